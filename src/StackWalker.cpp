@@ -89,6 +89,8 @@
 #include <windows.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <math.h>
+#include <assert.h>
 #include <new>
 
 #pragma comment(lib, "version.lib") // for "VerQueryValue"
@@ -198,6 +200,18 @@
 #undef OutputDebugString
 #endif
 
+#ifdef CreateFile
+#undef CreateFile
+#endif
+
+#ifdef GetFileAttributes
+#undef GetFileAttributes
+#endif
+
+#ifdef GetDriveType
+#undef GetDriveType
+#endif
+
 #ifdef __T
 #undef __T
 #endif
@@ -212,6 +226,8 @@
 #define sw_slen                 wcslen
 #define sw_scmp                 wcscmp
 #define sw_srchr                wcsrchr
+#define sw_snicmp               _wcsnicmp
+#define sw_sicmp                _wcsicmp
 #define GetModuleFileName       GetModuleFileNameW
 #define GetUserName             GetUserNameW
 #define GetVersionEx            GetVersionExW
@@ -221,12 +237,17 @@
 #define GetCurrentDirectory     GetCurrentDirectoryW
 #define GetEnvironmentVariable  GetEnvironmentVariableW
 #define OutputDebugString       OutputDebugStringW
+#define CreateFile              CreateFileW
+#define GetFileAttributes       GetFileAttributesW
+#define GetDriveType            GetDriveTypeW
 #else
 #define __T(x)      x
 #define sw_sdup                 _strdup
 #define sw_slen                 strlen
 #define sw_scmp                 strcmp
 #define sw_srchr                strrchr
+#define sw_snicmp               _strnicmp
+#define sw_sicmp                _stricmp
 #define GetModuleFileName       GetModuleFileNameA
 #define GetUserName             GetUserNameA
 #define GetVersionEx            GetVersionExA
@@ -236,6 +257,9 @@
 #define GetCurrentDirectory     GetCurrentDirectoryA
 #define GetEnvironmentVariable  GetEnvironmentVariableA
 #define OutputDebugString       OutputDebugStringA
+#define CreateFile              CreateFileA
+#define GetFileAttributes       GetFileAttributesA
+#define GetDriveType            GetDriveTypeA
 #endif // STKWLK_ANSI 
 
 #define _T(x)       __T(x)
@@ -389,6 +413,65 @@ static errno_t MyPathCat(LPWSTR path, size_t capacity, LPCWSTR addon, bool isDir
   return 0;
 }
 
+static bool SymPathContains(SW_CSTR symPath, SW_CSTR item, size_t len) STKWLK_NOEXCEPT
+{
+  for (SW_CSTR p = symPath; *p; )
+  {
+    SW_CSTR end = p;
+    while (*end && *end != ';')
+      end++;
+    if ((size_t)(end - p) == len && sw_snicmp(p, item, len) == 0)
+      return true;
+    p = *end ? end + 1 : end;
+  }
+  return false;
+}
+
+// Appends the ';'-separated entries to the symbol search path.
+// dbghelp probes every entry for each missing debug file, so duplicated entries are skipped.
+// checkExists: also skip not existing local directories (only for the generated entries,
+// the entries given by the user are added verbatim). Symbol servers (SRV*, CACHE*), network
+// shares and mapped network drives are added without checks, they can block for a long time.
+static void SymPathAdd(SW_STR symPath, size_t capacity, SW_CSTR entries, bool checkExists) STKWLK_NOEXCEPT
+{
+  SW_CHR item[1024];
+  while (entries != NULL && *entries)
+  {
+    SW_CSTR end = entries;
+    while (*end && *end != ';')
+      end++;
+    size_t len = end - entries;
+    if (len > 0 && !SymPathContains(symPath, entries, len))
+    {
+      bool add = true;
+      if (checkExists && len < _countof(item))
+      {
+        memcpy(item, entries, len * sizeof(SW_CHR));
+        item[len] = 0;
+        bool isLocal = (sw_srchr(item, '*') == NULL) && !(item[0] == '\\' && item[1] == '\\');
+        if (isLocal && item[0] != 0 && item[1] == ':')
+        {
+          SW_CHR root[4] = { item[0], ':', '\\', 0 };
+          isLocal = (GetDriveType(root) != DRIVE_REMOTE);
+        }
+        if (isLocal)
+        {
+          DWORD attr = GetFileAttributes(item);
+          add = (attr != INVALID_FILE_ATTRIBUTES) && (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        }
+      }
+      size_t pos = sw_slen(symPath);
+      if (add && pos + len + 1 < capacity)
+      {
+        memcpy(symPath + pos, entries, len * sizeof(SW_CHR));
+        symPath[pos + len] = ';';
+        symPath[pos + len + 1] = 0;
+      }
+    }
+    entries = *end ? end + 1 : end;
+  }
+}
+
 // ===========================================================================================
 
 static HMODULE LoadDbgHelpLib(bool prefixIsDir, LPCWSTR prefix, LPCWSTR path) STKWLK_NOEXCEPT
@@ -591,6 +674,95 @@ struct DbgHelpLib
   }
 };
 
+static int __cdecl CompareAddr(const void * a, const void * b)
+{
+  DWORD64 x = *(const DWORD64 *)a;
+  DWORD64 y = *(const DWORD64 *)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// index of the last item <= addr in the sorted array (branchless binary search)
+static int FindAddr(const DWORD64 * sorted, int count, DWORD64 addr) STKWLK_NOEXCEPT
+{
+  const DWORD64 * base = sorted;
+  int n = count;
+  while (n > 1)
+  {
+    int half = n / 2;
+    base = (base[half] <= addr) ? base + half : base;
+    n -= half;
+  }
+  return (int)(base - sorted);
+}
+
+// Lock of the process-wide static state: needs no initialization (usable from a vectored
+// exception handler and in any order of the static constructors), held only briefly.
+static void SpinLock(LONG volatile * lock) STKWLK_NOEXCEPT
+{
+  while (InterlockedExchange(lock, 1) != 0)
+    SwitchToThread();
+}
+
+static void SpinUnlock(LONG volatile * lock) STKWLK_NOEXCEPT
+{
+  InterlockedExchange(lock, 0);
+}
+
+// ===========================================================================================
+// DLL notifications of the current process (option NotifyModules, Vista+). The callback runs
+// under the loader lock, so it only counts the loaded and unloaded DLLs; the next walk enumerates
+// the modules again only if the counter was changed.
+
+typedef VOID (CALLBACK * TLdrDllNotification)(ULONG reason, const void * data, PVOID context);
+typedef LONG (NTAPI * TLdrRegisterDllNotification)(ULONG flags, TLdrDllNotification func, PVOID context, PVOID * cookie);
+typedef LONG (NTAPI * TLdrUnregisterDllNotification)(PVOID cookie);
+
+static LONG volatile  g_dllChanges = 0;
+static LONG volatile  g_dllNotifyLock = 0;
+static LONG volatile  g_dllNotifyState = 0;    // 0 - not registered, 2 - registered, 3 - not available
+static PVOID          g_dllNotifyCookie = NULL;
+
+static VOID CALLBACK DllNotification(ULONG reason, const void * data, PVOID context)
+{
+  InterlockedIncrement(&g_dllChanges);
+}
+
+static void __cdecl DllNotifyAtExit()
+{
+  HMODULE hNtdll = GetModuleHandleW(L"ntdll");
+  TLdrUnregisterDllNotification pUnregister = (TLdrUnregisterDllNotification) GetProcAddress(hNtdll, "LdrUnregisterDllNotification");
+  if (pUnregister != NULL && g_dllNotifyCookie != NULL)
+    pUnregister(g_dllNotifyCookie);
+  g_dllNotifyCookie = NULL;
+  InterlockedExchange(&g_dllNotifyState, 3);
+}
+
+// returns false if the notifications are not available
+static bool DllNotifyRegister() STKWLK_NOEXCEPT
+{
+  if (g_dllNotifyState != 0)
+    return g_dllNotifyState == 2;
+  SpinLock(&g_dllNotifyLock);
+  if (g_dllNotifyState == 0)
+  {
+    HMODULE hNtdll = GetModuleHandleW(L"ntdll");
+    TLdrRegisterDllNotification pRegister = (hNtdll == NULL) ? NULL :
+        (TLdrRegisterDllNotification) GetProcAddress(hNtdll, "LdrRegisterDllNotification");
+    LONG state = 3;
+    if (pRegister != NULL && pRegister(0, DllNotification, NULL, &g_dllNotifyCookie) == 0)
+    {
+      // the callback must not outlive this module
+      if (atexit(DllNotifyAtExit) == 0)
+        state = 2;
+      else
+        DllNotifyAtExit();
+    }
+    InterlockedExchange(&g_dllNotifyState, state);
+  }
+  SpinUnlock(&g_dllNotifyLock);
+  return g_dllNotifyState == 2;
+}
+
 // ===========================================================================================
 
 class StackWalkerInternal
@@ -601,6 +773,11 @@ public:
     m_parent = parent;
     InitializeCriticalSection(&m_critsec);
     m_options = options;
+    m_shareOptions = options;
+    m_shareProcessId = 0;
+    m_shareProcess = NULL;
+    m_shareSymPath = NULL;
+    m_nextShared = NULL;
     m_MaxRecursionCount = 1000;
     m_szSymPath = NULL;
     m_szDbgHelpPath = NULL;
@@ -609,9 +786,41 @@ public:
     m_dwProcessId = 0;
     m_SymInitialized = false;
     m_modListSize = 0;
+    memset(&m_liveModules, 0, sizeof(m_liveModules));
+    m_dllChanges = 0;
+    m_mapBases = NULL;
+    m_mapSizes = NULL;
+    m_mapCount = 0;
+    m_mapGeneration = 0;
+    m_modFilters = NULL;
+    m_dropRanges = NULL;
+    m_slotActions = NULL;
+    FrameFiltersFree();
     ResetLoadModules();
     m_IHM64Version = 0;      // unknown version
     m_pUserData = NULL;
+    m_pSnapshot = NULL;
+    m_snapImages = NULL;
+    m_asyncItems = NULL;
+    m_asyncMask = 0;
+    m_asyncHead = 0;
+    m_asyncTail = 0;
+    m_asyncPending = 0;
+    m_asyncPushers = 0;
+    m_asyncDrops = 0;
+    m_asyncStop = 0;
+    m_asyncSem = NULL;
+    m_asyncIdle = NULL;
+    m_asyncThreads = NULL;
+    m_asyncThreadsCount = 0;
+    m_symCache = NULL;
+    m_symCacheOldest = NULL;
+    m_symCacheNewest = NULL;
+    m_symCacheSize = 0;
+    m_symCacheMax = 0;
+    m_strPool = NULL;
+    memset(m_modInfo, 0, sizeof(m_modInfo));
+    ResetStats();
     memset(&Sym, 0, sizeof(Sym));
     m_ctx.ContextFlags = 0;
     if (ctx != NULL)
@@ -620,20 +829,77 @@ public:
 
   ~StackWalkerInternal() STKWLK_NOEXCEPT
   {
+    StopAsync(false);
     UnloadDbgHelpLib();
-    m_parent->SetSymPath(NULL);
-    m_parent->SetDbgHelpPath(NULL);
+    free(m_symCache);
+    free(m_strPool);
+    FrameFiltersFree();
+    ModuleMapFree();
+    free((LPVOID)m_szSymPath);
+    free((LPVOID)m_szDbgHelpPath);
+    free((LPVOID)m_shareSymPath);
     DeleteCriticalSection(&m_critsec);
     m_parent = NULL;
   }
 
+  // prepare an idle engine from the shared pool for a new walker
+  void Reuse(StackWalkerBase * parent, PCONTEXT ctx) STKWLK_NOEXCEPT
+  {
+    m_parent = parent;
+    m_nextShared = NULL;
+    m_MaxRecursionCount = 1000;
+    m_pUserData = NULL;
+    m_pSnapshot = NULL;
+    m_showLoadModules = false;
+    m_asyncDrops = 0;
+    SymCacheSetMax(0);       // disabled until the new walker sets its own budget
+    FrameFiltersFree();
+    ResetStats();
+    m_ctx.ContextFlags = 0;
+    if (ctx != NULL)
+      m_ctx = *ctx;
+  }
+
+  // The key of the shared pool is fixed at construction, the setters may change the engine later
+  void ShareKeySet(DWORD dwProcessId, HANDLE hProcess, SW_CSTR szSymPath) STKWLK_NOEXCEPT
+  {
+    m_shareProcessId = dwProcessId;
+    m_shareProcess = hProcess;
+    m_shareSymPath = (szSymPath == NULL) ? NULL : (SW_CSTR) sw_sdup(szSymPath);
+  }
+
+  static bool SymPathEqual(SW_CSTR a, SW_CSTR b) STKWLK_NOEXCEPT
+  {
+    if (a == NULL || b == NULL)
+      return a == b;
+    return sw_scmp(a, b) == 0;
+  }
+
+  bool ShareKeyMatches(int options, SW_CSTR szSymPath, DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
+  {
+    return m_shareOptions == options && m_shareProcessId == dwProcessId && m_shareProcess == hProcess &&
+           SymPathEqual(m_shareSymPath, szSymPath);
+  }
+
+  // Only an engine in the state of its construction can be pooled. A non isolated dbghelp has
+  // one session per process, which the SymCleanup of any other walker tears down.
+  bool IsShareable() STKWLK_NOEXCEPT
+  {
+    if (m_SymInitialized == false || m_dh.m_DbgHelp.hLib == NULL || m_szDbgHelpPath != NULL)
+      return false;
+    return m_dwProcessId == m_shareProcessId && m_hProcess == m_shareProcess &&
+           SymPathEqual(m_szSymPath, m_shareSymPath);
+  }
+
   void UnloadDbgHelpLib() STKWLK_NOEXCEPT
   {
+    SymCacheClear();
     if (m_hDbhHelp != NULL && m_SymInitialized != false && Sym.Cleanup != NULL)
       Sym.Cleanup(m_hProcess);
     memset(&Sym, 0, sizeof(Sym));
     m_SymInitialized = false;
     ResetLoadModules();
+    ModuleListFree(m_liveModules);
     if (m_hDbhHelp == NULL)
       return;
     FreeLibrary(m_hDbhHelp);
@@ -776,6 +1042,7 @@ public:
     GetProcAddrEx(fcnt, m_hDbhHelp, "SymLoadModuleEx", (LPVOID*)&Sym.LoadModuleEx);
     GetProcAddrEx(fcnt, m_hDbhHelp, "SymFromAddr", (LPVOID*)&Sym.FromAddr);
 #endif
+    GetProcAddrEx(fcnt, m_hDbhHelp, "MiniDumpWriteDump", (LPVOID*)&Sym.MiniDumpWriteDump);
 
     m_SymInitialized = !!Sym.Initialize(m_hProcess, szSymPath, FALSE);
     if (m_SymInitialized == false)
@@ -809,8 +1076,13 @@ public:
     return true;
   }
 
-  StackWalkerBase * m_parent;
+  StackWalkerBase * m_parent;        // NULL while the engine is idle in the shared pool
   CRITICAL_SECTION  m_critsec;
+  int               m_shareOptions;    // options of the constructor (key of the shared pool)
+  DWORD             m_shareProcessId;  // target and symbol path of the constructor (the key too)
+  HANDLE            m_shareProcess;
+  SW_CSTR           m_shareSymPath;
+  StackWalkerInternal * m_nextShared;
   HANDLE            m_hProcess;
   DWORD             m_dwProcessId;
   CONTEXT           m_ctx;
@@ -829,6 +1101,8 @@ public:
   int     m_modListSize;       // number of list elements
   char    m_IHM64Version;      // actual version of IMAGEHLP_MODULE64 struct
   LPVOID  m_pUserData;
+  const StackWalkerBase::TSnapshot * m_pSnapshot;   // snapshot to be unwound (optional)
+  LPBYTE * m_snapImages;       // images of the snapshot modules (mapped on demand)
 
 #pragma pack(push, 8)
   struct IMAGEHLP_MODULE64_V2
@@ -943,6 +1217,14 @@ public:
                                     DWORD   Flags);
 
     BOOL (WINAPI * GetSearchPath)(HANDLE hProcess, SW_STR SearchPath, DWORD SearchPathLength);
+
+    BOOL (WINAPI * MiniDumpWriteDump)(HANDLE                            hProcess,
+                                      DWORD                             ProcessId,
+                                      HANDLE                            hFile,
+                                      MINIDUMP_TYPE                     DumpType,
+                                      PMINIDUMP_EXCEPTION_INFORMATION   ExceptionParam,
+                                      PMINIDUMP_USER_STREAM_INFORMATION UserStreamParam,
+                                      PMINIDUMP_CALLBACK_INFORMATION    CallbackParam);
   } Sym;
 
   DWORD64 SymLoadModule(HANDLE hProcess, HANDLE hFile, SW_CSTR ImageName, SW_CSTR ModuleName,
@@ -984,7 +1266,7 @@ public:
 #ifdef STKWLK_ANSI
     if (Sym.GetSymFromAddr != NULL)
     {
-      memset(&sym, 0, sizeof(sym));
+      memset(&sym.baseinf, 0, sizeof(sym.baseinf));
       sym.baseinf.SizeOfStruct = sizeof(sym.baseinf);
       sym.baseinf.MaxNameLength = _countof(sym._buffer);
       BOOL rc = Sym.GetSymFromAddr(hProcess, Address, pdwDisplacement, &sym.baseinf);
@@ -996,370 +1278,1649 @@ public:
     return NULL;
   }
 
-private:
-// **************************************** ToolHelp32 ************************
-#define MAX_MODULE_NAME32 255
-#define TH32CS_SNAPMODULE 0x00000008
-#pragma pack(push, 8)
-  typedef struct tagMODULEENTRY32
+  // **************************************** MiniDump ************************
+  typedef struct _TMiniDumpParam
   {
-    DWORD   dwSize;
-    DWORD   th32ModuleID;  // This module
-    DWORD   th32ProcessID; // owning process
-    DWORD   GlblcntUsage;  // Global usage count on the module
-    DWORD   ProccntUsage;  // Module usage count in th32ProcessID's context
-    BYTE*   modBaseAddr;   // Base address of module in th32ProcessID's context
-    DWORD   modBaseSize;   // Size in bytes of module starting at modBaseAddr
-    HMODULE hModule;       // The hModule of this module in th32ProcessID's context
-    SW_CHR  szModule[MAX_MODULE_NAME32 + 1];
-    SW_CHR  szExePath[MAX_PATH];
-  } MODULEENTRY32;
-  typedef MODULEENTRY32* PMODULEENTRY32;
-  typedef MODULEENTRY32* LPMODULEENTRY32;
-#pragma pack(pop)
-
-  int GetModuleListTH32(HANDLE hProcess, DWORD pid) STKWLK_NOEXCEPT
+    DWORD      dwMaxStackSize;
+    ULONG64  * ranges;          // pairs of (base, size) for truncated stacks
+    int        rangesCount;
+    int        rangesCapacity;
+    int        rangesPos;       // next range for MemoryCallback
+  } TMiniDumpParam;
+
+  static bool MiniDumpAddRange(TMiniDumpParam * mdp, ULONG64 base, ULONG64 size) STKWLK_NOEXCEPT
   {
-    // try both dlls...
-    LPCWSTR      dllname[] = { L"kernel32.dll", L"tlhelp32.dll" };
-    HINSTANCE    hToolhelp = NULL;
-    HANDLE (WINAPI * CreateTH32Snapshot)(DWORD dwFlags, DWORD th32ProcessID);
-    BOOL (WINAPI * Module32First)(HANDLE hSnapshot, LPMODULEENTRY32 lpme);
-    BOOL (WINAPI * Module32Next)(HANDLE hSnapshot, LPMODULEENTRY32 lpme);
-    HANDLE        hSnap;
-    MODULEENTRY32 me;
-    me.dwSize = sizeof(me);
-
-    for (size_t i = 0; i < _countof(dllname); i++)
+    if (mdp->rangesCount >= mdp->rangesCapacity)
     {
-      hToolhelp = LoadLibraryW(dllname[i]);
-      if (hToolhelp == NULL)
-        continue;
-      int fcnt = 0;
-      GetProcAddrEx(fcnt, hToolhelp, "CreateToolhelp32Snapshot", (LPVOID*)&CreateTH32Snapshot);
-#ifndef STKWLK_ANSI
-      GetProcAddrEx(fcnt, hToolhelp, "Module32FirstW", (LPVOID*)&Module32First);
-      GetProcAddrEx(fcnt, hToolhelp, "Module32NextW", (LPVOID*)&Module32Next);
-#else
-      GetProcAddrEx(fcnt, hToolhelp, "Module32First", (LPVOID*)&Module32First);
-      GetProcAddrEx(fcnt, hToolhelp, "Module32Next", (LPVOID*)&Module32Next);
-#endif
-      if (fcnt == 3)
-        break; // found the functions!
-      FreeLibrary(hToolhelp);
-      hToolhelp = NULL;
+      int cap = mdp->rangesCapacity ? mdp->rangesCapacity * 2 : 64;
+      ULONG64 * ranges = (ULONG64 *) realloc(mdp->ranges, cap * 2 * sizeof(ULONG64));
+      if (ranges == NULL)
+        return false;
+      mdp->ranges = ranges;
+      mdp->rangesCapacity = cap;
     }
+    mdp->ranges[mdp->rangesCount * 2 + 0] = base;
+    mdp->ranges[mdp->rangesCount * 2 + 1] = size;
+    mdp->rangesCount++;
+    return true;
+  }
 
-    if (hToolhelp == NULL)
-      return -1;
-
-    hSnap = CreateTH32Snapshot(TH32CS_SNAPMODULE, pid);
-    if (hSnap == (HANDLE)-1)
+  static BOOL CALLBACK MiniDumpCallback(PVOID                          CallbackParam,
+                                        const PMINIDUMP_CALLBACK_INPUT CallbackInput,
+                                        PMINIDUMP_CALLBACK_OUTPUT      CallbackOutput) STKWLK_NOEXCEPT
+  {
+    TMiniDumpParam * mdp = (TMiniDumpParam *)CallbackParam;
+    if (mdp == NULL || CallbackInput == NULL || CallbackOutput == NULL)
+      return FALSE;
+    switch (CallbackInput->CallbackType)
     {
-      FreeLibrary(hToolhelp);
-      return -2;
+    case IncludeModuleCallback:
+    case IncludeThreadCallback:
+    case ModuleCallback:
+      return TRUE;
+    case ThreadCallback:
+    case ThreadExCallback:
+      {
+        // StackBase/StackEnd are the same for both thread structures
+        ULONG64 lo = CallbackInput->Thread.StackBase;
+        ULONG64 hi = CallbackInput->Thread.StackEnd;
+        if (lo > hi)
+        {
+          ULONG64 tmp = lo; lo = hi; hi = tmp;
+        }
+        if (mdp->dwMaxStackSize == 0 || hi - lo <= mdp->dwMaxStackSize)
+          return TRUE;
+        // save only the top part of the stack instead of the whole one
+        if (MiniDumpAddRange(mdp, lo, mdp->dwMaxStackSize))
+          CallbackOutput->ThreadWriteFlags &= ~ThreadWriteStack;
+        return TRUE;
+      }
+    case MemoryCallback:
+      if (mdp->rangesPos >= mdp->rangesCount)
+        return FALSE;   // no more memory regions
+      CallbackOutput->MemoryBase = mdp->ranges[mdp->rangesPos * 2 + 0];
+      CallbackOutput->MemorySize = (ULONG)mdp->ranges[mdp->rangesPos * 2 + 1];
+      mdp->rangesPos++;
+      return TRUE;
     }
+    return FALSE;
+  }
 
-    bool keepGoing = !!Module32First(hSnap, &me);
-    int cnt = 0;
-    while (keepGoing)
+  bool WriteMiniDump(LPCWSTR szDumpFile, PEXCEPTION_POINTERS exp, DWORD dwMaxStackSize) STKWLK_NOEXCEPT
+  {
+    if (Sym.MiniDumpWriteDump == NULL)
     {
-      DWORD rc = this->LoadModule(hProcess, me.szExePath, me.szModule, (DWORD64)me.modBaseAddr,
-                                  me.modBaseSize);
-      if (rc == ERROR_SUCCESS)
-        cnt++;
-      keepGoing = !!Module32Next(hSnap, &me);
+      this->OnDbgHelpErr(_T("MiniDumpWriteDump"), ERROR_PROC_NOT_FOUND);
+      return false;
     }
-    CloseHandle(hSnap);
-    FreeLibrary(hToolhelp);
-    return cnt;
-  } // GetModuleListTH32
+    // dbghelp writes the dump directly into the file, so no intermediate buffers are used here
+    HANDLE hFile = CreateFileW(szDumpFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+      this->OnDbgHelpErr(_T("CreateFile"), GetLastError());
+      return false;
+    }
+    TMiniDumpParam mdp;
+    memset(&mdp, 0, sizeof(mdp));
+    mdp.dwMaxStackSize = dwMaxStackSize;
+    MINIDUMP_CALLBACK_INFORMATION cbinfo;
+    cbinfo.CallbackRoutine = (MINIDUMP_CALLBACK_ROUTINE)MiniDumpCallback;
+    cbinfo.CallbackParam = &mdp;
+    MINIDUMP_EXCEPTION_INFORMATION expinfo;
+    expinfo.ThreadId = GetCurrentThreadId();
+    expinfo.ExceptionPointers = exp;
+    expinfo.ClientPointers = FALSE;
+    BOOL rc = Sym.MiniDumpWriteDump(m_hProcess, m_dwProcessId, hFile, MiniDumpNormal,
+                                    exp ? &expinfo : NULL, NULL, &cbinfo);
+    DWORD gle = GetLastError();
+    CloseHandle(hFile);
+    free(mdp.ranges);
+    if (rc == FALSE)
+    {
+      this->OnDbgHelpErr(_T("MiniDumpWriteDump"), gle);
+      DeleteFileW(szDumpFile);
+      return false;
+    }
+    return true;
+  }
 
-  // **************************************** PSAPI ************************
-  typedef struct _MODULEINFO
+  // **************************************** Statistics ************************
+  // All phases are executed under m_critsec, so the counters need no interlocked operations
+  ULONGLONG m_statCount[StackWalkerBase::StatPhasesCount];
+  ULONGLONG m_statTicks[StackWalkerBase::StatPhasesCount];
+
+  void ResetStats() STKWLK_NOEXCEPT
   {
-    LPVOID lpBaseOfDll;
-    DWORD  SizeOfImage;
-    LPVOID EntryPoint;
-  } MODULEINFO, *LPMODULEINFO;
+    memset(m_statCount, 0, sizeof(m_statCount));
+    memset(m_statTicks, 0, sizeof(m_statTicks));
+  }
 
-  typedef struct _SW_MODULE_INFO
+  void StatBegin(LARGE_INTEGER & start) STKWLK_NOEXCEPT
   {
-    HMODULE   hMods[1024];
-    SW_CHR    szImgName[2048];
-    SW_CHR    szModName[2048];
-  } SW_MODULE_INFO, *PSW_MODULE_INFO;
+    if ((m_options & StackWalkerBase::CollectStats) != 0)
+      QueryPerformanceCounter(&start);
+  }
 
-  int GetModuleListPSAPI(HANDLE hProcess) STKWLK_NOEXCEPT
+  void StatEnd(int phase, const LARGE_INTEGER & start) STKWLK_NOEXCEPT
   {
-    HINSTANCE hPsapi;
-    BOOL  (WINAPI * EnumProcessModules)(HANDLE hProcess, HMODULE * lphModule, DWORD cb, LPDWORD lpcbNeeded);
-    DWORD (WINAPI * GetModuleFileNameEx)(HANDLE hProcess, HMODULE hModule, SW_STR lpFilename, DWORD nSize);
-    DWORD (WINAPI * GetModuleBaseName)(HANDLE hProcess, HMODULE hModule, SW_STR lpFilename, DWORD nSize);
-    BOOL  (WINAPI * GetModuleInformation)(HANDLE hProcess, HMODULE hModule, LPMODULEINFO pmi, DWORD nSize);
+    if ((m_options & StackWalkerBase::CollectStats) != 0)
+    {
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+      m_statCount[phase]++;
+      m_statTicks[phase] += (ULONGLONG)(now.QuadPart - start.QuadPart);
+    }
+  }
 
-    MODULEINFO       mi;
-    SW_MODULE_INFO * mList = NULL;
-    DWORD            mListSize = 0;
-    size_t           mNumbers;
-    size_t           i;
-    int              cnt = -1;
+  void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    LARGE_INTEGER t;
+    StatBegin(t);
+    m_parent->OnCallstackEntry(entry);
+    StatEnd(StackWalkerBase::StatOutput, t);
+  }
 
-    hPsapi = LoadLibraryW(L"psapi.dll");
-    if (hPsapi == NULL)
-      return -1;
+  // **************************************** String pool ************************
+  // Module and source file names are interned: every distinct name is copied once and shared
+  // by all the frames and symbol cache items which refer to it. The pool is released together
+  // with the symbol cache.
+  typedef struct _TStrPoolItem
+  {
+    struct _TStrPoolItem * next;
+    DWORD                  hash;
+    SW_CHR                 str[1];
+  } TStrPoolItem;
 
-    int fcnt = 0;
-    GetProcAddrEx(fcnt, hPsapi, "EnumProcessModules", (LPVOID*)&EnumProcessModules);
-    GetProcAddrEx(fcnt, hPsapi, "GetModuleInformation", (LPVOID*)&GetModuleInformation);
-#ifndef STKWLK_ANSI
-    GetProcAddrEx(fcnt, hPsapi, "GetModuleFileNameExW", (LPVOID*)&GetModuleFileNameEx);
-    GetProcAddrEx(fcnt, hPsapi, "GetModuleBaseNameW", (LPVOID*)&GetModuleBaseName);
-#else
-    GetProcAddrEx(fcnt, hPsapi, "GetModuleFileNameExA", (LPVOID*)&GetModuleFileNameEx);
-    GetProcAddrEx(fcnt, hPsapi, "GetModuleBaseNameA", (LPVOID*)&GetModuleBaseName);
-#endif
-    if (fcnt < 4)
-      goto cleanup;  // we couldn't find all functions
+  enum { StrPoolBuckets = 512 };
 
-    mList = (SW_MODULE_INFO*) malloc(sizeof(SW_MODULE_INFO));
-    if (mList == NULL)
-      goto cleanup;
+  TStrPoolItem ** m_strPool;
 
-    if (!EnumProcessModules(hProcess, mList->hMods, sizeof(mList->hMods), &mListSize))
-      goto cleanup;
+  static DWORD StrPoolHash(SW_CSTR str, size_t & len) STKWLK_NOEXCEPT
+  {
+    DWORD hash = 2166136261U;   // FNV-1a
+    for (len = 0; str[len] != 0; len++)
+      hash = (hash ^ (DWORD)str[len]) * 16777619U;
+    return hash;
+  }
 
-    if (mListSize > sizeof(mList->hMods))
-      goto cleanup;
+  // returns NULL if out of memory
+  SW_CSTR StrPoolIntern(SW_CSTR str) STKWLK_NOEXCEPT
+  {
+    size_t len;
+    if (str == NULL)
+      return NULL;
+    if (m_strPool == NULL)
+    {
+      m_strPool = (TStrPoolItem **) calloc(StrPoolBuckets, sizeof(TStrPoolItem *));
+      if (m_strPool == NULL)
+        return NULL;
+    }
+    DWORD hash = StrPoolHash(str, len);
+    TStrPoolItem ** bucket = &m_strPool[hash & (StrPoolBuckets - 1)];
+    for (TStrPoolItem * item = *bucket; item != NULL; item = item->next)
+      if (item->hash == hash && sw_scmp(item->str, str) == 0)
+        return item->str;
+    TStrPoolItem * item = (TStrPoolItem *) malloc(sizeof(TStrPoolItem) + len * sizeof(SW_CHR));
+    if (item == NULL)
+      return NULL;
+    item->hash = hash;
+    memcpy(item->str, str, (len + 1) * sizeof(SW_CHR));
+    item->next = *bucket;
+    *bucket = item;
+    return item->str;
+  }
 
-    cnt = 0;
-    mNumbers = (size_t)mListSize / sizeof(mList->hMods[0]);
-    if (mNumbers < 2)
-      goto cleanup;
+  bool StrPoolOwns(SW_CSTR str) STKWLK_NOEXCEPT
+  {
+    size_t len;
+    if (str == NULL || m_strPool == NULL)
+      return false;
+    DWORD hash = StrPoolHash(str, len);
+    for (TStrPoolItem * item = m_strPool[hash & (StrPoolBuckets - 1)]; item != NULL; item = item->next)
+      if (item->str == str)
+        return true;
+    return false;
+  }
 
-    for (i = 0; i < mNumbers; i++)
+  void StrPoolClear() STKWLK_NOEXCEPT
+  {
+    if (m_strPool == NULL)
+      return;
+    for (int i = 0; i < StrPoolBuckets; i++)
     {
-      HMODULE hMod = mList->hMods[i];
-      // base address, size
-      GetModuleInformation(hProcess, hMod, &mi, sizeof(mi));
-      // image file name
-      mList->szImgName[0] = 0;
-      GetModuleFileNameEx(hProcess, hMod, mList->szImgName, _countof(mList->szImgName) - 1);
-      // module name
-      mList->szModName[0] = 0;
-      GetModuleBaseName(hProcess, hMod, mList->szModName, _countof(mList->szModName) - 1);
+      while (m_strPool[i] != NULL)
+      {
+        TStrPoolItem * item = m_strPool[i];
+        m_strPool[i] = item->next;
+        free(item);
+      }
+    }
+  }
 
-      DWORD dwRes = this->LoadModule(hProcess, mList->szImgName, mList->szModName,
-                                    (DWORD64)mi.lpBaseOfDll, mi.SizeOfImage);
-      if (dwRes != ERROR_SUCCESS)
-        this->OnDbgHelpErr(_T("LoadModule"), dwRes);
-      else
-        cnt++;
-    }
+  // **************************************** Module info cache ************************
+  // SymGetModuleInfo64 fills a 4 KB structure, so it is called once per module and only the
+  // interned names are kept.
+  typedef struct _TModInfoItem
+  {
+    struct _TModInfoItem * next;
+    DWORD64                baseOfImage;
+    SW_CSTR                symTypeString;
+    SW_CSTR                moduleName;
+    SW_CSTR                loadedImageName;
+  } TModInfoItem;
 
-  cleanup:
-    if (hPsapi != NULL)
-      FreeLibrary(hPsapi);
-    if (mList != NULL)
-      free(mList);
+  enum { ModInfoBuckets = 64 };
 
-    return cnt;
-  } // GetModuleListPSAPI
+  TModInfoItem * m_modInfo[ModInfoBuckets];
 
-  DWORD LoadModule(HANDLE hProcess, SW_CSTR img, SW_CSTR mod, DWORD64 baseAddr, DWORD size) STKWLK_NOEXCEPT
+  static size_t ModInfoHash(DWORD64 base) STKWLK_NOEXCEPT
   {
-    DWORD result = ERROR_SUCCESS;
-    TFileVer fileVersion;
-
-    if (img == NULL)
-      return ERROR_BAD_ARGUMENTS;
-
-    if (this->m_parent == NULL)
-      return ERROR_DS_NO_PARENT_OBJECT;
+    return (size_t)(base >> 16) & (ModInfoBuckets - 1);   // modules are 64 KB aligned
+  }
 
-    if (SymLoadModule(hProcess, NULL, img, mod, baseAddr, size) == 0)
+  void ModInfoClear() STKWLK_NOEXCEPT
+  {
+    for (int i = 0; i < ModInfoBuckets; i++)
     {
-      result = GetLastError();
-      if (result == ERROR_SUCCESS)
-        result = ERROR_DS_SCHEMA_NOT_LOADED;
+      while (m_modInfo[i] != NULL)
+      {
+        TModInfoItem * item = m_modInfo[i];
+        m_modInfo[i] = item->next;
+        free(item);
+      }
     }
-    // Retrieve some additional-infos about the module
-    T_IMAGEHLP_MODULE64 Module;
-    SW_CSTR szSymType = _T("-unknown-");
-    if (this->GetModuleInfo(hProcess, baseAddr, Module) != false)
-      szSymType = GetSymTypeNameById(Module.SymType);
+  }
 
-    if (m_showLoadModules == true)
+  void ModInfoRemove(DWORD64 baseAddr) STKWLK_NOEXCEPT
+  {
+    for (TModInfoItem ** pp = &m_modInfo[ModInfoHash(baseAddr)]; *pp != NULL; pp = &(*pp)->next)
     {
-      // try to retrieve the file-version:
-      if ((this->m_options & StackWalkerBase::RetrieveFileVersion) != 0)
+      TModInfoItem * item = *pp;
+      if (item->baseOfImage == baseAddr)
       {
-        GetFileVersion(img, fileVersion);
+        *pp = item->next;
+        free(item);
+        return;
       }
-      StackWalkerBase::TLoadModule data;
-      data.imgName = img;
-      data.modName = mod;
-      data.baseAddr = baseAddr;
-      data.size = size;
-      data.result = result;
-      data.symType = szSymType;
-      data.pdbName = Module.LoadedPdbName[0] ? Module.LoadedPdbName : Module.LoadedImageName;
-      data.ver = fileVersion;
-      this->m_parent->OnLoadModule(data);
     }
-    return result;
   }
 
-public:
-  typedef StackWalkerBase::TFileVer  TFileVer;
-  typedef StackWalkerBase::TCallstackEntry     TCallstackEntry;
-  typedef StackWalkerBase::PReadMemRoutine     PReadMemRoutine;
+  // **************************************** Symbol cache ************************
+  // Resolved frames keyed by address, evicted in LRU order when the byte budget is
+  // exceeded. The symbol names of the entry are stored right after the item, the module and
+  // file names are shared from the string pool.
+  typedef struct _TSymCacheItem
+  {
+    struct _TSymCacheItem * next;     // hash chain
+    struct _TSymCacheItem * older;    // LRU list
+    struct _TSymCacheItem * newer;
+    size_t                  size;     // size of the item including the strings
+    DWORD                   errSym;   // failed lookups, reported again on every hit
+    DWORD                   errLine;
+    TCallstackEntry         entry;
+  } TSymCacheItem;
+
+  enum { SymCacheBuckets = 1024 };
+
+  TSymCacheItem ** m_symCache;
+  TSymCacheItem *  m_symCacheOldest;
+  TSymCacheItem *  m_symCacheNewest;
+  size_t           m_symCacheSize;
+  size_t           m_symCacheMax;
+
+  static size_t SymCacheHash(DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    return (size_t)((addr * (DWORD64)0x9E3779B97F4A7C15) >> 54) & (SymCacheBuckets - 1);
+  }
 
-  bool GetFileVersion(SW_CSTR filename, TFileVer & ver, VS_FIXEDFILEINFO * vinfo = NULL) STKWLK_NOEXCEPT
+  void SymCacheUnlinkLRU(TSymCacheItem * item) STKWLK_NOEXCEPT
   {
-    bool result = false;
-    BYTE buffer[2048];
-    LPVOID vData = (LPVOID)buffer;
-    VS_FIXEDFILEINFO * fInfo = NULL;
-    ver.zeroinit();
-    DWORD dwHandle = 0;
-    DWORD dwSize = GetFileVersionInfoSize(filename, &dwHandle);
-    if (dwSize == 0 || dwSize > 256 * 1024)
-      return false;
-    if (dwSize >= sizeof(buffer))
-    {
-      vData = malloc(dwSize);
-      if (vData == NULL)
-        return false;
-    }
-    if (GetFileVersionInfo(filename, dwHandle, dwSize, vData) != 0)
+    if (item->older)
+      item->older->newer = item->newer;
+    else
+      m_symCacheOldest = item->newer;
+    if (item->newer)
+      item->newer->older = item->older;
+    else
+      m_symCacheNewest = item->older;
+  }
+
+  void SymCacheLinkLRU(TSymCacheItem * item) STKWLK_NOEXCEPT
+  {
+    item->older = m_symCacheNewest;
+    item->newer = NULL;
+    if (m_symCacheNewest)
+      m_symCacheNewest->newer = item;
+    else
+      m_symCacheOldest = item;
+    m_symCacheNewest = item;
+  }
+
+  void SymCacheRemove(TSymCacheItem * item) STKWLK_NOEXCEPT
+  {
+    TSymCacheItem ** pp = &m_symCache[SymCacheHash(item->entry.offset)];
+    while (*pp != item)
+      pp = &(*pp)->next;
+    *pp = item->next;
+    SymCacheUnlinkLRU(item);
+    m_symCacheSize -= item->size;
+    free(item);
+  }
+
+  void SymCacheClear() STKWLK_NOEXCEPT
+  {
+    while (m_symCacheOldest)
+      SymCacheRemove(m_symCacheOldest);
+    ModInfoClear();
+    StrPoolClear();     // the items referred to the pooled strings
+  }
+
+  // Remove the entries of an unloaded module: another module may be loaded at its address
+  void SymCacheEvictModule(DWORD64 baseAddr, DWORD size) STKWLK_NOEXCEPT
+  {
+    TSymCacheItem * item = m_symCacheOldest;
+    while (item != NULL)
     {
-      UINT len = 0;
-      BOOL rc = VerQueryValue(vData, _T("\\"), (LPVOID*)&fInfo, &len);
-      if (rc != FALSE && fInfo != NULL && len > 0)
-      {
-        ver.wMajor = (WORD)(fInfo->dwFileVersionMS >> 16);
-        ver.wMinor = (WORD)fInfo->dwFileVersionMS;
-        ver.wBuild = (WORD)(fInfo->dwFileVersionLS >> 16);
-        ver.wRevis = (WORD)fInfo->dwFileVersionLS;
-        if (vinfo)
-          *vinfo = *fInfo;
-        result = true;
-      }
+      TSymCacheItem * next = item->newer;
+      if (item->entry.offset - baseAddr < size)
+        SymCacheRemove(item);
+      item = next;
     }
-    if (vData != buffer)
-      free(vData);
-    return result;
+    ModInfoRemove(baseAddr);
   }
 
-  bool LoadModules(HANDLE hProcess, DWORD dwProcessId) STKWLK_NOEXCEPT
+  void SymCacheSetMax(size_t maxBytes) STKWLK_NOEXCEPT
   {
-    m_modulesLoaded = false;
-    // first try toolhelp32
-    m_modulesNumber = GetModuleListTH32(hProcess, dwProcessId);
-    if (m_modulesNumber < 2)   // then try psapi
-      m_modulesNumber = GetModuleListPSAPI(hProcess);
-    if (m_modulesNumber < 2)
+    m_symCacheMax = maxBytes;
+    while (m_symCacheOldest && m_symCacheSize > m_symCacheMax)
+      SymCacheRemove(m_symCacheOldest);
+  }
+
+  bool SymCacheFind(DWORD64 addr, TCallstackEntry & entry, DWORD & errSym, DWORD & errLine) STKWLK_NOEXCEPT
+  {
+    if (m_symCache == NULL || m_symCacheMax == 0)
       return false;
-    m_modulesLoaded = true;
+    TSymCacheItem * item = m_symCache[SymCacheHash(addr)];
+    while (item && item->entry.offset != addr)
+      item = item->next;
+    if (item == NULL)
+      return false;
+    // the module may be unloaded and another one loaded in its place
+    if (Sym.GetModuleBase == NULL || Sym.GetModuleBase(m_hProcess, addr) != item->entry.baseOfImage)
+    {
+      SymCacheRemove(item);
+      return false;
+    }
+    SymCacheUnlinkLRU(item);
+    SymCacheLinkLRU(item);
+    entry = item->entry;
+    errSym = item->errSym;
+    errLine = item->errLine;
     return true;
   }
 
-  bool GetModuleInfo(HANDLE hProcess, DWORD64 baseAddr, T_IMAGEHLP_MODULE64 & modInfo) STKWLK_NOEXCEPT
+  static size_t SymCacheStrSize(SW_CSTR str) STKWLK_NOEXCEPT
   {
-    memset(&modInfo, 0, sizeof(modInfo));
-    if (Sym.GetModuleInfo == NULL)
+    return str ? (sw_slen(str) + 1) * sizeof(SW_CHR) : 0;
+  }
+
+  static SW_CSTR SymCacheStrCopy(LPBYTE & pos, SW_CSTR str) STKWLK_NOEXCEPT
+  {
+    if (str == NULL || pos == NULL)
+      return str;
+    size_t size = SymCacheStrSize(str);
+    memcpy(pos, str, size);
+    SW_CSTR res = (SW_CSTR)pos;
+    pos += size;
+    return res;
+  }
+
+  // size of the strings which are not shared from the pool
+  size_t SymCacheStrSizeNP(SW_CSTR str) STKWLK_NOEXCEPT
+  {
+    return StrPoolOwns(str) ? 0 : SymCacheStrSize(str);
+  }
+
+  size_t SymCacheItemSize(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    size_t size = sizeof(TSymCacheItem) + SymCacheStrSize(entry.name);
+    if (entry.undName != entry.name)
+      size += SymCacheStrSize(entry.undName);
+    if (entry.undFullName != entry.name)
+      size += SymCacheStrSize(entry.undFullName);
+    return size + SymCacheStrSizeNP(entry.lineFileName) + SymCacheStrSizeNP(entry.moduleName) +
+           SymCacheStrSizeNP(entry.loadedImageName);
+  }
+
+  // Copy of the entry with its own strings in one memory block (free with free())
+  TSymCacheItem * SymCacheNewItem(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    size_t size = SymCacheItemSize(entry);
+    TSymCacheItem * item = (TSymCacheItem *) malloc(size);
+    if (item == NULL)
+      return NULL;
+    memset(item, 0, sizeof(TSymCacheItem));
+    item->size = size;
+    item->entry = entry;
+    LPBYTE pos = (LPBYTE)(item + 1);
+    LPBYTE nopos = NULL;
+    item->entry.name = SymCacheStrCopy(pos, entry.name);
+    if (entry.undName == entry.name)
+      item->entry.undName = item->entry.name;
+    else
+      item->entry.undName = SymCacheStrCopy(pos, entry.undName);
+    if (entry.undFullName == entry.name)
+      item->entry.undFullName = item->entry.name;
+    else
+      item->entry.undFullName = SymCacheStrCopy(pos, entry.undFullName);
+    item->entry.lineFileName = SymCacheStrCopy(StrPoolOwns(entry.lineFileName) ? nopos : pos, entry.lineFileName);
+    item->entry.moduleName = SymCacheStrCopy(StrPoolOwns(entry.moduleName) ? nopos : pos, entry.moduleName);
+    item->entry.loadedImageName = SymCacheStrCopy(StrPoolOwns(entry.loadedImageName) ? nopos : pos, entry.loadedImageName);
+    // symTypeString points to a string literal
+    return item;
+  }
+
+  void SymCacheAdd(const TCallstackEntry & entry, DWORD errSym, DWORD errLine) STKWLK_NOEXCEPT
+  {
+    if (m_symCacheMax == 0)
+      return;
+    if (m_symCache == NULL)
     {
-      SetLastError(ERROR_DLL_INIT_FAILED);
-      return false;
+      m_symCache = (TSymCacheItem **) calloc(SymCacheBuckets, sizeof(TSymCacheItem *));
+      if (m_symCache == NULL)
+        return;
     }
-    // First try to use the larger ModuleInfo-Structure
-    if (m_IHM64Version == 0 || m_IHM64Version == 3)
+    size_t size = SymCacheItemSize(entry);
+    if (size > m_symCacheMax)
+      return;
+    while (m_symCacheOldest && m_symCacheSize + size > m_symCacheMax)
+      SymCacheRemove(m_symCacheOldest);
+    TSymCacheItem * item = SymCacheNewItem(entry);
+    if (item == NULL)
+      return;
+    item->errSym = errSym;
+    item->errLine = errLine;
+    TSymCacheItem ** bucket = &m_symCache[SymCacheHash(entry.offset)];
+    item->next = *bucket;
+    *bucket = item;
+    SymCacheLinkLRU(item);
+    m_symCacheSize += size;
+  }
+
+  // **************************************** Async symbolization ************************
+  typedef struct _TAsyncItem
+  {
+    volatile LONG seq;        // sequence number of the bounded MPMC queue (by Dmitry Vyukov)
+    LPVOID        pUserData;
+    int           count;
+    DWORD64       frames[STKWLK_MAX_RAW_FRAMES];
+  } TAsyncItem;
+
+  TAsyncItem *  m_asyncItems;
+  LONG          m_asyncMask;
+  volatile LONG m_asyncHead;          // next item for the workers
+  volatile LONG m_asyncTail;          // next free item for the producers
+  volatile LONG m_asyncPending;       // queued or processed items
+  volatile LONG m_asyncPushers;       // producers inside AsyncPush
+  volatile LONG m_asyncDrops;         // items dropped because the queue was full
+  volatile LONG m_asyncStop;          // 1 - drain the queue and stop, 2 - stop immediately
+  HANDLE        m_asyncSem;
+  HANDLE        m_asyncIdle;          // manual-reset event, signaled while nothing is pending
+  CRITICAL_SECTION m_asyncIdleLock;   // orders the transitions of m_asyncIdle
+  HANDLE *      m_asyncThreads;
+  int           m_asyncThreadsCount;
+
+  static LONG SeqDiff(LONG a, LONG b) STKWLK_NOEXCEPT
+  {
+    return (LONG)((ULONG)a - (ULONG)b);
+  }
+
+  // The idle event is updated only when m_asyncPending crosses zero; the state is rechecked under
+  // the lock, so the last transition always wins.
+  void AsyncPendingInc() STKWLK_NOEXCEPT
+  {
+    if (InterlockedIncrement(&m_asyncPending) != 1)
+      return;
+    ::EnterCriticalSection(&m_asyncIdleLock);
+    if (m_asyncPending > 0)
+      ResetEvent(m_asyncIdle);
+    ::LeaveCriticalSection(&m_asyncIdleLock);
+  }
+
+  void AsyncPendingDec() STKWLK_NOEXCEPT
+  {
+    if (InterlockedDecrement(&m_asyncPending) != 0)
+      return;
+    ::EnterCriticalSection(&m_asyncIdleLock);
+    if (m_asyncPending == 0)
+      SetEvent(m_asyncIdle);
+    ::LeaveCriticalSection(&m_asyncIdleLock);
+  }
+
+  bool AsyncPush(LPVOID pUserData, const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+  {
+    bool result = false;
+    // StopAsync waits for the registered producers before the queue is freed
+    InterlockedIncrement(&m_asyncPushers);
+    if (m_asyncStop == 0 && m_asyncItems != NULL)
+      result = AsyncPushItem(pUserData, frames, count);
+    InterlockedDecrement(&m_asyncPushers);
+    return result;
+  }
+
+  bool AsyncPushItem(LPVOID pUserData, const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+  {
+    AsyncPendingInc();
+    LONG pos = m_asyncTail;
+    for (;;)
     {
-      modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V3);
-      if (Sym.GetModuleInfo(hProcess, baseAddr, &modInfo) != FALSE)
+      TAsyncItem & item = m_asyncItems[pos & m_asyncMask];
+      LONG diff = SeqDiff(item.seq, pos);
+      if (diff == 0)
       {
-        modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V3);
-        if (m_IHM64Version == 0)
-          m_IHM64Version = 3;
-        return true;
+        LONG prev = InterlockedCompareExchange(&m_asyncTail, pos + 1, pos);
+        if (prev == pos)
+        {
+          item.pUserData = pUserData;
+          item.count = (count < STKWLK_MAX_RAW_FRAMES) ? count : STKWLK_MAX_RAW_FRAMES;
+          memcpy(item.frames, frames, item.count * sizeof(DWORD64));
+          InterlockedExchange(&item.seq, pos + 1);   // publish
+          ReleaseSemaphore(m_asyncSem, 1, NULL);
+          return true;
+        }
+        pos = prev;
       }
-      if (m_IHM64Version == 3)
+      else if (diff < 0)
       {
-        SetLastError(ERROR_DLL_INIT_FAILED);
+        // the queue is full: drop the callstack instead of blocking the caller
+        InterlockedIncrement(&m_asyncDrops);
+        AsyncPendingDec();
         return false;
       }
-      if (GetLastError() != ERROR_INVALID_PARAMETER)
-        return false;
-      // try V2 struct only when SymGetModuleInfo returned error 87
-      memset(&modInfo, 0, sizeof(modInfo));
+      else
+        pos = m_asyncTail;
     }
+  }
 
-    // could not retrieve the bigger structure, try with the smaller one (as defined in VC7.1)...
-    modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V2);
-    if (Sym.GetModuleInfo(hProcess, baseAddr, &modInfo) != false)
+  bool AsyncPop(TAsyncItem & out) STKWLK_NOEXCEPT
+  {
+    LONG pos = m_asyncHead;
+    for (;;)
     {
-      modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V2);
-      if (m_IHM64Version == 0)
-        m_IHM64Version = 2; // to prevent unnecessary calls with the larger V3 struct...
-      return true;
+      TAsyncItem & item = m_asyncItems[pos & m_asyncMask];
+      LONG diff = SeqDiff(item.seq, pos + 1);
+      if (diff == 0)
+      {
+        LONG prev = InterlockedCompareExchange(&m_asyncHead, pos + 1, pos);
+        if (prev == pos)
+        {
+          out.pUserData = item.pUserData;
+          out.count = item.count;
+          memcpy(out.frames, item.frames, item.count * sizeof(DWORD64));
+          InterlockedExchange(&item.seq, pos + m_asyncMask + 1);   // release the item
+          return true;
+        }
+        pos = prev;
+      }
+      else if (diff < 0)
+        return false;   // the queue is empty
+      else
+        pos = m_asyncHead;
     }
-    SetLastError(ERROR_DLL_INIT_FAILED);
-    return false;
   }
 
-  static BOOL WINAPI SymEnumModulesCallback(SW_CSTR ModuleName, DWORD64 BaseOfDll, PVOID UserContext) STKWLK_NOEXCEPT
+  static DWORD WINAPI AsyncWorkerProc(LPVOID param) STKWLK_NOEXCEPT
   {
-    StackWalkerInternal * swi = (StackWalkerInternal *)UserContext;
-    if (swi && swi->m_modListSize < _countof(swi->m_modList))
-      swi->m_modList[swi->m_modListSize++] = BaseOfDll;
-    return TRUE;
+    StackWalkerInternal * swi = (StackWalkerInternal *)param;
+    TAsyncItem item;
+    for (;;)
+    {
+      WaitForSingleObject(swi->m_asyncSem, INFINITE);
+      if (swi->m_asyncStop == 2)
+        break;
+      if (swi->AsyncPop(item))
+      {
+        swi->m_parent->ShowRawCallstack(item.frames, item.count, item.pUserData);
+        swi->AsyncPendingDec();
+        continue;
+      }
+      if (swi->m_asyncStop != 0)
+        break;
+    }
+    return 0;
   }
 
-  int UpdateModulesList() STKWLK_NOEXCEPT
+  bool StartAsync(int workers, int queueSize) STKWLK_NOEXCEPT
   {
-    m_modListSize = 0;
-    Sym.EnumerateModules(m_hProcess, (T_SYM_ENUMMODULES_CALLBACK64)SymEnumModulesCallback, this);
-    return m_modListSize;
+    if (m_asyncItems != NULL)
+      return true;   // already started
+    if (workers < 1 || queueSize < 1)
+    {
+      SetLastError(ERROR_INVALID_PARAMETER);
+      return false;
+    }
+    LONG capacity = 2;
+    while (capacity < queueSize && capacity < 0x100000)
+      capacity *= 2;
+    m_asyncItems = (TAsyncItem *) malloc(capacity * sizeof(TAsyncItem));
+    m_asyncThreads = (HANDLE *) calloc(workers, sizeof(HANDLE));
+    m_asyncSem = CreateSemaphoreW(NULL, 0, 0x7FFFFFFF, NULL);
+    m_asyncIdle = CreateEventW(NULL, TRUE, TRUE, NULL);
+    if (m_asyncIdle != NULL)
+      InitializeCriticalSection(&m_asyncIdleLock);
+    if (m_asyncItems == NULL || m_asyncThreads == NULL || m_asyncSem == NULL || m_asyncIdle == NULL)
+    {
+      StopAsync(false);
+      SetLastError(ERROR_OUTOFMEMORY);
+      return false;
+    }
+    for (LONG i = 0; i < capacity; i++)
+      m_asyncItems[i].seq = i;
+    m_asyncMask = capacity - 1;
+    m_asyncHead = 0;
+    m_asyncTail = 0;
+    m_asyncPending = 0;
+    m_asyncStop = 0;
+    for (m_asyncThreadsCount = 0; m_asyncThreadsCount < workers; m_asyncThreadsCount++)
+    {
+      DWORD tid;
+      HANDLE hThread = CreateThread(NULL, 0, AsyncWorkerProc, this, 0, &tid);
+      if (hThread == NULL)
+        break;
+      m_asyncThreads[m_asyncThreadsCount] = hThread;
+    }
+    if (m_asyncThreadsCount == 0)
+    {
+      DWORD gle = GetLastError();
+      StopAsync(false);
+      SetLastError(gle);
+      return false;
+    }
+    return true;
   }
 
-  bool UnloadModules() STKWLK_NOEXCEPT
+  void StopAsync(bool drain) STKWLK_NOEXCEPT
   {
-    bool result = false;
-    int i;
-    int mcnt;
-    if (m_SymInitialized == false || m_modulesNumber <= 0)
+    if (m_asyncItems == NULL && m_asyncThreads == NULL && m_asyncSem == NULL && m_asyncIdle == NULL)
+      return;   // not started
+    InterlockedExchange(&m_asyncStop, drain ? 1 : 2);
+    // a producer that passed the stop check may still write into the queue
+    while (m_asyncPushers > 0)
+      SwitchToThread();
+    if (m_asyncSem != NULL && m_asyncThreadsCount > 0)
+      ReleaseSemaphore(m_asyncSem, m_asyncThreadsCount, NULL);
+    for (int i = 0; i < m_asyncThreadsCount; i++)
     {
-      result = true;
-      goto fin;
+      WaitForSingleObject(m_asyncThreads[i], INFINITE);
+      CloseHandle(m_asyncThreads[i]);
     }
-    result = false;
-    mcnt = UpdateModulesList();
-    if (mcnt <= 0)
-      goto fin;
-
-    for (i = 0; i < mcnt; i++)
+    if (m_asyncSem != NULL)
+      CloseHandle(m_asyncSem);
+    if (m_asyncIdle != NULL)
     {
-      Sym.UnloadModule(m_hProcess, m_modList[i]);
+      CloseHandle(m_asyncIdle);
+      DeleteCriticalSection(&m_asyncIdleLock);
     }
-    result = true;
-  fin:  
-    m_modulesLoaded = false;
-    m_modulesNumber = 0;
-    m_showLoadModules = false;
-    return result;
+    free(m_asyncThreads);
+    free(m_asyncItems);
+    m_asyncSem = NULL;
+    m_asyncIdle = NULL;
+    m_asyncThreads = NULL;
+    m_asyncThreadsCount = 0;
+    m_asyncItems = NULL;
+    m_asyncPending = 0;
   }
 
-  void OnDbgHelpErr(SW_CSTR szFuncName, DWORD gle = 0, DWORD64 addr = 0) STKWLK_NOEXCEPT
+  // **************************************** Module list ************************
+  typedef StackWalkerBase::TSnapshotModule  TModuleDesc;
+
+  typedef struct _TModuleList
   {
-    StackWalkerBase::TDbgHelpErr data(szFuncName, gle, addr);
-    if (m_parent)
-      m_parent->OnDbgHelpErr(data);
+    TModuleDesc * items;
+    int           count;
+    int           capacity;
+    bool          psapi;      // list was taken from PSAPI
+  } TModuleList;
+
+  static bool ModuleListAdd(TModuleList & list, SW_CSTR img, SW_CSTR mod, DWORD64 baseAddr, DWORD size) STKWLK_NOEXCEPT
+  {
+    if (list.count >= list.capacity)
+    {
+      int cap = list.capacity ? list.capacity * 2 : 256;
+      TModuleDesc * items = (TModuleDesc *) realloc(list.items, cap * sizeof(TModuleDesc));
+      if (items == NULL)
+        return false;
+      list.items = items;
+      list.capacity = cap;
+    }
+    TModuleDesc & md = list.items[list.count];
+    md.baseAddr = baseAddr;
+    md.size = size;
+    md.imgName = img ? sw_sdup(img) : NULL;
+    md.modName = mod ? sw_sdup(mod) : NULL;
+    if (md.imgName == NULL)
+    {
+      free(md.modName);
+      return false;
+    }
+    list.count++;
+    return true;
   }
 
-  SW_CSTR GetSymTypeNameById(SYM_TYPE stype) STKWLK_NOEXCEPT
+  static void ModuleListFree(TModuleDesc * items, int count) STKWLK_NOEXCEPT
   {
-    switch (stype)
+    for (int i = 0; items && i < count; i++)
+    {
+      free(items[i].imgName);
+      free(items[i].modName);
+    }
+    free(items);
+  }
+
+  static void ModuleListFree(TModuleList & list) STKWLK_NOEXCEPT
+  {
+    ModuleListFree(list.items, list.count);
+    memset(&list, 0, sizeof(list));
+  }
+
+  static bool ModuleListContains(const TModuleList & list, const TModuleDesc & md) STKWLK_NOEXCEPT
+  {
+    for (int i = 0; i < list.count; i++)
+    {
+      const TModuleDesc & it = list.items[i];
+      if (it.baseAddr == md.baseAddr && it.size == md.size && sw_scmp(it.imgName, md.imgName) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  // Modules of the target process which are loaded into dbghelp. They are kept between
+  // the calls and only the difference to the current module list is loaded or unloaded.
+  TModuleList m_liveModules;
+  LONG        m_dllChanges;     // DLL notifications seen by the last enumeration (option NotifyModules)
+
+  // Module map of the encoded callstacks: the modules sorted by the base address. The
+  // generation is a hash of the bases and sizes, so it changes whenever a reload finds another
+  // set of modules, and the walkers with the same modules have the same generation.
+  DWORD64 *   m_mapBases;
+  DWORD *     m_mapSizes;
+  int         m_mapCount;
+  DWORD       m_mapGeneration;    // 0 - no map
+
+  static DWORD ModuleMapHash(const DWORD64 * bases, const DWORD * sizes, int count) STKWLK_NOEXCEPT
+  {
+    DWORD h = 2166136261U;    // FNV-1a
+    for (int i = 0; i < count; i++)
+    {
+      h = (h ^ (DWORD)bases[i]) * 16777619U;
+      h = (h ^ (DWORD)(bases[i] >> 32)) * 16777619U;
+      h = (h ^ sizes[i]) * 16777619U;
+    }
+    return (h != 0) ? h : 1;
+  }
+
+  void ModuleMapUpdate(const TModuleList & list) STKWLK_NOEXCEPT
+  {
+    int i, j;
+    DWORD64 * bases = (DWORD64 *) malloc((list.count + 1) * sizeof(DWORD64));
+    DWORD *   sizes = (DWORD *) malloc((list.count + 1) * sizeof(DWORD));
+    if (bases == NULL || sizes == NULL)
+    {
+      free(bases);
+      free(sizes);
+      return;
+    }
+    for (i = 0; i < list.count; i++)
+    {
+      // insertion sort, the lists are short and mostly sorted already
+      const TModuleDesc & md = list.items[i];
+      for (j = i; j > 0 && bases[j - 1] > md.baseAddr; j--)
+      {
+        bases[j] = bases[j - 1];
+        sizes[j] = sizes[j - 1];
+      }
+      bases[j] = md.baseAddr;
+      sizes[j] = md.size;
+    }
+    if (m_mapBases != NULL && m_mapCount == list.count &&
+        memcmp(m_mapBases, bases, list.count * sizeof(DWORD64)) == 0 &&
+        memcmp(m_mapSizes, sizes, list.count * sizeof(DWORD)) == 0)
+    {
+      free(bases);
+      free(sizes);
+      return;
+    }
+    free(m_mapBases);
+    free(m_mapSizes);
+    m_mapBases = bases;
+    m_mapSizes = sizes;
+    m_mapCount = list.count;
+    m_mapGeneration = ModuleMapHash(bases, sizes, list.count);
+  }
+
+  void ModuleMapFree() STKWLK_NOEXCEPT
+  {
+    free(m_mapBases);
+    free(m_mapSizes);
+    m_mapBases = NULL;
+    m_mapSizes = NULL;
+    m_mapCount = 0;
+    m_mapGeneration = 0;
+  }
+
+  // the first call loads the modules, the later ones use the map of the last walk
+  void ModuleMapLoad() STKWLK_NOEXCEPT
+  {
+    if (m_mapBases != NULL)
+      return;
+    UnloadModules();
+    InitAndLoad();
+  }
+
+  // slot of the address in the module map (0 - unknown module)
+  int ModuleMapSlot(DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    if (m_mapCount <= 0)
+      return 0;
+    int i = FindAddr(m_mapBases, m_mapCount, addr);
+    if (addr < m_mapBases[i] || addr - m_mapBases[i] >= m_mapSizes[i])
+      return 0;
+    return i + 1;
+  }
+
+  // **************************************** Frame filters ************************
+  // The filters are checked before any symbol lookup. The module filters are resolved into an
+  // action per slot of the module map whenever the map was changed. A snapshot with its own
+  // modules is filtered by the slots of its module list (index + 1) instead.
+  typedef struct _TModuleFilter
+  {
+    struct _TModuleFilter * next;
+    int                     action;     // StackWalkerBase::FrameFilter
+    SW_CHR                  name[1];
+  } TModuleFilter;
+
+  enum { FilterNone = -1 };
+
+  TModuleFilter * m_modFilters;
+  bool            m_allowFilters;      // any FrameAllow filter
+  DWORD64 *       m_dropRanges;        // pairs [start, end)
+  int             m_dropRangesCount;
+  int             m_skipFrames;
+  signed char *   m_slotActions;       // [m_slotActionsCount + 1]
+  int             m_slotActionsCount;
+  DWORD           m_slotActionsGen;
+
+  bool HasFrameFilters() const STKWLK_NOEXCEPT
+  {
+    return m_modFilters != NULL || m_dropRangesCount > 0 || m_skipFrames > 0;
+  }
+
+  void FrameFiltersFree() STKWLK_NOEXCEPT
+  {
+    while (m_modFilters != NULL)
+    {
+      TModuleFilter * f = m_modFilters;
+      m_modFilters = f->next;
+      free(f);
+    }
+    free(m_dropRanges);
+    free(m_slotActions);
+    m_allowFilters = false;
+    m_dropRanges = NULL;
+    m_dropRangesCount = 0;
+    m_skipFrames = 0;
+    m_slotActions = NULL;
+    m_slotActionsCount = 0;
+    SlotActionsReset();
+  }
+
+  void SlotActionsReset() STKWLK_NOEXCEPT
+  {
+    m_slotActionsGen = m_mapGeneration - 1;    // resolve again
+  }
+
+  static bool ModuleNameMatch(SW_CSTR name, const TModuleDesc & md) STKWLK_NOEXCEPT
+  {
+    if (md.modName != NULL && sw_sicmp(name, md.modName) == 0)
+      return true;
+    SW_CSTR file = (md.imgName != NULL) ? sw_srchr(md.imgName, _T('\\')) : NULL;
+    file = (file != NULL) ? file + 1 : md.imgName;
+    return file != NULL && sw_sicmp(name, file) == 0;
+  }
+
+  // modules of the snapshot being walked (NULL - the module map is used)
+  const TModuleDesc * SnapshotModules(int & count) const STKWLK_NOEXCEPT
+  {
+    const StackWalkerBase::TSnapshot * snap = m_pSnapshot;
+    count = (snap != NULL && snap->modules != NULL) ? snap->modulesCount : 0;
+    return (snap != NULL) ? snap->modules : NULL;
+  }
+
+  // slot of the address for the frame filters (0 - unknown module)
+  int FilterSlot(DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    int count;
+    const TModuleDesc * modules = SnapshotModules(count);
+    if (modules == NULL)
+      return ModuleMapSlot(addr);
+    for (int i = 0; i < count; i++)
+      if (addr - modules[i].baseAddr < modules[i].size)
+        return i + 1;
+    return 0;
+  }
+
+  // must be reset when a snapshot with modules is started or finished
+  void UpdateSlotActions() STKWLK_NOEXCEPT
+  {
+    if (m_slotActions != NULL && m_slotActionsGen == m_mapGeneration)
+      return;
+    int count;
+    int slots;
+    const TModuleDesc * modules = SnapshotModules(count);
+    if (modules != NULL)
+      slots = count;
+    else
+    {
+      modules = m_liveModules.items;
+      count = m_liveModules.count;
+      slots = m_mapCount;
+    }
+    signed char * actions = (signed char *) realloc(m_slotActions, slots + 1);
+    if (actions == NULL)
+      return;
+    m_slotActions = actions;
+    m_slotActionsCount = slots;
+    m_slotActionsGen = m_mapGeneration;
+    memset(actions, FilterNone, slots + 1);
+    for (int i = 0; i < count; i++)
+    {
+      const TModuleDesc & md = modules[i];
+      int slot = FilterSlot(md.baseAddr);
+      for (const TModuleFilter * f = m_modFilters; f != NULL && slot > 0; f = f->next)
+      {
+        if (ModuleNameMatch(f->name, md))
+        {
+          actions[slot] = (signed char)f->action;
+          break;
+        }
+      }
+    }
+  }
+
+  // Returns true if the frame is shown. `frameNum` counts all the walked frames,
+  // `collapseSlot` is the module of the previous frame kept by FrameCollapse (0 - none).
+  bool FilterFrame(DWORD64 addr, int frameNum, int & collapseSlot) STKWLK_NOEXCEPT
+  {
+    if (frameNum < m_skipFrames)
+      return false;
+    for (int i = 0; i < m_dropRangesCount; i++)
+      if (addr - m_dropRanges[2 * i] < m_dropRanges[2 * i + 1] - m_dropRanges[2 * i])
+        return false;
+    if (m_modFilters == NULL)
+      return true;
+    UpdateSlotActions();
+    int slot = FilterSlot(addr);
+    int action = (m_slotActions != NULL && slot <= m_slotActionsCount) ? m_slotActions[slot] : FilterNone;
+    if (action == StackWalkerBase::FrameDrop || (m_allowFilters && action == FilterNone))
+      return false;
+    if (action != StackWalkerBase::FrameCollapse)
+    {
+      collapseSlot = 0;
+      return true;
+    }
+    if (slot == collapseSlot)
+      return false;
+    collapseSlot = slot;
+    return true;
+  }
+
+  // Enumerate modules of the process without loading them
+  int GetModuleList(HANDLE hProcess, DWORD pid, TModuleList & list) STKWLK_NOEXCEPT
+  {
+    // first try toolhelp32
+    int cnt = GetModuleListTH32(hProcess, pid, list);
+    if (cnt < 2)   // then try psapi
+    {
+      ModuleListFree(list);
+      cnt = GetModuleListPSAPI(hProcess, list);
+    }
+    return cnt;
+  }
+
+  // Read memory of a snapshot module from its image file (offline unwinding)
+  bool ReadSnapshotImage(DWORD64 addr, PVOID lpBuffer, DWORD nSize) STKWLK_NOEXCEPT
+  {
+    const StackWalkerBase::TSnapshot * snap = m_pSnapshot;
+    if (snap == NULL || snap->modules == NULL || m_snapImages == NULL)
+      return false;
+    for (int i = 0; i < snap->modulesCount; i++)
+    {
+      const TModuleDesc & md = snap->modules[i];
+      if (addr < md.baseAddr || addr + nSize > md.baseAddr + md.size)
+        continue;
+      if (m_snapImages[i] == NULL)
+      {
+        m_snapImages[i] = (LPBYTE)INVALID_HANDLE_VALUE;   // do not try again
+        HANDLE hFile = CreateFile(md.imgName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                  NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+          return false;
+        // SEC_IMAGE gives the same layout of sections as in the loaded module
+        HANDLE hMap = CreateFileMappingW(hFile, NULL, PAGE_READONLY | SEC_IMAGE, 0, 0, NULL);
+        CloseHandle(hFile);
+        if (hMap == NULL)
+          return false;
+        LPVOID view = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMap);
+        if (view == NULL)
+          return false;
+        m_snapImages[i] = (LPBYTE)view;
+      }
+      if (m_snapImages[i] == (LPBYTE)INVALID_HANDLE_VALUE)
+        return false;
+      MEMORY_BASIC_INFORMATION mbi;
+      LPBYTE src = m_snapImages[i] + (size_t)(addr - md.baseAddr);
+      if (VirtualQuery(src, &mbi, sizeof(mbi)) == 0 || mbi.State != MEM_COMMIT)
+        return false;
+      if (src + nSize > (LPBYTE)mbi.BaseAddress + mbi.RegionSize)
+        return false;
+      memcpy(lpBuffer, src, nSize);
+      return true;
+    }
+    return false;
+  }
+
+  void UnmapSnapshotImages() STKWLK_NOEXCEPT
+  {
+    if (m_snapImages == NULL)
+      return;
+    for (int i = 0; m_pSnapshot && i < m_pSnapshot->modulesCount; i++)
+      if (m_snapImages[i] != NULL && m_snapImages[i] != (LPBYTE)INVALID_HANDLE_VALUE)
+        UnmapViewOfFile(m_snapImages[i]);
+    free(m_snapImages);
+    m_snapImages = NULL;
+  }
+
+private:
+// **************************************** ToolHelp32 ************************
+#define MAX_MODULE_NAME32 255
+#define TH32CS_SNAPMODULE 0x00000008
+#pragma pack(push, 8)
+  typedef struct tagMODULEENTRY32
+  {
+    DWORD   dwSize;
+    DWORD   th32ModuleID;  // This module
+    DWORD   th32ProcessID; // owning process
+    DWORD   GlblcntUsage;  // Global usage count on the module
+    DWORD   ProccntUsage;  // Module usage count in th32ProcessID's context
+    BYTE*   modBaseAddr;   // Base address of module in th32ProcessID's context
+    DWORD   modBaseSize;   // Size in bytes of module starting at modBaseAddr
+    HMODULE hModule;       // The hModule of this module in th32ProcessID's context
+    SW_CHR  szModule[MAX_MODULE_NAME32 + 1];
+    SW_CHR  szExePath[MAX_PATH];
+  } MODULEENTRY32;
+  typedef MODULEENTRY32* PMODULEENTRY32;
+  typedef MODULEENTRY32* LPMODULEENTRY32;
+#pragma pack(pop)
+
+  int GetModuleListTH32(HANDLE hProcess, DWORD pid, TModuleList & list) STKWLK_NOEXCEPT
+  {
+    // try both dlls...
+    LPCWSTR      dllname[] = { L"kernel32.dll", L"tlhelp32.dll" };
+    HINSTANCE    hToolhelp = NULL;
+    HANDLE (WINAPI * CreateTH32Snapshot)(DWORD dwFlags, DWORD th32ProcessID);
+    BOOL (WINAPI * Module32First)(HANDLE hSnapshot, LPMODULEENTRY32 lpme);
+    BOOL (WINAPI * Module32Next)(HANDLE hSnapshot, LPMODULEENTRY32 lpme);
+    HANDLE        hSnap;
+    MODULEENTRY32 me;
+    me.dwSize = sizeof(me);
+
+    for (size_t i = 0; i < _countof(dllname); i++)
+    {
+      hToolhelp = LoadLibraryW(dllname[i]);
+      if (hToolhelp == NULL)
+        continue;
+      int fcnt = 0;
+      GetProcAddrEx(fcnt, hToolhelp, "CreateToolhelp32Snapshot", (LPVOID*)&CreateTH32Snapshot);
+#ifndef STKWLK_ANSI
+      GetProcAddrEx(fcnt, hToolhelp, "Module32FirstW", (LPVOID*)&Module32First);
+      GetProcAddrEx(fcnt, hToolhelp, "Module32NextW", (LPVOID*)&Module32Next);
+#else
+      GetProcAddrEx(fcnt, hToolhelp, "Module32First", (LPVOID*)&Module32First);
+      GetProcAddrEx(fcnt, hToolhelp, "Module32Next", (LPVOID*)&Module32Next);
+#endif
+      if (fcnt == 3)
+        break; // found the functions!
+      FreeLibrary(hToolhelp);
+      hToolhelp = NULL;
+    }
+
+    if (hToolhelp == NULL)
+      return -1;
+
+    hSnap = CreateTH32Snapshot(TH32CS_SNAPMODULE, pid);
+    if (hSnap == (HANDLE)-1)
+    {
+      FreeLibrary(hToolhelp);
+      return -2;
+    }
+
+    bool keepGoing = !!Module32First(hSnap, &me);
+    int cnt = 0;
+    while (keepGoing)
+    {
+      if (ModuleListAdd(list, me.szExePath, me.szModule, (DWORD64)me.modBaseAddr, me.modBaseSize))
+        cnt++;
+      keepGoing = !!Module32Next(hSnap, &me);
+    }
+    CloseHandle(hSnap);
+    FreeLibrary(hToolhelp);
+    return cnt;
+  } // GetModuleListTH32
+
+  // **************************************** PSAPI ************************
+  typedef struct _MODULEINFO
+  {
+    LPVOID lpBaseOfDll;
+    DWORD  SizeOfImage;
+    LPVOID EntryPoint;
+  } MODULEINFO, *LPMODULEINFO;
+
+  typedef struct _SW_MODULE_INFO
+  {
+    HMODULE   hMods[1024];
+    SW_CHR    szImgName[2048];
+    SW_CHR    szModName[2048];
+  } SW_MODULE_INFO, *PSW_MODULE_INFO;
+
+  int GetModuleListPSAPI(HANDLE hProcess, TModuleList & list) STKWLK_NOEXCEPT
+  {
+    HINSTANCE hPsapi;
+    BOOL  (WINAPI * EnumProcessModules)(HANDLE hProcess, HMODULE * lphModule, DWORD cb, LPDWORD lpcbNeeded);
+    DWORD (WINAPI * GetModuleFileNameEx)(HANDLE hProcess, HMODULE hModule, SW_STR lpFilename, DWORD nSize);
+    DWORD (WINAPI * GetModuleBaseName)(HANDLE hProcess, HMODULE hModule, SW_STR lpFilename, DWORD nSize);
+    BOOL  (WINAPI * GetModuleInformation)(HANDLE hProcess, HMODULE hModule, LPMODULEINFO pmi, DWORD nSize);
+
+    MODULEINFO       mi;
+    SW_MODULE_INFO * mList = NULL;
+    DWORD            mListSize = 0;
+    size_t           mNumbers;
+    size_t           i;
+    int              cnt = -1;
+
+    hPsapi = LoadLibraryW(L"psapi.dll");
+    if (hPsapi == NULL)
+      return -1;
+
+    int fcnt = 0;
+    GetProcAddrEx(fcnt, hPsapi, "EnumProcessModules", (LPVOID*)&EnumProcessModules);
+    GetProcAddrEx(fcnt, hPsapi, "GetModuleInformation", (LPVOID*)&GetModuleInformation);
+#ifndef STKWLK_ANSI
+    GetProcAddrEx(fcnt, hPsapi, "GetModuleFileNameExW", (LPVOID*)&GetModuleFileNameEx);
+    GetProcAddrEx(fcnt, hPsapi, "GetModuleBaseNameW", (LPVOID*)&GetModuleBaseName);
+#else
+    GetProcAddrEx(fcnt, hPsapi, "GetModuleFileNameExA", (LPVOID*)&GetModuleFileNameEx);
+    GetProcAddrEx(fcnt, hPsapi, "GetModuleBaseNameA", (LPVOID*)&GetModuleBaseName);
+#endif
+    if (fcnt < 4)
+      goto cleanup;  // we couldn't find all functions
+
+    mList = (SW_MODULE_INFO*) malloc(sizeof(SW_MODULE_INFO));
+    if (mList == NULL)
+      goto cleanup;
+
+    if (!EnumProcessModules(hProcess, mList->hMods, sizeof(mList->hMods), &mListSize))
+      goto cleanup;
+
+    if (mListSize > sizeof(mList->hMods))
+      goto cleanup;
+
+    cnt = 0;
+    list.psapi = true;
+    mNumbers = (size_t)mListSize / sizeof(mList->hMods[0]);
+    if (mNumbers < 2)
+      goto cleanup;
+
+    for (i = 0; i < mNumbers; i++)
+    {
+      HMODULE hMod = mList->hMods[i];
+      // base address, size
+      GetModuleInformation(hProcess, hMod, &mi, sizeof(mi));
+      // image file name
+      mList->szImgName[0] = 0;
+      GetModuleFileNameEx(hProcess, hMod, mList->szImgName, _countof(mList->szImgName) - 1);
+      // module name
+      mList->szModName[0] = 0;
+      GetModuleBaseName(hProcess, hMod, mList->szModName, _countof(mList->szModName) - 1);
+
+      if (ModuleListAdd(list, mList->szImgName, mList->szModName, (DWORD64)mi.lpBaseOfDll,
+                        mi.SizeOfImage))
+        cnt++;
+    }
+
+  cleanup:
+    if (hPsapi != NULL)
+      FreeLibrary(hPsapi);
+    if (mList != NULL)
+      free(mList);
+
+    return cnt;
+  } // GetModuleListPSAPI
+
+  DWORD LoadModule(HANDLE hProcess, SW_CSTR img, SW_CSTR mod, DWORD64 baseAddr, DWORD size,
+                   const StackWalkerBase::TFileVer * pFileVer = NULL) STKWLK_NOEXCEPT
+  {
+    DWORD result = ERROR_SUCCESS;
+    TFileVer fileVersion;
+
+    if (img == NULL)
+      return ERROR_BAD_ARGUMENTS;
+
+    if (this->m_parent == NULL)
+      return ERROR_DS_NO_PARENT_OBJECT;
+
+    LARGE_INTEGER t;
+    StatBegin(t);
+    DWORD64 modBase = SymLoadModule(hProcess, NULL, img, mod, baseAddr, size);
+    if (modBase == 0)
+    {
+      result = GetLastError();
+      if (result == ERROR_SUCCESS)
+        result = ERROR_DS_SCHEMA_NOT_LOADED;
+    }
+    StatEnd(StackWalkerBase::StatSymLoadModule, t);
+    // Retrieve some additional-infos about the module
+    T_IMAGEHLP_MODULE64 Module;
+    SW_CSTR szSymType = _T("-unknown-");
+    if (this->GetModuleInfo(hProcess, baseAddr, Module) != false)
+      szSymType = GetSymTypeNameById(Module.SymType);
+
+    if (m_showLoadModules == true)
+    {
+      // try to retrieve the file-version:
+      if (pFileVer != NULL)
+        fileVersion = *pFileVer;
+      else if ((this->m_options & StackWalkerBase::RetrieveFileVersion) != 0)
+        GetFileVersion(img, fileVersion);
+      StackWalkerBase::TLoadModule data;
+      data.imgName = img;
+      data.modName = mod;
+      data.baseAddr = baseAddr;
+      data.size = size;
+      data.result = result;
+      data.symType = szSymType;
+      data.pdbName = Module.LoadedPdbName[0] ? Module.LoadedPdbName : Module.LoadedImageName;
+      data.ver = fileVersion;
+      this->m_parent->OnLoadModule(data);
+    }
+    return result;
+  }
+
+public:
+  typedef StackWalkerBase::TFileVer  TFileVer;
+  typedef StackWalkerBase::TCallstackEntry     TCallstackEntry;
+  typedef StackWalkerBase::PReadMemRoutine     PReadMemRoutine;
+
+  static bool GetFileVersion(SW_CSTR filename, TFileVer & ver, VS_FIXEDFILEINFO * vinfo = NULL) STKWLK_NOEXCEPT
+  {
+    bool result = false;
+    BYTE buffer[2048];
+    LPVOID vData = (LPVOID)buffer;
+    VS_FIXEDFILEINFO * fInfo = NULL;
+    ver.zeroinit();
+    DWORD dwHandle = 0;
+    DWORD dwSize = GetFileVersionInfoSize(filename, &dwHandle);
+    if (dwSize == 0 || dwSize > 256 * 1024)
+      return false;
+    if (dwSize >= sizeof(buffer))
+    {
+      vData = malloc(dwSize);
+      if (vData == NULL)
+        return false;
+    }
+    if (GetFileVersionInfo(filename, dwHandle, dwSize, vData) != 0)
+    {
+      UINT len = 0;
+      BOOL rc = VerQueryValue(vData, _T("\\"), (LPVOID*)&fInfo, &len);
+      if (rc != FALSE && fInfo != NULL && len > 0)
+      {
+        ver.wMajor = (WORD)(fInfo->dwFileVersionMS >> 16);
+        ver.wMinor = (WORD)fInfo->dwFileVersionMS;
+        ver.wBuild = (WORD)(fInfo->dwFileVersionLS >> 16);
+        ver.wRevis = (WORD)fInfo->dwFileVersionLS;
+        if (vinfo)
+          *vinfo = *fInfo;
+        result = true;
+      }
+    }
+    if (vData != buffer)
+      free(vData);
+    return result;
+  }
+
+  // The job outlives a timed out wait: it owns copies of the file names and is freed by the
+  // last of the caller and the workers.
+  typedef struct _TFileVerJob
+  {
+    LONG volatile   refs;
+    LONG volatile   next;       // next item to read
+    LONG volatile   finished;   // number of read items
+    LONG            count;
+    SW_CSTR *       names;
+    TFileVer *      vers;
+    LONG volatile * done;       // 1 - vers[i] is read
+  } TFileVerJob;
+
+  static void FileVerJobRun(TFileVerJob * job) STKWLK_NOEXCEPT
+  {
+    for (;;)
+    {
+      LONG i = InterlockedIncrement(&job->next) - 1;
+      if (i >= job->count)
+        break;
+      GetFileVersion(job->names[i], job->vers[i]);
+      InterlockedExchange(&job->done[i], 1);
+      InterlockedIncrement(&job->finished);
+    }
+  }
+
+  static void FileVerJobRelease(TFileVerJob * job) STKWLK_NOEXCEPT
+  {
+    if (InterlockedDecrement(&job->refs) == 0)
+      free(job);
+  }
+
+  static DWORD WINAPI FileVerWorkerProc(LPVOID param) STKWLK_NOEXCEPT
+  {
+    TFileVerJob * job = (TFileVerJob *)param;
+    FileVerJobRun(job);
+    FileVerJobRelease(job);
+    return 0;
+  }
+
+  static TFileVerJob * FileVerJobCreate(const TModuleDesc * items, int count) STKWLK_NOEXCEPT
+  {
+    size_t size = sizeof(TFileVerJob) + count * (sizeof(SW_CSTR) + sizeof(TFileVer) + sizeof(LONG));
+    for (int i = 0; i < count; i++)
+      size += SymCacheStrSize(items[i].imgName);
+    TFileVerJob * job = (TFileVerJob *) malloc(size);
+    if (job == NULL)
+      return NULL;
+    memset(job, 0, size);
+    job->count = count;
+    job->names = (SW_CSTR *)(job + 1);
+    job->vers = (TFileVer *)(job->names + count);
+    job->done = (LONG volatile *)(job->vers + count);
+    LPBYTE pos = (LPBYTE)(job->done + count);
+    for (int i = 0; i < count; i++)
+      job->names[i] = SymCacheStrCopy(pos, items[i].imgName);
+    return job;
+  }
+
+  // Reading the version resources is plain file I/O and does not need dbghelp, so with option
+  // PrefetchVersions it is done by several threads in advance. This is the only parallel part of
+  // the module loading: dbghelp is single-threaded, so SymLoadModule stays serialized and a cold
+  // InitAndLoad does not scale with the processors. The wait for the workers is bounded (they do
+  // not start under the loader lock), the rest is then read in place.
+  // Returns NULL if it is not worth it.
+  TFileVer * PrefetchFileVersions(const TModuleDesc * items, int count) STKWLK_NOEXCEPT
+  {
+    const int maxWorkers = 8;
+    const DWORD maxWaitMs = 2000;
+    HANDLE threads[maxWorkers];
+    if (m_showLoadModules == false || (m_options & StackWalkerBase::RetrieveFileVersion) == 0 ||
+        (m_options & StackWalkerBase::PrefetchVersions) == 0)
+      return NULL;
+    // the workers wait for the file I/O, so their number does not depend on the processors
+    int workers = count / 8;     // few modules are faster to read in place
+    if (workers > maxWorkers)
+      workers = maxWorkers;
+    if (workers < 2)
+      return NULL;
+    TFileVer * vers = (TFileVer *) calloc(count, sizeof(TFileVer));
+    if (vers == NULL)
+      return NULL;
+    TFileVerJob * job = FileVerJobCreate(items, count);
+    if (job == NULL)
+    {
+      free(vers);
+      return NULL;
+    }
+    job->refs = 1;
+    int started = 0;
+    for (; started < workers - 1; started++)
+    {
+      DWORD tid;
+      InterlockedIncrement(&job->refs);
+      threads[started] = CreateThread(NULL, 0, FileVerWorkerProc, job, 0, &tid);
+      if (threads[started] == NULL)
+      {
+        InterlockedDecrement(&job->refs);
+        break;
+      }
+    }
+    FileVerJobRun(job);   // the calling thread works too
+    // wait only for the items which are still being read by a worker
+    if (started > 0 && job->finished < job->count)
+      WaitForMultipleObjects(started, threads, TRUE, maxWaitMs);
+    for (int i = 0; i < started; i++)
+      CloseHandle(threads[i]);
+    for (int i = 0; i < count; i++)
+    {
+      if (job->done[i] != 0)
+        vers[i] = job->vers[i];
+      else
+        GetFileVersion(items[i].imgName, vers[i]);   // the worker did not finish in time
+    }
+    FileVerJobRelease(job);
+    return vers;
+  }
+
+  int LoadModuleList(HANDLE hProcess, const TModuleDesc * items, int count, bool reportErr) STKWLK_NOEXCEPT
+  {
+    int cnt = 0;
+    TFileVer * vers = PrefetchFileVersions(items, count);
+    for (int i = 0; i < count; i++)
+    {
+      const TModuleDesc & md = items[i];
+      DWORD dwRes = this->LoadModule(hProcess, md.imgName, md.modName, md.baseAddr, md.size,
+                                     vers ? &vers[i] : NULL);
+      if (dwRes == ERROR_SUCCESS)
+        cnt++;
+      else if (reportErr)
+        this->OnDbgHelpErr(_T("LoadModule"), dwRes);
+    }
+    free(vers);
+    return cnt;
+  }
+
+  bool LoadModules(HANDLE hProcess, DWORD dwProcessId) STKWLK_NOEXCEPT
+  {
+    m_modulesLoaded = false;
+    if (m_pSnapshot != NULL && m_pSnapshot->modules != NULL)
+    {
+      // module map saved in the snapshot
+      m_modulesNumber = LoadModuleList(hProcess, m_pSnapshot->modules, m_pSnapshot->modulesCount, true);
+      m_modulesLoaded = (m_modulesNumber > 0);
+      return m_modulesLoaded;
+    }
+    bool notified = (m_options & StackWalkerBase::NotifyModules) != 0 &&
+                    dwProcessId == GetCurrentProcessId() && DllNotifyRegister();
+    LONG dllChanges = g_dllChanges;    // read before the enumeration, so no change is missed
+    if (notified && m_liveModules.count > 0 && dllChanges == m_dllChanges)
+    {
+      m_modulesLoaded = true;    // no DLL was loaded or unloaded since the last enumeration
+      return true;
+    }
+    TModuleList list = { 0 };
+    int cnt = GetModuleList(hProcess, dwProcessId, list);
+    if (cnt >= 2)
+    {
+      if (m_liveModules.count > 0)
+        cnt = UpdateModuleList(hProcess, list);
+      else
+        cnt = LoadModuleList(hProcess, list.items, list.count, list.psapi);
+    }
+    if (cnt < 2)
+    {
+      ModuleListFree(list);
+      UnloadModules(true);
+      return false;
+    }
+    ModuleListFree(m_liveModules);
+    m_liveModules = list;
+    m_dllChanges = dllChanges;
+    ModuleMapUpdate(list);
+    m_modulesNumber = cnt;
+    m_modulesLoaded = true;
+    return true;
+  }
+
+  // Apply the difference between the loaded modules and the current module list
+  int UpdateModuleList(HANDLE hProcess, const TModuleList & list) STKWLK_NOEXCEPT
+  {
+    int i;
+    int cnt = m_modulesNumber;
+    for (i = 0; i < m_liveModules.count; i++)
+    {
+      const TModuleDesc & md = m_liveModules.items[i];
+      if (!ModuleListContains(list, md))
+      {
+        if (Sym.UnloadModule(hProcess, md.baseAddr) != FALSE)
+          cnt--;
+        SymCacheEvictModule(md.baseAddr, md.size);
+        if (m_parent)
+        {
+          StackWalkerBase::TUnloadModule data;
+          data.imgName = md.imgName;
+          data.modName = md.modName;
+          data.baseAddr = md.baseAddr;
+          data.size = md.size;
+          m_parent->OnUnloadModule(data);
+        }
+      }
+    }
+    TModuleDesc * added = (TModuleDesc *) malloc((list.count + 1) * sizeof(TModuleDesc));
+    if (added == NULL)
+      return 0;
+    int addedCount = 0;
+    for (i = 0; i < list.count; i++)
+      if (!ModuleListContains(m_liveModules, list.items[i]))
+        added[addedCount++] = list.items[i];   // the strings stay owned by the list
+    bool showLoadModules = m_showLoadModules;
+    if ((m_options & StackWalkerBase::NotifyModules) != 0)
+      m_showLoadModules = true;    // OnLoadModule for the new modules
+    cnt += LoadModuleList(hProcess, added, addedCount, list.psapi);
+    m_showLoadModules = showLoadModules;
+    free(added);
+    return cnt;
+  }
+
+  bool GetModuleInfo(HANDLE hProcess, DWORD64 baseAddr, T_IMAGEHLP_MODULE64 & modInfo) STKWLK_NOEXCEPT
+  {
+    memset(&modInfo, 0, sizeof(modInfo));
+    if (Sym.GetModuleInfo == NULL)
+    {
+      SetLastError(ERROR_DLL_INIT_FAILED);
+      return false;
+    }
+    // First try to use the larger ModuleInfo-Structure
+    if (m_IHM64Version == 0 || m_IHM64Version == 3)
+    {
+      modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V3);
+      if (Sym.GetModuleInfo(hProcess, baseAddr, &modInfo) != FALSE)
+      {
+        modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V3);
+        if (m_IHM64Version == 0)
+          m_IHM64Version = 3;
+        return true;
+      }
+      if (m_IHM64Version == 3)
+      {
+        SetLastError(ERROR_DLL_INIT_FAILED);
+        return false;
+      }
+      if (GetLastError() != ERROR_INVALID_PARAMETER)
+        return false;
+      // try V2 struct only when SymGetModuleInfo returned error 87
+      memset(&modInfo, 0, sizeof(modInfo));
+    }
+
+    // could not retrieve the bigger structure, try with the smaller one (as defined in VC7.1)...
+    modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V2);
+    if (Sym.GetModuleInfo(hProcess, baseAddr, &modInfo) != false)
+    {
+      modInfo.SizeOfStruct = sizeof(IMAGEHLP_MODULE64_V2);
+      if (m_IHM64Version == 0)
+        m_IHM64Version = 2; // to prevent unnecessary calls with the larger V3 struct...
+      return true;
+    }
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    return false;
+  }
+
+  static BOOL WINAPI SymEnumModulesCallback(SW_CSTR ModuleName, DWORD64 BaseOfDll, PVOID UserContext) STKWLK_NOEXCEPT
+  {
+    StackWalkerInternal * swi = (StackWalkerInternal *)UserContext;
+    if (swi && swi->m_modListSize < _countof(swi->m_modList))
+      swi->m_modList[swi->m_modListSize++] = BaseOfDll;
+    return TRUE;
+  }
+
+  int UpdateModulesList() STKWLK_NOEXCEPT
+  {
+    m_modListSize = 0;
+    Sym.EnumerateModules(m_hProcess, (T_SYM_ENUMMODULES_CALLBACK64)SymEnumModulesCallback, this);
+    return m_modListSize;
+  }
+
+  // force = false keeps the modules of the target process for the next LoadModules
+  bool UnloadModules(bool force = false) STKWLK_NOEXCEPT
+  {
+    bool result = false;
+    int i;
+    int mcnt;
+    if (force == false && m_liveModules.count > 0 && m_pSnapshot == NULL)
+    {
+      m_modulesLoaded = false;
+      m_showLoadModules = false;
+      return true;
+    }
+    ModuleListFree(m_liveModules);
+    ModInfoClear();
+    if (m_SymInitialized == false || m_modulesNumber <= 0)
+    {
+      result = true;
+      goto fin;
+    }
+    result = false;
+    mcnt = UpdateModulesList();
+    if (mcnt <= 0)
+      goto fin;
+
+    for (i = 0; i < mcnt; i++)
+    {
+      Sym.UnloadModule(m_hProcess, m_modList[i]);
+    }
+    result = true;
+  fin:  
+    m_modulesLoaded = false;
+    m_modulesNumber = 0;
+    m_showLoadModules = false;
+    return result;
+  }
+
+  void OnDbgHelpErr(SW_CSTR szFuncName, DWORD gle = 0, DWORD64 addr = 0) STKWLK_NOEXCEPT
+  {
+    StackWalkerBase::TDbgHelpErr data(szFuncName, gle, addr);
+    if (m_parent)
+      m_parent->OnDbgHelpErr(data);
+  }
+
+  SW_CSTR GetSymTypeNameById(SYM_TYPE stype) STKWLK_NOEXCEPT
+  {
+    switch (stype)
     {
     case SymNone:      return _T("-nosymbols-");
     case SymCoff:      return _T("COFF");
@@ -1371,797 +2932,4567 @@ public:
     case 7:            return _T("DIA");
     case 8:            return _T("Virtual");
     }
-    return NULL;
+    return NULL;
+  }
+
+  typedef struct _TFrameInfoBuf   // buffers for the strings of TCallstackEntry
+  {
+    SW_CHR               undName[STACKWALK_MAX_NAMELEN];
+    SW_CHR               undFullName[STACKWALK_MAX_NAMELEN];
+    T_SW_SYM_INFO        symInf;
+    T_IMAGEHLP_MODULE64  Module;
+    T_IMAGEHLP_LINE64    Line;
+  } TFrameInfoBuf;
+
+  // Module info of the address from the module info cache. Returns NULL if the info is
+  // not cacheable, the caller then queries dbghelp directly.
+  const TModInfoItem * GetModInfo(DWORD64 addr, T_IMAGEHLP_MODULE64 & modInfo) STKWLK_NOEXCEPT
+  {
+    DWORD64 base = (Sym.GetModuleBase != NULL) ? Sym.GetModuleBase(m_hProcess, addr) : 0;
+    if (base == 0)
+      return NULL;
+    TModInfoItem ** bucket = &m_modInfo[ModInfoHash(base)];
+    for (TModInfoItem * item = *bucket; item != NULL; item = item->next)
+      if (item->baseOfImage == base)
+        return item;
+    if (GetModuleInfo(m_hProcess, base, modInfo) == false)
+      return NULL;
+    if (modInfo.SymType == SymDeferred)
+      return NULL;   // the symbols are not loaded yet
+    TModInfoItem * item = (TModInfoItem *) malloc(sizeof(TModInfoItem));
+    if (item == NULL)
+      return NULL;
+    item->baseOfImage = modInfo.BaseOfImage;
+    item->symTypeString = GetSymTypeNameById(modInfo.SymType);
+    item->moduleName = StrPoolIntern(modInfo.ModuleName);
+    item->loadedImageName = StrPoolIntern(modInfo.LoadedImageName);
+    if (item->moduleName == NULL || item->loadedImageName == NULL || item->baseOfImage != base)
+    {
+      free(item);
+      return NULL;
+    }
+    item->next = *bucket;
+    *bucket = item;
+    return item;
+  }
+
+  // Retrieve symbol, line and module info for the address
+  void GetFrameInfo(DWORD64 addr, TCallstackEntry & entry, TFrameInfoBuf & fbuf) STKWLK_NOEXCEPT
+  {
+    DWORD err_sym = 0;    // SymFromAddr
+    DWORD err_lfa = 0;    // GetLineFromAddr
+    DWORD err_gmi = 0;    // GetModuleInfo
+
+    LARGE_INTEGER t;
+
+    entry.offset = addr;
+    if (SymCacheFind(addr, entry, err_sym, err_lfa))
+    {
+      ReportFrameErrors(addr, 0, err_sym, err_lfa);
+      return;
+    }
+
+    memset(&fbuf.Line, 0, sizeof(fbuf.Line));
+    fbuf.Line.SizeOfStruct = sizeof(fbuf.Line);
+
+    // show procedure info (SymGetSymFromAddr64())
+    StatBegin(t);
+    SW_CSTR sname = SymFromAddr(m_hProcess, addr, &entry.offsetFromSymbol, fbuf.symInf);
+    if (sname != NULL)
+    {
+      entry.name = sname;
+      entry.undName = sname;
+      entry.undFullName = sname;
+      // only C++ decorated names need to be copied, the rest is returned in place
+      // (with SYMOPT_UNDNAME dbghelp already returns most names undecorated)
+      if (sname[0] == '?')
+      {
+        if (Sym.UnDecorateName(sname, fbuf.undName, _countof(fbuf.undName), UNDNAME_NAME_ONLY) != 0)
+          entry.undName = fbuf.undName;
+        if (Sym.UnDecorateName(sname, fbuf.undFullName, _countof(fbuf.undFullName), UNDNAME_COMPLETE) != 0)
+          entry.undFullName = fbuf.undFullName;
+      }
+    }
+    else
+      err_sym = GetLastError() ? GetLastError() : ERROR_INVALID_STATE;
+    StatEnd(StackWalkerBase::StatSymFromAddr, t);
+
+    // show line number info, NT5.0-method (SymGetLineFromAddr64())
+    if (Sym.GetLineFromAddr != NULL)
+    { // yes, we have SymGetLineFromAddr64()
+      StatBegin(t);
+      BOOL rc = Sym.GetLineFromAddr(m_hProcess, addr, &entry.offsetFromLine, &fbuf.Line);
+      if (rc != FALSE)
+      {
+        entry.lineNumber = fbuf.Line.LineNumber;
+        entry.lineFileName = StrPoolIntern(fbuf.Line.FileName);
+        if (entry.lineFileName == NULL)
+          entry.lineFileName = fbuf.Line.FileName;
+      }
+      else
+        if (GetLastError() != ERROR_INVALID_ADDRESS)
+          err_lfa = GetLastError();
+      StatEnd(StackWalkerBase::StatGetLineFromAddr, t);
+    } // yes, we have SymGetLineFromAddr64()
+
+    // show module info (SymGetModuleInfo64())
+    StatBegin(t);
+    const TModInfoItem * mi = GetModInfo(addr, fbuf.Module);
+    if (mi != NULL)
+    {
+      entry.symTypeString = mi->symTypeString;
+      entry.moduleName = mi->moduleName;
+      entry.baseOfImage = mi->baseOfImage;
+      entry.loadedImageName = mi->loadedImageName;
+    }
+    else if (this->GetModuleInfo(this->m_hProcess, addr, fbuf.Module) != false)
+    {
+      // got module info OK
+      entry.symTypeString = GetSymTypeNameById(fbuf.Module.SymType);
+      entry.moduleName = fbuf.Module.ModuleName;
+      entry.baseOfImage = fbuf.Module.BaseOfImage;
+      entry.loadedImageName = fbuf.Module.LoadedImageName;
+    }
+    else
+      err_gmi = GetLastError() ? GetLastError() : ERROR_INVALID_STATE;
+    StatEnd(StackWalkerBase::StatGetModuleInfo, t);
+
+    // cache only the entries which belong to a known module (with the errors of the lookups)
+    if (err_gmi == 0)
+      SymCacheAdd(entry, err_sym, err_lfa);
+
+    ReportFrameErrors(addr, err_gmi, err_sym, err_lfa);
+  }
+
+  void ReportFrameErrors(DWORD64 addr, DWORD err_gmi, DWORD err_sym, DWORD err_lfa) STKWLK_NOEXCEPT
+  {
+    if (err_gmi)
+      this->OnDbgHelpErr(_T("SymGetModuleInfo64"), err_gmi, addr);
+    else if (err_sym)
+      this->OnDbgHelpErr(_T("SymGetSymFromAddr"), err_sym, addr);
+    else if (err_lfa)
+      this->OnDbgHelpErr(_T("SymGetLineFromAddr64"), err_lfa, addr);
+  }
+
+  typedef struct _TThreadData
+  {
+    ULONGLONG             qwMagic;    // must be qwThreadDataMagic
+    StackWalkerInternal * swi;
+    PReadMemRoutine       pReadMemFunc;
+    LPVOID                pUserData;
+    const StackWalkerBase::TSnapshot * pSnapshot;
+    DWORD64 *             rawFrames;  // raw mode: only the addresses are collected
+    int                   rawMax;
+    int                   rawCount;
+  } TThreadData;
+
+  bool ShowSnapshot(const StackWalkerBase::TSnapshot & snap, TThreadData & tdata) STKWLK_NOEXCEPT;
+
+  bool ShowCallstack(HANDLE          hThread,
+                     const CONTEXT & context,
+                     TThreadData   & tdata) STKWLK_NOEXCEPT;
+
+  bool ShowFrames(const DWORD64 * frames, int count) STKWLK_NOEXCEPT;
+  bool ShowFramesBatch(const DWORD64 * addrs, int count) STKWLK_NOEXCEPT;
+
+  static BOOL WINAPI MyReadProcMem(HANDLE  hProcess,
+                                   DWORD64 qwBaseAddress,
+                                   PVOID   lpBuffer,
+                                   DWORD   nSize,
+                                   LPDWORD lpNumberOfBytesRead) STKWLK_NOEXCEPT;
+
+  bool InitAndLoad(bool showLoadModules = false) STKWLK_NOEXCEPT;
+};
+
+const ULONGLONG qwThreadDataMagic = 0x00A1B2F4D9F00D33;
+typedef StackWalkerInternal::TThreadData          TThreadData;
+typedef StackWalkerInternal::T_SW_SYM_INFO        T_SW_SYM_INFO;
+typedef StackWalkerInternal::T_IMAGEHLP_MODULE64  T_IMAGEHLP_MODULE64;
+
+// #############################################################
+
+StackWalkerBase::TDbgHelpErr::TDbgHelpErr(SW_CSTR szFuncName, DWORD gle, DWORD64 addr) STKWLK_NOEXCEPT
+{
+  this->szFuncName = szFuncName;
+  this->gle = gle;
+  this->addr = addr;
+}
+
+// =============================================================
+
+#define STKWLK_CURRENT_THREAD_HANDLE  ((HANDLE)(ULONG_PTR)-2)
+
+typedef LONG (WINAPI * TNtQueryInfoThread)(HANDLE thread, DWORD infoClass, PVOID info, ULONG infoLen, PULONG retLen);
+
+static TNtQueryInfoThread NtQueryInfoThread = NULL;
+
+typedef struct _ThreadBasicInfo
+{
+  LONG      ExitStatus;
+  LPVOID    TebBaseAddress;
+  HANDLE    UniqueProcess;
+  HANDLE    UniqueThread; 
+  ULONG_PTR AffinityMask;
+  LONG      Priority;
+  LONG      BasePriority;
+} ThreadBasicInfo;
+
+static DWORD GetThreadIdByHandle(HANDLE thread) STKWLK_NOEXCEPT
+{
+  if (thread == STKWLK_CURRENT_THREAD_HANDLE)
+    return GetCurrentThreadId();
+  if (thread == NULL)
+    return 0;
+#if _WIN32_WINNT >= 0x0502
+  return GetThreadId(thread);
+#else
+  if (NtQueryInfoThread == NULL)
+  {
+    HMODULE ntdll = GetModuleHandleW(L"ntdll");
+    if (ntdll == NULL)
+      return 0;
+    NtQueryInfoThread = (TNtQueryInfoThread) GetProcAddress(ntdll, "NtQueryInformationThread");
+    if (NtQueryInfoThread == NULL)
+      return 0;
+  }
+  ThreadBasicInfo tbi = { 0 };
+  ULONG len;
+  LONG ns = NtQueryInfoThread(thread, 0, (PVOID)&tbi, sizeof(tbi), &len);
+  return (ns == 0) ? (DWORD)(ULONG_PTR)tbi.UniqueThread : 0;
+#endif
+}
+
+typedef USHORT (WINAPI * TRtlCaptureStackBackTrace)(ULONG FramesToSkip, ULONG FramesToCapture, PVOID * BackTrace, PULONG BackTraceHash);
+
+static TRtlCaptureStackBackTrace RtlCaptureStackBackTraceFn = NULL;
+
+static PNT_TIB GetCurrentTIB() STKWLK_NOEXCEPT
+{
+#if _MSC_VER >= 1400
+  return (PNT_TIB)NtCurrentTeb();
+#else
+  PNT_TIB lpTIB;
+  __asm mov eax, fs:[0x18]
+  __asm mov[lpTIB], eax
+  return lpTIB;
+#endif
+}
+
+// =============================================================
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+extern "C" void* __cdecl _getptd();
+#endif
+#if defined(_MSC_VER) && _MSC_VER >= 1900
+extern "C" void** __cdecl __current_exception_context();
+#endif
+
+static PCONTEXT get_current_exception_context() STKWLK_NOEXCEPT
+{
+  PCONTEXT * pctx = NULL;
+#if _MSC_VER < 1400 && !defined(_MT)
+  return NULL;
+#elif _MSC_VER < 1900
+  char * ptd = (char *)_getptd();
+  if (ptd == NULL)
+    return NULL;
+#if _MSC_VER >= 1200 && _MSC_VER < 1300
+  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x70 : 0xC0));  // VC6
+#elif _MSC_VER >= 1300 && _MSC_VER < 1400
+  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x7C : 0xE0));  // VC7 ... vs2003
+#else
+  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x8C : 0xF8));  // vs2005 ... vs2013
+#endif
+#else // _MSC_VER >= 1900
+  pctx = (PCONTEXT *)__current_exception_context();
+#endif
+  return pctx ? *pctx : NULL;
+}
+
+// =============================================================
+
+// ===========================================================================================
+// Pool of the idle symbol engines (option ShareEngine)
+
+static volatile LONG         g_sharedLock = 0;
+static StackWalkerInternal * g_sharedEngines = NULL;
+static int                   g_sharedCount = 0;
+static bool                  g_sharedAtExit = false;
+
+static void __cdecl SharedEnginesAtExit()
+{
+  StackWalkerBase::ReleaseSharedEngines();
+}
+
+static StackWalkerInternal * SharedEngineAcquire(int options, SW_CSTR szSymPath, DWORD dwProcessId,
+                                                 HANDLE hProcess) STKWLK_NOEXCEPT
+{
+  StackWalkerInternal * sw;
+  StackWalkerInternal ** psw;
+  SpinLock(&g_sharedLock);
+  for (psw = &g_sharedEngines; (sw = *psw) != NULL; psw = &sw->m_nextShared)
+  {
+    if (!sw->ShareKeyMatches(options, szSymPath, dwProcessId, hProcess))
+      continue;
+    *psw = sw->m_nextShared;
+    g_sharedCount--;
+    break;
+  }
+  SpinUnlock(&g_sharedLock);
+  return sw;
+}
+
+// returns false if the engine is not kept (the caller destroys it)
+static bool SharedEngineRelease(StackWalkerInternal * sw) STKWLK_NOEXCEPT
+{
+  bool result = false;
+  if (!sw->IsShareable())
+    return false;     // nothing to share, not isolated or changed by the setters
+  SpinLock(&g_sharedLock);
+  if (g_sharedCount < STKWLK_MAX_SHARED_ENGINES)
+  {
+    sw->m_parent = NULL;
+    sw->m_nextShared = g_sharedEngines;
+    g_sharedEngines = sw;
+    g_sharedCount++;
+    result = true;
+    if (!g_sharedAtExit)
+      g_sharedAtExit = (atexit(SharedEnginesAtExit) == 0);
+  }
+  SpinUnlock(&g_sharedLock);
+  return result;
+}
+
+void StackWalkerBase::ReleaseSharedEngines() STKWLK_NOEXCEPT
+{
+  SpinLock(&g_sharedLock);
+  StackWalkerInternal * list = g_sharedEngines;
+  g_sharedEngines = NULL;
+  g_sharedCount = 0;
+  SpinUnlock(&g_sharedLock);
+  while (list != NULL)
+  {
+    StackWalkerInternal * sw = list;
+    list = sw->m_nextShared;
+    sw->~StackWalkerInternal();
+    free(sw);
+  }
+}
+
+// ===========================================================================================
+
+bool StackWalkerBase::Init(ExceptType extype, int options, SW_CSTR szSymPath, DWORD dwProcessId,
+                           HANDLE hProcess, PEXCEPTION_POINTERS exp) STKWLK_NOEXCEPT
+{
+  PCONTEXT ctx = NULL;
+  if (extype == AfterCatch)
+    ctx = get_current_exception_context();
+  if (extype == AfterExcept && exp)
+    ctx = exp->ContextRecord;
+  if (extype != NonExcept)
+    options &= ~PrefetchVersions;   // an exception may be handled under the loader lock
+  this->m_sw = NULL;
+  if (options & ShareEngine)
+  {
+    this->m_sw = SharedEngineAcquire(options, szSymPath, dwProcessId, hProcess);
+    if (this->m_sw != NULL)
+    {
+      this->m_sw->Reuse(this, ctx);
+      return true;
+    }
+  }
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerInternal));
+  if (!buf)
+    return false;
+  memset(buf, 0, sizeof(StackWalkerInternal));
+  this->m_sw = new(buf) StackWalkerInternal(this, options, hProcess, ctx);  // placement new
+  SetTargetProcess(dwProcessId, hProcess);
+  SetSymPath(szSymPath);
+  if (options & ShareEngine)
+    this->m_sw->ShareKeySet(dwProcessId, hProcess, szSymPath);
+  return true;
+}
+
+StackWalkerBase::StackWalkerBase(DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
+{
+  Init(NonExcept, OptionsAll, NULL, dwProcessId, hProcess);
+}
+
+StackWalkerBase::StackWalkerBase(int options, SW_CSTR szSymPath, DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
+{
+  Init(NonExcept, options, szSymPath, dwProcessId, hProcess);
+}
+
+StackWalkerBase::StackWalkerBase(ExceptType extype, int options, PEXCEPTION_POINTERS exp) STKWLK_NOEXCEPT
+{
+  Init(extype, options, NULL, GetCurrentProcessId(), GetCurrentProcess(), exp);
+}
+
+StackWalkerBase::~StackWalkerBase() STKWLK_NOEXCEPT
+{
+  if (m_sw != NULL) {
+    // the derived class must stop the workers in its destructor: they call its virtual methods
+    assert(m_sw->m_asyncThreadsCount == 0);
+    m_sw->StopAsync(false);        // no callbacks from the workers anymore
+    if ((m_sw->m_shareOptions & ShareEngine) == 0 || !SharedEngineRelease(m_sw))
+    {
+      m_sw->~StackWalkerInternal();  // call the object's destructor
+      free(m_sw);
+    }
+  }
+  m_sw = NULL;
+}
+
+bool StackWalkerBase::SetSymPath(SW_CSTR szSymPath) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return false;
+  free((LPVOID)m_sw->m_szSymPath);
+  m_sw->m_szSymPath = NULL;
+  if (szSymPath == NULL)
+    return true;
+  m_sw->m_szSymPath = (SW_CSTR) sw_sdup(szSymPath);
+  if (m_sw->m_szSymPath)
+    m_sw->m_options |= SymBuildPath;
+  return m_sw->m_szSymPath ? true : false;
+}
+
+bool StackWalkerBase::SetDbgHelpPath(LPCWSTR szDllPath) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return false;
+  free((LPVOID)m_sw->m_szDbgHelpPath);
+  m_sw->m_szDbgHelpPath = NULL;
+  if (szDllPath == NULL)
+    return true;
+  m_sw->m_szDbgHelpPath = (LPCWSTR)_wcsdup(szDllPath);
+  return m_sw->m_szDbgHelpPath ? true : false;
+}
+
+bool StackWalkerBase::SetTargetProcess(DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return false;
+  m_sw->EnterCriticalSection();
+  m_sw->UnloadModules(true);
+  m_sw->SymCacheClear();
+  m_sw->m_dwProcessId = dwProcessId;
+  m_sw->m_hProcess = hProcess;
+  m_sw->LeaveCriticalSection();
+  return true;
+}
+
+void StackWalkerBase::SetSymCacheSize(size_t maxBytes) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return;
+  m_sw->EnterCriticalSection();
+  m_sw->SymCacheSetMax(maxBytes);
+  m_sw->LeaveCriticalSection();
+}
+
+bool StackWalkerBase::AddModuleFilter(SW_CSTR szModule, FrameFilter filter) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (szModule == NULL || szModule[0] == 0 || filter < FrameDrop || filter > FrameCollapse)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  size_t len = sw_slen(szModule);
+  StackWalkerInternal::TModuleFilter * f = (StackWalkerInternal::TModuleFilter *)
+      malloc(sizeof(StackWalkerInternal::TModuleFilter) + len * sizeof(SW_CHR));
+  if (f == NULL)
+  {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return false;
+  }
+  f->action = filter;
+  memcpy(f->name, szModule, (len + 1) * sizeof(SW_CHR));
+  m_sw->EnterCriticalSection();
+  // appended: the first matching filter of a module wins
+  StackWalkerInternal::TModuleFilter ** pp = &m_sw->m_modFilters;
+  while (*pp != NULL)
+    pp = &(*pp)->next;
+  f->next = NULL;
+  *pp = f;
+  if (filter == FrameAllow)
+    m_sw->m_allowFilters = true;
+  m_sw->SlotActionsReset();
+  m_sw->LeaveCriticalSection();
+  return true;
+}
+
+bool StackWalkerBase::AddRangeFilter(DWORD64 startAddr, DWORD64 endAddr) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (startAddr >= endAddr)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  bool result = false;
+  m_sw->EnterCriticalSection();
+  DWORD64 * ranges = (DWORD64 *) realloc(m_sw->m_dropRanges, (m_sw->m_dropRangesCount + 1) * 2 * sizeof(DWORD64));
+  if (ranges != NULL)
+  {
+    ranges[m_sw->m_dropRangesCount * 2] = startAddr;
+    ranges[m_sw->m_dropRangesCount * 2 + 1] = endAddr;
+    m_sw->m_dropRanges = ranges;
+    m_sw->m_dropRangesCount++;
+    result = true;
+  }
+  m_sw->LeaveCriticalSection();
+  if (result == false)
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+  return result;
+}
+
+void StackWalkerBase::SetSkipFrames(int count) STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return;
+  m_sw->EnterCriticalSection();
+  m_sw->m_skipFrames = (count > 0) ? count : 0;
+  m_sw->LeaveCriticalSection();
+}
+
+void StackWalkerBase::ClearFrameFilters() STKWLK_NOEXCEPT
+{
+  if (m_sw == NULL)
+    return;
+  m_sw->EnterCriticalSection();
+  m_sw->FrameFiltersFree();
+  m_sw->LeaveCriticalSection();
+}
+
+PCONTEXT StackWalkerBase::GetCurrentExceptionContext() STKWLK_NOEXCEPT
+{
+  return get_current_exception_context();
+}
+
+LPVOID StackWalkerBase::GetUserData() STKWLK_NOEXCEPT
+{
+  return (this->m_sw == NULL) ? NULL : this->m_sw->m_pUserData;
+}
+
+bool StackWalkerInternal::InitAndLoad(bool showLoadModules) STKWLK_NOEXCEPT
+{
+  if (m_SymInitialized == true && m_modulesLoaded == true)
+    return true;
+
+  // Build the sym-path:
+  SW_STR szSymPath = NULL;
+  if (m_SymInitialized == false && (m_options & StackWalkerBase::SymBuildPath) != 0)
+  {
+    const size_t nSymPathLen = 4096;
+    szSymPath = (SW_STR) malloc((nSymPathLen + 8) * sizeof(SW_CHR));
+    if (szSymPath == NULL)
+    {
+      SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      return false;
+    }
+    szSymPath[0] = 0;
+    // Now first add the (optional) provided sympath:
+    SymPathAdd(szSymPath, nSymPathLen, this->m_szSymPath, false);
+    SymPathAdd(szSymPath, nSymPathLen, _T("."), true);
+
+    size_t len;
+    const size_t nTempLen = 1024;
+    SW_CHR       szTemp[nTempLen];
+    // Now add the current directory:
+    len = GetCurrentDirectory(nTempLen, szTemp);
+    if (len > 0 && len < nTempLen-1)
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, true);
+
+    // Now add the path for the main-module:
+    len = GetModuleFileName(NULL, szTemp, nTempLen);
+    if (len > 0 && len < nTempLen-1)
+    {
+      for (SW_STR p = (szTemp + sw_slen(szTemp) - 1); p >= szTemp; --p)
+      {
+        // locate the rightmost path separator
+        if ((*p == '\\') || (*p == '/') || (*p == ':'))
+        {
+          *p = 0;
+          break;
+        }
+      } // for (search for path separator...)
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, true);
+    }
+    len = GetEnvironmentVariable(_T("_NT_SYMBOL_PATH"), szTemp, nTempLen);
+    if (len > 0 && len < nTempLen-1)
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, false);
+    len = GetEnvironmentVariable(_T("_NT_ALTERNATE_SYMBOL_PATH"), szTemp, nTempLen);
+    if (len > 0 && len < nTempLen-1)
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, false);
+    len = GetEnvironmentVariable(_T("SYSTEMROOT"), szTemp, nTempLen);
+    if (len > 0 && len < nTempLen-1)
+    {
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, true);
+      // also add the "system32"-directory:
+      MyStrCat(szTemp, nTempLen, _T("\\system32"));
+      SymPathAdd(szSymPath, nSymPathLen, szTemp, true);
+    }
+
+    if ((this->m_options & StackWalkerBase::SymUseSymSrv) != 0)
+    {
+      SW_CSTR drive = _T("c:");
+      len = GetEnvironmentVariable(_T("SYSTEMDRIVE"), szTemp, nTempLen);
+      if (len > 0 && len < nTempLen-1)
+      {
+        drive = szTemp;
+      }
+      SW_CHR szSrv[nTempLen + 64];
+      szSrv[0] = 0;
+      MyStrCat(szSrv, _countof(szSrv), _T("SRV*"));
+      MyStrCat(szSrv, _countof(szSrv), drive);
+      MyStrCat(szSrv, _countof(szSrv), _T("\\websymbols*"));
+      MyStrCat(szSrv, _countof(szSrv), _T("https://msdl.microsoft.com/download/symbols"));
+      SymPathAdd(szSymPath, nSymPathLen, szSrv, false);
+    }
+  } // if SymBuildPath
+
+  bool bRet = false;
+  if (m_SymInitialized == false)
+  {
+    // First Init the whole stuff...
+    bRet = !!this->Init(szSymPath);
+    if (szSymPath != NULL)
+      free(szSymPath);
+    szSymPath = NULL;
+    if (bRet == false)
+    {
+      this->OnDbgHelpErr(_T("Error while initializing dbghelp.dll"));
+      SetLastError(ERROR_DLL_INIT_FAILED);
+      return false;
+    }
+  }
+  this->m_showLoadModules = showLoadModules;
+  LARGE_INTEGER t;
+  StatBegin(t);
+  bRet = this->LoadModules(this->m_hProcess, this->m_dwProcessId);
+  StatEnd(StackWalkerBase::StatLoadModules, t);
+  return bRet;
+}
+
+bool StackWalkerBase::ShowModules(LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+  this->m_sw->UnloadModules(true);   // report all modules
+  bool bRet = this->m_sw->InitAndLoad(true);
+  this->m_sw->LeaveCriticalSection();
+  if (bRet == false)
+    SetLastError(ERROR_DLL_INIT_FAILED);
+  return true;
+}
+
+bool StackWalkerBase::ShowCallstack(HANDLE          hThread,
+                                    const CONTEXT * context,
+                                    PReadMemRoutine pReadMemFunc,
+                                    LPVOID          pUserData) STKWLK_NOEXCEPT
+{
+  bool          result = false;
+  CONTEXT       c;
+  bool          isCurrentThread = false;
+  bool          isThreadSuspended = false;
+  PNT_TIB       lpTIB = NULL;
+  LPVOID        ArbitraryUserPointer = NULL;
+  TThreadData   tdata = { 0 };
+
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+
+  tdata.qwMagic = qwThreadDataMagic;
+  tdata.swi = m_sw;
+  tdata.pReadMemFunc = pReadMemFunc;
+  tdata.pUserData = pUserData;
+
+  if (hThread == NULL)
+    hThread = STKWLK_CURRENT_THREAD_HANDLE;
+
+  if (hThread == STKWLK_CURRENT_THREAD_HANDLE || GetThreadIdByHandle(hThread) == GetCurrentThreadId())
+    isCurrentThread = true;
+
+  if (context == NULL)
+  {
+    if (isCurrentThread == true)
+    {
+      memset(&c, 0, sizeof(c));
+      if (m_sw->m_ctx.ContextFlags != 0)
+        c = m_sw->m_ctx;   // context taken at Init
+      else
+      {
+        c.ContextFlags = STKWLK_CONTEXT_FLAGS;
+#if defined(_M_IX86)
+        // The following should be enough for walking the callstack...
+        __asm    call x
+        __asm x: pop eax
+        __asm    mov c.Eip, eax
+        __asm    mov c.Ebp, ebp
+        __asm    mov c.Esp, esp
+#else
+        // The following is defined for x86 (XP and higher), x64 and IA64
+        RtlCaptureContext(&c);
+#endif
+      }
+    }
+  }
+
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+
+  if (context == NULL)
+  {
+    if (isCurrentThread == false)
+    {
+      DWORD dwCount = SuspendThread(hThread);
+      if (dwCount == (DWORD)-1)
+        goto fin;
+      isThreadSuspended = true;
+      memset(&c, 0, sizeof(CONTEXT));
+      c.ContextFlags = STKWLK_CONTEXT_FLAGS;
+
+      // TODO: Detect if you want to get a thread context of a different process, which is running a different processor architecture...
+      // This does only work if we are x64 and the target process is x64 or x86;
+      // It cannot work, if this process is x64 and the target process is x64... this is not supported...
+      // See also: http://www.howzatt.demon.co.uk/articles/DebuggingInWin64.html
+      if (GetThreadContext(hThread, &c) == FALSE)
+        goto fin;
+    }
+  }
+
+  if (context != NULL)
+    c = *context;
+
+  this->m_sw->UnloadModules();
+  if (this->m_sw->InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+
+  lpTIB = GetCurrentTIB();
+  ArbitraryUserPointer = lpTIB->ArbitraryUserPointer;  // save original value
+
+  result = m_sw->ShowCallstack(hThread, c, tdata);
+
+fin:
+  if (lpTIB)
+    lpTIB->ArbitraryUserPointer = ArbitraryUserPointer;   // restore original value
+  if (isThreadSuspended)
+    ResumeThread(hThread);
+  this->m_sw->LeaveCriticalSection();
+  return result;
+}
+
+bool StackWalkerInternal::ShowCallstack(HANDLE          hThread,
+                                        const CONTEXT & c,
+                                        TThreadData   & tdata) STKWLK_NOEXCEPT
+{  
+  TCallstackEntry      csEntry;
+  TFrameInfoBuf        fbuf;
+  LARGE_INTEGER        t;
+  int                  frameNum;
+  bool                 bLastEntryCalled = true;
+  int                  curRecursionCount = 0;
+  int                  shownCount = 0;
+  int                  collapseSlot = 0;
+  bool                 filtered = HasFrameFilters();
+
+  PNT_TIB lpTIB = GetCurrentTIB();
+
+  // init STACKFRAME for first call
+  STACKFRAME64 s; // in/out stackframe
+  memset(&s, 0, sizeof(s));
+  DWORD imageType;
+#ifdef _M_IX86
+  // normally, call ImageNtHeader() and use machine info from PE header
+  imageType = IMAGE_FILE_MACHINE_I386;
+  s.AddrPC.Offset = c.Eip;
+  s.AddrPC.Mode = AddrModeFlat;
+  s.AddrFrame.Offset = c.Ebp;
+  s.AddrFrame.Mode = AddrModeFlat;
+  s.AddrStack.Offset = c.Esp;
+  s.AddrStack.Mode = AddrModeFlat;
+#elif _M_X64
+  imageType = IMAGE_FILE_MACHINE_AMD64;
+  s.AddrPC.Offset = c.Rip;
+  s.AddrPC.Mode = AddrModeFlat;
+  s.AddrFrame.Offset = c.Rsp;
+  s.AddrFrame.Mode = AddrModeFlat;
+  s.AddrStack.Offset = c.Rsp;
+  s.AddrStack.Mode = AddrModeFlat;
+#elif _M_IA64
+  imageType = IMAGE_FILE_MACHINE_IA64;
+  s.AddrPC.Offset = c.StIIP;
+  s.AddrPC.Mode = AddrModeFlat;
+  s.AddrFrame.Offset = c.IntSp;
+  s.AddrFrame.Mode = AddrModeFlat;
+  s.AddrBStore.Offset = c.RsBSP;
+  s.AddrBStore.Mode = AddrModeFlat;
+  s.AddrStack.Offset = c.IntSp;
+  s.AddrStack.Mode = AddrModeFlat;
+#else
+#error "Platform not supported!"
+#endif
+
+  for (frameNum = 0;; ++frameNum)
+  {
+    LPVOID ArbitraryUserPointer = lpTIB->ArbitraryUserPointer;   // save
+    lpTIB->ArbitraryUserPointer = (LPVOID)&tdata;
+    // get next stack frame (StackWalk64(), SymFunctionTableAccess64(), SymGetModuleBase64())
+    // if this returns ERROR_INVALID_ADDRESS (487) or ERROR_NOACCESS (998), you can
+    // assume that either you are done, or that the stack is so hosed that the next
+    // deeper frame could not be found.
+    // CONTEXT need not to be supplied if imageTyp is IMAGE_FILE_MACHINE_I386!
+    StatBegin(t);
+    BOOL rc = Sym.StackWalk(imageType, m_hProcess, hThread, &s, (PVOID)&c, MyReadProcMem, 
+                            Sym.FunctionTableAccess, Sym.GetModuleBase, NULL);
+    StatEnd(StackWalkerBase::StatStackWalk, t);
+    lpTIB->ArbitraryUserPointer = ArbitraryUserPointer;  // restore
+    if (rc == FALSE)
+    {
+      // INFO: "StackWalk64" does not set "GetLastError"...
+      this->OnDbgHelpErr(_T("StackWalk64"), 0, s.AddrPC.Offset);
+      break;
+    }
+
+    memset((LPVOID)&csEntry, 0, sizeof(csEntry));
+    csEntry.offset = s.AddrPC.Offset;
+    if (s.AddrPC.Offset == s.AddrReturn.Offset)
+    {
+      if ((m_MaxRecursionCount > 0) && (curRecursionCount > m_MaxRecursionCount))
+      {
+        this->OnDbgHelpErr(_T("StackWalk64-Endless-Callstack!"), 0, s.AddrPC.Offset);
+        break;
+      }
+      curRecursionCount++;
+    }
+    else
+      curRecursionCount = 0;
+
+    if (tdata.rawFrames != NULL)
+    {
+      if (s.AddrPC.Offset != 0)
+        tdata.rawFrames[tdata.rawCount++] = s.AddrPC.Offset;
+      if (s.AddrReturn.Offset == 0 || tdata.rawCount >= tdata.rawMax)
+        break;
+      continue;
+    }
+
+    if (filtered && !FilterFrame(s.AddrPC.Offset, frameNum, collapseSlot))
+    {
+      if (s.AddrReturn.Offset == 0)
+        break;
+      continue;
+    }
+
+    if (s.AddrPC.Offset != 0)
+      GetFrameInfo(s.AddrPC.Offset, csEntry, fbuf);
+
+    csEntry.type = (shownCount++ == 0) ? StackWalkerBase::firstEntry : StackWalkerBase::nextEntry;
+    bLastEntryCalled = false;
+    this->OnCallstackEntry(csEntry);
+
+    if (s.AddrReturn.Offset == 0)
+    {
+      bLastEntryCalled = true;
+      csEntry.type = StackWalkerBase::lastEntry;
+      this->OnCallstackEntry(csEntry);
+      SetLastError(ERROR_SUCCESS);
+      break;
+    }
+  } // for ( frameNum )
+
+  // sent even if no frame was shown (e.g. all dropped by the filters), as by ShowFrames
+  csEntry.type = StackWalkerBase::lastEntry;
+  if (bLastEntryCalled == false || (shownCount == 0 && tdata.rawFrames == NULL))
+    this->OnCallstackEntry(csEntry);
+
+  return true;
+}
+
+bool StackWalkerBase::ShowCallstack(const CONTEXT * context, LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  return ShowCallstack(STKWLK_CURRENT_THREAD_HANDLE, context, NULL, pUserData);
+}
+
+bool StackWalkerInternal::ShowFrames(const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+{
+  TCallstackEntry csEntry;
+  TFrameInfoBuf   fbuf;
+
+  int             shownCount = 0;
+  int             collapseSlot = 0;
+  bool            filtered = HasFrameFilters();
+
+  memset((LPVOID)&csEntry, 0, sizeof(csEntry));
+  for (int frameNum = 0; frameNum < count; frameNum++)
+  {
+    if (filtered && !FilterFrame(frames[frameNum], frameNum, collapseSlot))
+      continue;
+    memset((LPVOID)&csEntry, 0, sizeof(csEntry));
+    csEntry.offset = frames[frameNum];
+    if (csEntry.offset != 0)
+      GetFrameInfo(csEntry.offset, csEntry, fbuf);
+    csEntry.type = (shownCount++ == 0) ? StackWalkerBase::firstEntry : StackWalkerBase::nextEntry;
+    this->OnCallstackEntry(csEntry);
+  }
+  csEntry.type = StackWalkerBase::lastEntry;
+  this->OnCallstackEntry(csEntry);
+  return true;
+}
+
+bool StackWalkerInternal::ShowFramesBatch(const DWORD64 * addrs, int count) STKWLK_NOEXCEPT
+{
+  TCallstackEntry   csEntry;
+  TFrameInfoBuf     fbuf;
+  DWORD64 *         uniq = NULL;
+  TSymCacheItem **  items = NULL;
+  int               ucount = 0;
+  int               i;
+  bool              result = false;
+
+  if (count <= 0)
+    return ShowFrames(addrs, count);
+  uniq = (DWORD64 *) malloc(count * sizeof(DWORD64));
+  if (uniq == NULL)
+    goto fin;
+  // resolve each distinct address once, in ascending order (same module and
+  // function are looked up one after another)
+  memcpy(uniq, addrs, count * sizeof(DWORD64));
+  qsort(uniq, count, sizeof(DWORD64), CompareAddr);
+  for (i = 0; i < count; i++)
+    if (ucount == 0 || uniq[ucount - 1] != uniq[i])
+      uniq[ucount++] = uniq[i];
+  items = (TSymCacheItem **) calloc(ucount, sizeof(TSymCacheItem *));
+  if (items == NULL)
+    goto fin;
+  for (i = 0; i < ucount; i++)
+  {
+    memset((LPVOID)&csEntry, 0, sizeof(csEntry));
+    csEntry.offset = uniq[i];
+    if (csEntry.offset != 0)
+      GetFrameInfo(csEntry.offset, csEntry, fbuf);
+    items[i] = SymCacheNewItem(csEntry);
+    if (items[i] == NULL)
+      goto fin;
+  }
+  for (i = 0; i < count; i++)
+  {
+    csEntry = items[FindAddr(uniq, ucount, addrs[i])]->entry;
+    csEntry.type = (i == 0) ? StackWalkerBase::firstEntry : StackWalkerBase::nextEntry;
+    this->OnCallstackEntry(csEntry);
+  }
+  memset((LPVOID)&csEntry, 0, sizeof(csEntry));
+  csEntry.type = StackWalkerBase::lastEntry;
+  this->OnCallstackEntry(csEntry);
+  result = true;
+
+fin:
+  if (items != NULL)
+    for (i = 0; i < ucount; i++)
+      free(items[i]);
+  free(items);
+  free(uniq);
+  if (result == false)
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+  return result;
+}
+
+int StackWalkerBase::CaptureRawCallstack(DWORD64 * frames, int maxFrames, int framesToSkip) STKWLK_NOEXCEPT
+{
+  PVOID addr[STKWLK_MAX_RAW_FRAMES];
+  if (frames == NULL || maxFrames <= 0 || framesToSkip < 0)
+    return 0;
+  if (RtlCaptureStackBackTraceFn == NULL)
+  {
+    HMODULE hKernel = GetModuleHandleW(L"kernel32");
+    if (hKernel == NULL)
+      return 0;
+    RtlCaptureStackBackTraceFn = (TRtlCaptureStackBackTrace) GetProcAddress(hKernel, "RtlCaptureStackBackTrace");
+    if (RtlCaptureStackBackTraceFn == NULL)
+      return 0;
+  }
+  framesToSkip++;   // skip this function
+  if (framesToSkip >= STKWLK_MAX_RAW_FRAMES)
+    return 0;
+  // WinXP requires (FramesToSkip + FramesToCapture) < 63
+  if (maxFrames > STKWLK_MAX_RAW_FRAMES - framesToSkip)
+    maxFrames = STKWLK_MAX_RAW_FRAMES - framesToSkip;
+  int count = RtlCaptureStackBackTraceFn(framesToSkip, maxFrames, addr, NULL);
+  for (int i = 0; i < count; i++)
+    frames[i] = (DWORD64)(ULONG_PTR)addr[i];
+  return count;
+}
+
+bool StackWalkerBase::ShowRawCallstack(const DWORD64 * frames, int count, LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  bool result = false;
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (frames == NULL && count > 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+  this->m_sw->UnloadModules();
+  if (this->m_sw->InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+  result = this->m_sw->ShowFrames(frames, count);
+fin:
+  this->m_sw->LeaveCriticalSection();
+  return result;
+}
+
+// =============================================================
+// Throw sites of C++ exceptions
+
+#define SW_CXX_EXCEPTION_CODE  0xE06D7363    // raised by _CxxThrowException ('msc' | 0xE0000000)
+
+typedef LONG (WINAPI * TVectoredHandler)(PEXCEPTION_POINTERS ExceptionInfo);
+typedef PVOID (WINAPI * TAddVectoredExceptionHandler)(ULONG First, TVectoredHandler Handler);
+typedef ULONG (WINAPI * TRemoveVectoredExceptionHandler)(PVOID Handle);
+typedef VOID (WINAPI * TFlsCallback)(PVOID data);
+typedef DWORD (WINAPI * TFlsAlloc)(TFlsCallback callback);
+typedef PVOID (WINAPI * TFlsGetValue)(DWORD index);
+typedef BOOL (WINAPI * TFlsSetValue)(DWORD index, PVOID data);
+
+// The slot belongs to its thread: only the handler running on that thread and GetThrowCallstack
+// use it. It is freed by the FLS callback when the thread exits (on XP without FLS the slots are
+// kept until the process exits). The index is never freed, the handler may run on any thread.
+struct TThrowSite
+{
+  const void *  object;       // the thrown object
+  int           count;
+  DWORD64       frames[STKWLK_MAX_RAW_FRAMES];
+};
+
+static LONG volatile    g_throwLock = 0;
+static PVOID            g_throwHandler = NULL;
+static DWORD volatile   g_throwIndex = TLS_OUT_OF_INDEXES;   // FLS or TLS index of the slots
+static TFlsGetValue     g_throwGetValue = NULL;
+static TFlsSetValue     g_throwSetValue = NULL;
+
+static VOID WINAPI ThrowSiteFree(PVOID data)
+{
+  free(data);
+}
+
+// allocate the index of the slots once (FLS with a destructor if available, TLS otherwise)
+static bool ThrowSiteIndexAlloc(HMODULE hKernel) STKWLK_NOEXCEPT
+{
+  if (g_throwIndex != TLS_OUT_OF_INDEXES)
+    return true;
+  int fcnt = 0;
+  TFlsAlloc pAlloc;
+  GetProcAddrEx(fcnt, hKernel, "FlsAlloc", (LPVOID*)&pAlloc);
+  GetProcAddrEx(fcnt, hKernel, "FlsGetValue", (LPVOID*)&g_throwGetValue);
+  GetProcAddrEx(fcnt, hKernel, "FlsSetValue", (LPVOID*)&g_throwSetValue);
+  DWORD index = TLS_OUT_OF_INDEXES;
+  if (fcnt == 3)
+    index = pAlloc(ThrowSiteFree);
+  if (index == TLS_OUT_OF_INDEXES)
+  {
+    g_throwGetValue = TlsGetValue;
+    g_throwSetValue = TlsSetValue;
+    index = TlsAlloc();
+  }
+  g_throwIndex = index;     // published after the accessors
+  return index != TLS_OUT_OF_INDEXES;
+}
+
+static DWORD64 GetContextPC(const CONTEXT * c) STKWLK_NOEXCEPT
+{
+#ifdef _M_IX86
+  return c->Eip;
+#elif _M_X64
+  return c->Rip;
+#elif _M_IA64
+  return c->StIIP;
+#else
+  return 0;
+#endif
+}
+
+// Called for every exception before the frame based handlers, so the slot is filled when the
+// catch block runs. Only the raw return addresses are saved (no heap allocation after the first
+// throw of the thread, no dbghelp).
+static LONG WINAPI ThrowSiteHandler(PEXCEPTION_POINTERS pExp) STKWLK_NOEXCEPT
+{
+  PEXCEPTION_RECORD rec = pExp->ExceptionRecord;
+  if (rec->ExceptionCode != SW_CXX_EXCEPTION_CODE || rec->NumberParameters < 3)
+    return EXCEPTION_CONTINUE_SEARCH;
+  if (rec->ExceptionInformation[2] == 0)
+    return EXCEPTION_CONTINUE_SEARCH;    // rethrow ("throw;"), keep the original throw site
+  DWORD index = g_throwIndex;
+  if (index == TLS_OUT_OF_INDEXES)
+    return EXCEPTION_CONTINUE_SEARCH;
+  TThrowSite * site = (TThrowSite *)g_throwGetValue(index);
+  if (site == NULL)
+  {
+    site = (TThrowSite *)malloc(sizeof(TThrowSite));
+    if (site == NULL)
+      return EXCEPTION_CONTINUE_SEARCH;
+    if (g_throwSetValue(index, site) == FALSE)
+    {
+      free(site);
+      return EXCEPTION_CONTINUE_SEARCH;
+    }
+  }
+  int count = StackWalkerBase::CaptureRawCallstack(site->frames, STKWLK_MAX_RAW_FRAMES, 1);
+  // Skip the exception dispatching: the context of the exception points into RaiseException,
+  // the frame after it is _CxxThrowException and then comes the function with the throw.
+  DWORD64 pc = GetContextPC(pExp->ContextRecord);
+  int first = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (site->frames[i] == pc)
+    {
+      first = (i + 2 < count) ? i + 2 : count;
+      break;
+    }
+  }
+  if (first > 0)
+    memmove(site->frames, site->frames + first, (count - first) * sizeof(DWORD64));
+  site->object = (const void *)rec->ExceptionInformation[1];
+  site->count = count - first;
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+
+bool StackWalkerBase::EnableThrowCapture(bool enable) STKWLK_NOEXCEPT
+{
+  HMODULE hKernel = GetModuleHandleW(L"kernel32");
+  if (hKernel == NULL)
+    return false;
+  bool result = true;
+  SpinLock(&g_throwLock);
+  if (enable && g_throwHandler == NULL)
+  {
+    TAddVectoredExceptionHandler pAdd = (TAddVectoredExceptionHandler)GetProcAddress(hKernel, "AddVectoredExceptionHandler");
+    if (pAdd != NULL && ThrowSiteIndexAlloc(hKernel))
+      g_throwHandler = pAdd(1, ThrowSiteHandler);
+    result = (g_throwHandler != NULL);
+    if (result == false)
+      SetLastError(ERROR_NOT_SUPPORTED);
+  }
+  else if (!enable && g_throwHandler != NULL)
+  {
+    // only the handler is removed: it may still run on another thread and use its slot
+    TRemoveVectoredExceptionHandler pRemove = (TRemoveVectoredExceptionHandler)GetProcAddress(hKernel, "RemoveVectoredExceptionHandler");
+    if (pRemove != NULL)
+      pRemove(g_throwHandler);
+    g_throwHandler = NULL;
+  }
+  SpinUnlock(&g_throwLock);
+  return result;
+}
+
+int StackWalkerBase::GetThrowCallstack(DWORD64 * frames, int maxFrames, const void * pException) STKWLK_NOEXCEPT
+{
+  if (frames == NULL || maxFrames <= 0)
+    return 0;
+  DWORD index = g_throwIndex;
+  if (index == TLS_OUT_OF_INDEXES || g_throwHandler == NULL)
+    return 0;    // the slot of a disabled capture is out of date
+  const TThrowSite * site = (const TThrowSite *)g_throwGetValue(index);
+  if (site == NULL || (pException != NULL && pException != site->object))
+    return 0;
+  int count = (site->count < maxFrames) ? site->count : maxFrames;
+  memcpy(frames, site->frames, count * sizeof(DWORD64));
+  return count;
+}
+
+bool StackWalkerBase::SymbolizeBatch(const DWORD64 * addrs, int count, LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  bool result = false;
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (addrs == NULL && count > 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+  this->m_sw->UnloadModules();
+  if (this->m_sw->InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+  result = this->m_sw->ShowFramesBatch(addrs, count);
+fin:
+  this->m_sw->LeaveCriticalSection();
+  return result;
+}
+
+bool StackWalkerBase::StartAsync(int workers, int queueSize) STKWLK_NOEXCEPT
+{
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  return this->m_sw->StartAsync(workers, queueSize);
+}
+
+void StackWalkerBase::StopAsync(bool drain) STKWLK_NOEXCEPT
+{
+  if (this->m_sw != NULL)
+    this->m_sw->StopAsync(drain);
+}
+
+bool StackWalkerBase::ShowCallstackAsync(LPVOID pUserData, int framesToSkip) STKWLK_NOEXCEPT
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  int count = CaptureRawCallstack(frames, _countof(frames), framesToSkip);
+  return this->m_sw->AsyncPush(pUserData, frames, count);
+}
+
+bool StackWalkerBase::FlushAsync(DWORD dwTimeout) STKWLK_NOEXCEPT
+{
+  DWORD start = GetTickCount();
+  if (this->m_sw == NULL)
+    return false;
+  if (this->m_sw->m_asyncIdle == NULL)
+    return true;   // not started
+  while (this->m_sw->m_asyncPending > 0)
+  {
+    DWORD wait = INFINITE;
+    if (dwTimeout != INFINITE)
+    {
+      DWORD elapsed = GetTickCount() - start;
+      if (elapsed >= dwTimeout)
+        return false;
+      wait = dwTimeout - elapsed;
+    }
+    WaitForSingleObject(this->m_sw->m_asyncIdle, wait);
+  }
+  return true;
+}
+
+bool StackWalkerBase::GetStats(TStats & stats) STKWLK_NOEXCEPT
+{
+  LARGE_INTEGER freq;
+  memset(&stats, 0, sizeof(stats));
+  if (this->m_sw == NULL)
+    return false;
+  if (QueryPerformanceFrequency(&freq) == FALSE || freq.QuadPart == 0)
+    return false;
+  this->m_sw->EnterCriticalSection();
+  for (int i = 0; i < StatPhasesCount; i++)
+  {
+    ULONGLONG ticks = this->m_sw->m_statTicks[i];
+    stats.count[i] = this->m_sw->m_statCount[i];
+    // split to avoid overflow of (ticks * 10^9)
+    stats.timeNs[i] = (ticks / freq.QuadPart) * 1000000000 +
+                      (ticks % freq.QuadPart) * 1000000000 / freq.QuadPart;
+  }
+  this->m_sw->LeaveCriticalSection();
+  return true;
+}
+
+void StackWalkerBase::ResetStats() STKWLK_NOEXCEPT
+{
+  if (this->m_sw == NULL)
+    return;
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->ResetStats();
+  this->m_sw->LeaveCriticalSection();
+}
+
+LONG StackWalkerBase::GetAsyncDropCount() STKWLK_NOEXCEPT
+{
+  return (this->m_sw == NULL) ? 0 : this->m_sw->m_asyncDrops;
+}
+
+// Copy stack memory of the target process page by page (stops at the first unreadable page)
+static DWORD ReadStackMemory(HANDLE hProcess, DWORD64 addr, LPBYTE buf, DWORD size) STKWLK_NOEXCEPT
+{
+  const DWORD pageSize = 0x1000;
+  DWORD total = 0;
+  while (total < size)
+  {
+    DWORD64 cur = addr + total;
+    DWORD chunk = pageSize - (DWORD)(cur & (pageSize - 1));
+    if (chunk > size - total)
+      chunk = size - total;
+    SIZE_T st = 0;
+    if (ReadProcessMemory(hProcess, (LPCVOID)cur, buf + total, chunk, &st) == FALSE || st != chunk)
+      break;
+    total += chunk;
+  }
+  return total;
+}
+
+bool StackWalkerBase::CaptureSnapshot(TSnapshot &     snap,
+                                      HANDLE          hThread,
+                                      const CONTEXT * context,
+                                      DWORD           dwMaxStackSize,
+                                      bool            withModules) STKWLK_NOEXCEPT
+{
+  bool    result = false;
+  bool    isCurrentThread = false;
+  bool    isThreadSuspended = false;
+  DWORD64 sp;
+
+  memset(&snap, 0, sizeof(snap));
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (hThread == NULL)
+    hThread = STKWLK_CURRENT_THREAD_HANDLE;
+  if (hThread == STKWLK_CURRENT_THREAD_HANDLE || GetThreadIdByHandle(hThread) == GetCurrentThreadId())
+    isCurrentThread = true;
+
+  if (dwMaxStackSize > 0)
+  {
+    // allocate before the thread is suspended: it may hold the heap lock
+    snap.stackData = (LPBYTE) malloc(dwMaxStackSize);
+    if (snap.stackData == NULL)
+    {
+      SetLastError(ERROR_OUTOFMEMORY);
+      return false;
+    }
+  }
+
+  if (context != NULL)
+    snap.context = *context;
+  else if (isCurrentThread)
+  {
+    CONTEXT c;
+    memset(&c, 0, sizeof(c));
+    c.ContextFlags = STKWLK_CONTEXT_FLAGS;
+#if defined(_M_IX86)
+    __asm    call x
+    __asm x: pop eax
+    __asm    mov c.Eip, eax
+    __asm    mov c.Ebp, ebp
+    __asm    mov c.Esp, esp
+#else
+    RtlCaptureContext(&c);
+#endif
+    snap.context = c;
+  }
+  else
+  {
+    if (SuspendThread(hThread) == (DWORD)-1)
+      goto fin;
+    isThreadSuspended = true;
+    snap.context.ContextFlags = STKWLK_CONTEXT_FLAGS;
+    if (GetThreadContext(hThread, &snap.context) == FALSE)
+      goto fin;
+  }
+
+#if defined(_M_IX86)
+  sp = snap.context.Esp;
+#elif defined(_M_X64)
+  sp = snap.context.Rsp;
+#elif defined(_M_IA64)
+  sp = snap.context.IntSp;
+#endif
+  if (dwMaxStackSize > 0)
+  {
+    snap.stackAddr = sp;
+    if (isCurrentThread && context == NULL && m_sw->m_dwProcessId == GetCurrentProcessId())
+    {
+      // own stack: copy it directly up to the stack base
+      DWORD64 base = (DWORD64)GetCurrentTIB()->StackBase;
+      snap.stackSize = (base > sp && base - sp < dwMaxStackSize) ? (DWORD)(base - sp) : dwMaxStackSize;
+      memcpy(snap.stackData, (LPCVOID)sp, snap.stackSize);
+    }
+    else
+      snap.stackSize = ReadStackMemory(m_sw->m_hProcess, sp, snap.stackData, dwMaxStackSize);
+  }
+  if (isThreadSuspended)
+  {
+    ResumeThread(hThread);
+    isThreadSuspended = false;
+  }
+
+  if (withModules)
+  {
+    StackWalkerInternal::TModuleList list = { 0 };
+    if (m_sw->GetModuleList(m_sw->m_hProcess, m_sw->m_dwProcessId, list) <= 0)
+    {
+      StackWalkerInternal::ModuleListFree(list);
+      SetLastError(ERROR_MOD_NOT_FOUND);
+      goto fin;
+    }
+    snap.modules = list.items;
+    snap.modulesCount = list.count;
+  }
+  result = true;
+
+fin:
+  if (isThreadSuspended)
+    ResumeThread(hThread);
+  if (result == false)
+    FreeSnapshot(snap);
+  return result;
+}
+
+void StackWalkerBase::FreeSnapshot(TSnapshot & snap) STKWLK_NOEXCEPT
+{
+  free(snap.stackData);
+  StackWalkerInternal::ModuleListFree(snap.modules, snap.modulesCount);
+  memset(&snap, 0, sizeof(snap));
+}
+
+bool StackWalkerBase::ShowCallstack(const TSnapshot & snap, LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  bool          result = false;
+  TThreadData   tdata = { 0 };
+
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+
+  tdata.qwMagic = qwThreadDataMagic;
+  tdata.swi = m_sw;
+  tdata.pReadMemFunc = NULL;
+  tdata.pUserData = pUserData;
+  tdata.pSnapshot = &snap;
+
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+  result = this->m_sw->ShowSnapshot(snap, tdata);
+  this->m_sw->LeaveCriticalSection();
+  return result;
+}
+
+int StackWalkerBase::GetSnapshotFrames(const TSnapshot & snap, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT
+{
+  TThreadData   tdata = { 0 };
+
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return 0;
+  }
+  if (frames == NULL || maxFrames <= 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+
+  tdata.qwMagic = qwThreadDataMagic;
+  tdata.swi = m_sw;
+  tdata.pSnapshot = &snap;
+  tdata.rawFrames = frames;
+  tdata.rawMax = maxFrames;
+
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->ShowSnapshot(snap, tdata);
+  this->m_sw->LeaveCriticalSection();
+  return tdata.rawCount;
+}
+
+// must be called under m_critsec
+bool StackWalkerInternal::ShowSnapshot(const StackWalkerBase::TSnapshot & snap, TThreadData & tdata) STKWLK_NOEXCEPT
+{
+  bool          result = false;
+  PNT_TIB       lpTIB = NULL;
+  LPVOID        ArbitraryUserPointer = NULL;
+
+  UnloadModules(snap.modules != NULL);
+  m_pSnapshot = &snap;
+  if (snap.modules != NULL)
+  {
+    m_snapImages = (LPBYTE *) calloc(snap.modulesCount, sizeof(LPBYTE));
+    SlotActionsReset();    // the frame filters use the modules of the snapshot
+  }
+  if (InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+
+  lpTIB = GetCurrentTIB();
+  ArbitraryUserPointer = lpTIB->ArbitraryUserPointer;  // save original value
+
+  result = ShowCallstack(STKWLK_CURRENT_THREAD_HANDLE, snap.context, tdata);
+
+fin:
+  if (lpTIB)
+    lpTIB->ArbitraryUserPointer = ArbitraryUserPointer;   // restore original value
+  if (snap.modules != NULL)
+    UnloadModules(true);   // do not keep the modules of the snapshot
+  UnmapSnapshotImages();
+  m_pSnapshot = NULL;
+  if (snap.modules != NULL)
+    SlotActionsReset();
+  return result;
+}
+
+bool StackWalkerBase::ShowObject(LPVOID pObject, LPVOID pUserData) STKWLK_NOEXCEPT
+{
+  bool result = false;
+  SW_CSTR sname = NULL;
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->m_pUserData = pUserData;
+  this->m_sw->UnloadModules();
+  if (this->m_sw->InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+  // SymGetSymFromAddr64 or SymFromAddr is required
+  if (m_sw->Sym.GetSymFromAddr == NULL && m_sw->Sym.FromAddr == NULL)
+    goto fin;
+
+  {
+    // Show object info (SymGetSymFromAddr64())
+    T_SW_SYM_INFO symInf;
+    DWORD64 dwAddress = (DWORD64)pObject;
+    DWORD64 dwDisplacement = 0;
+    sname = m_sw->SymFromAddr(m_sw->m_hProcess, dwAddress, &dwDisplacement, symInf);
+    if (sname == NULL)
+      this->OnDbgHelpErr(TDbgHelpErr(_T("SymGetSymFromAddr"), GetLastError(), dwAddress));
+    else
+      result = true;
+  }
+fin:  
+  // Object name output
+  TShowObject data;
+  data.pObject = pObject;
+  data.szName = sname;
+  this->OnShowObject(data);
+  this->m_sw->LeaveCriticalSection();
+  return result;
+};
+
+bool StackWalkerBase::WriteMiniDump(LPCWSTR szDumpFile, PEXCEPTION_POINTERS exp, DWORD dwMaxStackSize) STKWLK_NOEXCEPT
+{
+  bool result = false;
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (szDumpFile == NULL)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  this->m_sw->EnterCriticalSection();
+  if (this->m_sw->InitAndLoad() == false)
+  {
+    SetLastError(ERROR_DLL_INIT_FAILED);
+    goto fin;
+  }
+  result = this->m_sw->WriteMiniDump(szDumpFile, exp, dwMaxStackSize);
+fin:
+  this->m_sw->LeaveCriticalSection();
+  return result;
+}
+
+BOOL WINAPI StackWalkerInternal::MyReadProcMem(HANDLE  hProcess,
+                                               DWORD64 qwBaseAddress,
+                                               PVOID   lpBuffer,
+                                               DWORD   nSize,
+                                               LPDWORD lpNumberOfBytesRead) STKWLK_NOEXCEPT
+{
+  PNT_TIB lpTIB = GetCurrentTIB();
+  TThreadData * tdata = (TThreadData *)lpTIB->ArbitraryUserPointer;
+  if (tdata == NULL)
+    return FALSE;
+  if (tdata->qwMagic != qwThreadDataMagic)
+    return FALSE;
+  if (tdata->swi == NULL)
+    return FALSE;
+
+  const StackWalkerBase::TSnapshot * snap = tdata->pSnapshot;
+  if (snap != NULL)
+  {
+    if (qwBaseAddress >= snap->stackAddr && qwBaseAddress + nSize <= snap->stackAddr + snap->stackSize)
+    {
+      memcpy(lpBuffer, snap->stackData + (size_t)(qwBaseAddress - snap->stackAddr), nSize);
+      *lpNumberOfBytesRead = nSize;
+      return TRUE;
+    }
+    if (snap->modules != NULL)
+    {
+      // offline unwinding: memory of the target process is not available, only the image files
+      if (tdata->swi->ReadSnapshotImage(qwBaseAddress, lpBuffer, nSize) == false)
+        return FALSE;
+      *lpNumberOfBytesRead = nSize;
+      return TRUE;
+    }
+  }
+
+  if (tdata->pReadMemFunc == NULL)
+  {
+    SIZE_T st;
+    BOOL   bRet = ReadProcessMemory(hProcess, (LPVOID)qwBaseAddress, lpBuffer, nSize, &st);
+    *lpNumberOfBytesRead = (DWORD)st;
+    //printf("ReadMemory: hProcess: %p, baseAddr: %p, buffer: %p, size: %d, read: %d, result: %d\n", hProcess, (LPVOID) qwBaseAddress, lpBuffer, nSize, (DWORD) st, (DWORD) bRet);
+    return bRet;
+  }
+
+  return tdata->pReadMemFunc(hProcess, qwBaseAddress, lpBuffer, nSize, lpNumberOfBytesRead, tdata->pUserData);
+}
+
+// =====================================================================================
+
+void StackWalkerDemo::OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  SW_CHR ver[80] = { 0 };
+  SW_CHR res[24] = { 0 };
+
+  if (data.result != 0)
+    MyStrFmt(res, _countof(res), _T(" [result: %d]"), data.result);
+
+  if (data.ver.isEmpty() == false)
+    MyStrFmt(ver, _countof(ver), _T(" v%d.%d.%d.%d"),
+              data.ver.wMajor, data.ver.wMinor, data.ver.wBuild, data.ver.wRevis);
+
+  SW_CSTR pdbName = NULL;
+  if (sw_scmp(data.symType, _T("PDB")) == 0)
+  {
+    pdbName = data.pdbName;
+    if (data.pdbName && sw_srchr(data.pdbName, _T('\\')))
+      pdbName = sw_srchr(data.pdbName, _T('\\'));
+  }
+  MyStrFmt(buf, _countof(buf), _T("%p %s  (size: %d)%s%s, SymType: %s, PDB: \"%s\"\n"),
+            (LPVOID)data.baseAddr, data.modName, (int)data.size, ver, res, data.symType, pdbName);
+  OnOutput(buf);
+}
+
+void StackWalkerDemo::OnUnloadModule(const TUnloadModule & data) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  MyStrFmt(buf, _countof(buf), _T("%p %s  (size: %d) unloaded\n"), (LPVOID)data.baseAddr, data.modName, (int)data.size);
+  OnOutput(buf);
+}
+
+void StackWalkerDemo::OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  if ((entry.type != lastEntry) && (entry.offset != 0))
+  {
+    //if (entry.type == firstEntry)
+    //  OnOutput(_T("Callstack:\n"));
+
+    TCallstackEntry e = entry;
+    if (entry.name == NULL || entry.name[0] == 0)
+      e.name = _T("(function-name not available)");
+    if (entry.undName && entry.undName[0] != 0)
+      e.name = entry.undName;
+    if (entry.undFullName && entry.undFullName[0] != 0)
+      e.name = entry.undFullName;
+    if (entry.lineFileName == NULL || entry.lineFileName[0] == 0)
+    {
+      e.lineFileName = _T("(filename not available)");
+      if (entry.moduleName == NULL || entry.moduleName[0] == 0)
+        e.moduleName = _T("(module-name not available)");
+      MyStrFmt(buf, _countof(buf), _T("%p (%s): %s: %s\n"),
+                (LPVOID)e.offset, e.moduleName, e.lineFileName, e.name);
+    }
+    else
+      MyStrFmt(buf, _countof(buf), _T("%s (%d): %s\n"),
+                e.lineFileName, e.lineNumber, e.name);
+    OnOutput(buf);
+  }
+}
+
+void StackWalkerDemo::OnShowObject(const TShowObject & data) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  MyStrFmt(buf, _countof(buf), _T("Object: Addr: %p, Name: \"%s\"\n"), data.pObject, data.szName);
+  OnOutput(buf);
+}
+
+void StackWalkerDemo::OnDbgHelpErr(const TDbgHelpErr & data) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  MyStrFmt(buf, _countof(buf), _T("ERROR: %s, GetLastError: %d (Address: %p)\n"),
+            data.szFuncName, data.gle, (LPVOID)data.addr);
+  OnOutput(buf);
+}
+
+void StackWalkerDemo::OnLoadDbgHelp(const TLoadDbgHelp & a) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  MyStrFmt(buf, _countof(buf), _T("LoadDbgHelp: FileVer: %d.%d.%d.%d, Path: \"%s\"\n"),
+            a.ver.wMajor, a.ver.wMinor, a.ver.wBuild, a.ver.wRevis, a.szDllPath);
+  OnOutput(buf);
+}
+
+void StackWalkerDemo::OnSymInit(const TSymInit & data) STKWLK_NOEXCEPT
+{
+  SW_CHR buf[STACKWALK_MAX_NAMELEN];
+  MyStrFmt(buf, _countof(buf), _T("SymInit: symOptions: 0x%08X, UserName: \"%s\"\n"),
+            data.dwSymOptions, data.szUserName);
+  OnOutput(buf);
+
+  MyStrFmt(buf, _countof(buf), _T("Symbol-SearchPath: \"%s\"\n"), data.szSearchPath);
+  OnOutput(buf);
+
+  // Also display the OS-version
+  T_OSVERSIONINFOEX ver = { 0 };
+  ver.dwOSVersionInfoSize = sizeof(ver);
+#pragma warning(push)
+#pragma warning(disable : 4996)  // For fix warning "GetVersionExW was declared deprecated"
+  if (GetVersionEx((T_OSVERSIONINFO*)&ver) != FALSE)
+  {
+    MyStrFmt(buf, _countof(buf), _T("OS-Version: %d.%d.%d (%s) 0x%04x-%d\n"),
+              ver.dwMajorVersion, ver.dwMinorVersion, ver.dwBuildNumber, ver.szCSDVersion,
+              ver.wSuiteMask, ver.wProductType);
+    OnOutput(buf);
+  }
+#pragma warning(pop)
+}
+
+void StackWalkerDemo::OnOutput(SW_CSTR buffer) STKWLK_NOEXCEPT
+{
+  OutputDebugString(buffer);
+}
+
+// ===========================================================================================
+// Interned raw callstacks. The memory is taken from an own arena (VirtualAlloc), so the
+// table can be used from inside of the allocator hooks.
+
+typedef struct _TArenaChunk
+{
+  struct _TArenaChunk * next;
+  size_t                size;
+} TArenaChunk;
+
+typedef struct _TArena
+{
+  TArenaChunk * chunks;
+  LPBYTE        cur;
+  LPBYTE        end;
+} TArena;
+
+static LPVOID ArenaAlloc(TArena & arena, size_t size) STKWLK_NOEXCEPT
+{
+  const size_t chunkSize = 1024 * 1024;
+  size = (size + 15) & ~(size_t)15;
+  if (arena.cur == NULL || (size_t)(arena.end - arena.cur) < size)
+  {
+    size_t csize = sizeof(TArenaChunk) + 16 + size;
+    csize = (csize < chunkSize) ? chunkSize : csize;
+    TArenaChunk * chunk = (TArenaChunk *) VirtualAlloc(NULL, csize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (chunk == NULL)
+      return NULL;
+    chunk->next = arena.chunks;
+    chunk->size = csize;
+    arena.chunks = chunk;
+    arena.cur = (LPBYTE)chunk + ((sizeof(TArenaChunk) + 15) & ~(size_t)15);
+    arena.end = (LPBYTE)chunk + csize;
+  }
+  LPVOID ptr = arena.cur;
+  arena.cur += size;
+  return ptr;
+}
+
+static void ArenaFree(TArena & arena) STKWLK_NOEXCEPT
+{
+  while (arena.chunks)
+  {
+    TArenaChunk * next = arena.chunks->next;
+    VirtualFree(arena.chunks, 0, MEM_RELEASE);
+    arena.chunks = next;
+  }
+  arena.cur = NULL;
+  arena.end = NULL;
+}
+
+typedef struct _TStackNode
+{
+  struct _TStackNode * next;        // hash chain
+  struct _TStackNode * nextAll;     // list of all nodes
+  DWORD                hash;
+  int                  id;
+  int                  count;
+  ULONGLONG            value[4];    // counters of the owner
+  DWORD64              frames[1];   // [count]
+} TStackNode;
+
+typedef struct _TStackTable
+{
+  enum { Buckets = 4096 };
+  TArena        arena;
+  TStackNode ** buckets;
+  TStackNode *  all;
+  int           count;
+} TStackTable;
+
+static DWORD StackHash(const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+{
+  DWORD h = 2166136261U;    // FNV-1a
+  for (int i = 0; i < count; i++)
+  {
+    h = (h ^ (DWORD)frames[i]) * 16777619U;
+    h = (h ^ (DWORD)(frames[i] >> 32)) * 16777619U;
+  }
+  return h;
+}
+
+static TStackNode * StackTableIntern(TStackTable & tbl, const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+{
+  if (tbl.buckets == NULL)
+  {
+    tbl.buckets = (TStackNode **) ArenaAlloc(tbl.arena, TStackTable::Buckets * sizeof(TStackNode *));
+    if (tbl.buckets == NULL)
+      return NULL;
+    memset(tbl.buckets, 0, TStackTable::Buckets * sizeof(TStackNode *));
+  }
+  DWORD hash = StackHash(frames, count);
+  TStackNode ** bucket = &tbl.buckets[hash & (TStackTable::Buckets - 1)];
+  for (TStackNode * node = *bucket; node != NULL; node = node->next)
+  {
+    if (node->hash == hash && node->count == count &&
+        memcmp(node->frames, frames, count * sizeof(DWORD64)) == 0)
+      return node;
+  }
+  size_t size = sizeof(TStackNode) + (count > 1 ? count - 1 : 0) * sizeof(DWORD64);
+  TStackNode * node = (TStackNode *) ArenaAlloc(tbl.arena, size);
+  if (node == NULL)
+    return NULL;
+  memset(node, 0, sizeof(TStackNode));
+  node->hash = hash;
+  node->id = ++tbl.count;
+  node->count = count;
+  memcpy(node->frames, frames, count * sizeof(DWORD64));
+  node->next = *bucket;
+  *bucket = node;
+  node->nextAll = tbl.all;
+  tbl.all = node;
+  return node;
+}
+
+static void StackTableFree(TStackTable & tbl) STKWLK_NOEXCEPT
+{
+  ArenaFree(tbl.arena);
+  memset(&tbl, 0, sizeof(tbl));
+}
+
+// ===========================================================================================
+
+class StackWalkerTrackerInternal
+{
+public:
+  enum { PtrBuckets = 16384 };
+
+  typedef struct _TSampledPtr
+  {
+    struct _TSampledPtr * next;
+    LPVOID                ptr;
+    TStackNode *          stack;
+    ULONGLONG             count;    // estimated allocations
+    ULONGLONG             bytes;    // estimated bytes
+  } TSampledPtr;
+
+  enum { AllocCount = 0, AllocBytes, LiveCount, LiveBytes };   // TStackNode::value
+
+  CRITICAL_SECTION  m_critsec;
+  TStackTable       m_stacks;
+  TSampledPtr **    m_ptrs;
+  TSampledPtr *     m_freePtrs;
+  LONG volatile     m_sampledCount;
+  double            m_interval;
+  DWORD             m_tlsIndex;     // bytes until the next sample of the thread
+  ULONGLONG         m_rnd;
+
+  StackWalkerTrackerInternal(size_t sampleInterval) STKWLK_NOEXCEPT
+  {
+    InitializeCriticalSection(&m_critsec);
+    memset(&m_stacks, 0, sizeof(m_stacks));
+    m_ptrs = NULL;
+    m_freePtrs = NULL;
+    m_sampledCount = 0;
+    m_interval = (double)(sampleInterval ? sampleInterval : 1);
+    m_tlsIndex = TlsAlloc();
+    m_rnd = GetTickCount() | 1;
+  }
+
+  ~StackWalkerTrackerInternal() STKWLK_NOEXCEPT
+  {
+    if (m_tlsIndex != TLS_OUT_OF_INDEXES)
+      TlsFree(m_tlsIndex);
+    StackTableFree(m_stacks);
+    DeleteCriticalSection(&m_critsec);
+  }
+
+  static size_t PtrHash(LPVOID ptr) STKWLK_NOEXCEPT
+  {
+    return (size_t)(((DWORD64)ptr * (DWORD64)0x9E3779B97F4A7C15) >> 50) & (PtrBuckets - 1);
+  }
+
+  // Geometric distribution of the intervals (the sampling points form a Poisson process)
+  size_t NextInterval() STKWLK_NOEXCEPT
+  {
+    // xorshift64, races between the threads only add to the randomness
+    ULONGLONG x = m_rnd;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    m_rnd = x;
+    double u = ((double)(x >> 11) + 0.5) / 9007199254740992.0;   // (0, 1)
+    double n = -log(u) * m_interval;
+    return (n < 1.0) ? 1 : ((n > 1e9) ? (size_t)1e9 : (size_t)n);
+  }
+
+  bool ShouldSample(size_t size) STKWLK_NOEXCEPT
+  {
+    if (m_tlsIndex == TLS_OUT_OF_INDEXES)
+      return false;
+    size_t left = (size_t)TlsGetValue(m_tlsIndex);
+    if (left == 0)
+      left = NextInterval();
+    bool sample = (size >= left);
+    left = sample ? NextInterval() : left - size;
+    TlsSetValue(m_tlsIndex, (LPVOID)left);
+    return sample;
+  }
+
+  void AddSample(LPVOID ptr, size_t size, const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+  {
+    // probability of sampling is 1 - exp(-size / interval)
+    double p = 1.0 - exp(-(double)size / m_interval);
+    double weight = (p > 0.0) ? 1.0 / p : 1.0;
+    ::EnterCriticalSection(&m_critsec);
+    if (m_ptrs == NULL)
+    {
+      m_ptrs = (TSampledPtr **) ArenaAlloc(m_stacks.arena, PtrBuckets * sizeof(TSampledPtr *));
+      if (m_ptrs != NULL)
+        memset(m_ptrs, 0, PtrBuckets * sizeof(TSampledPtr *));
+    }
+    TStackNode * stack = StackTableIntern(m_stacks, frames, count);
+    TSampledPtr * sp = m_freePtrs;
+    if (sp != NULL)
+      m_freePtrs = sp->next;
+    else if (m_ptrs != NULL)
+      sp = (TSampledPtr *) ArenaAlloc(m_stacks.arena, sizeof(TSampledPtr));
+    if (stack != NULL && sp != NULL)
+    {
+      sp->ptr = ptr;
+      sp->stack = stack;
+      sp->count = (ULONGLONG)(weight + 0.5);
+      sp->bytes = (ULONGLONG)(weight * size + 0.5);
+      TSampledPtr ** bucket = &m_ptrs[PtrHash(ptr)];
+      sp->next = *bucket;
+      *bucket = sp;
+      stack->value[AllocCount] += sp->count;
+      stack->value[AllocBytes] += sp->bytes;
+      stack->value[LiveCount] += sp->count;
+      stack->value[LiveBytes] += sp->bytes;
+      InterlockedIncrement(&m_sampledCount);
+    }
+    else if (sp != NULL)
+    {
+      sp->next = m_freePtrs;
+      m_freePtrs = sp;
+    }
+    ::LeaveCriticalSection(&m_critsec);
+  }
+
+  void RemoveSample(LPVOID ptr) STKWLK_NOEXCEPT
+  {
+    if (m_sampledCount == 0)
+      return;     // nothing sampled (or everything freed) - do not take the lock
+    ::EnterCriticalSection(&m_critsec);
+    if (m_ptrs != NULL)
+    {
+      for (TSampledPtr ** pp = &m_ptrs[PtrHash(ptr)]; *pp != NULL; pp = &(*pp)->next)
+      {
+        TSampledPtr * sp = *pp;
+        if (sp->ptr != ptr)
+          continue;
+        *pp = sp->next;
+        sp->stack->value[LiveCount] -= sp->count;
+        sp->stack->value[LiveBytes] -= sp->bytes;
+        sp->next = m_freePtrs;
+        m_freePtrs = sp;
+        InterlockedDecrement(&m_sampledCount);
+        break;
+      }
+    }
+    ::LeaveCriticalSection(&m_critsec);
+  }
+};
+
+StackWalkerAllocTracker::StackWalkerAllocTracker(size_t sampleInterval) STKWLK_NOEXCEPT
+{
+  // the tracker must not use the CRT heap
+  LPVOID p = VirtualAlloc(NULL, sizeof(StackWalkerTrackerInternal), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  m_at = (p == NULL) ? NULL : new(p) StackWalkerTrackerInternal(sampleInterval);
+}
+
+StackWalkerAllocTracker::~StackWalkerAllocTracker() STKWLK_NOEXCEPT
+{
+  if (m_at == NULL)
+    return;
+  m_at->~StackWalkerTrackerInternal();
+  VirtualFree(m_at, 0, MEM_RELEASE);
+  m_at = NULL;
+}
+
+void StackWalkerAllocTracker::OnAlloc(LPVOID ptr, size_t size) STKWLK_NOEXCEPT
+{
+  if (m_at == NULL || ptr == NULL || !m_at->ShouldSample(size))
+    return;
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int count = StackWalkerBase::CaptureRawCallstack(frames, STKWLK_MAX_RAW_FRAMES, 1);  // skip OnAlloc
+  m_at->AddSample(ptr, size, frames, count);
+}
+
+void StackWalkerAllocTracker::OnFree(LPVOID ptr) STKWLK_NOEXCEPT
+{
+  if (m_at != NULL && ptr != NULL)
+    m_at->RemoveSample(ptr);
+}
+
+bool StackWalkerAllocTracker::Dump(StackWalkerBase & sw, bool liveOnly) STKWLK_NOEXCEPT
+{
+  if (m_at == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  // Copy the counters first: the symbolization allocates and can call OnAlloc again
+  ::EnterCriticalSection(&m_at->m_critsec);
+  int count = m_at->m_stacks.count;
+  ::LeaveCriticalSection(&m_at->m_critsec);
+  if (count == 0)
+    return true;
+  TAllocSite * sites = (TAllocSite *) malloc(count * sizeof(TAllocSite));
+  if (sites == NULL)
+  {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return false;
+  }
+  int n = 0;
+  ::EnterCriticalSection(&m_at->m_critsec);
+  for (const TStackNode * node = m_at->m_stacks.all; node != NULL && n < count; node = node->nextAll)
+  {
+    if (liveOnly && node->value[StackWalkerTrackerInternal::LiveCount] == 0)
+      continue;
+    TAllocSite & site = sites[n++];
+    site.id = node->id;
+    site.framesCount = node->count;
+    site.frames = node->frames;    // the nodes are never freed before Reset
+    site.allocCount = node->value[StackWalkerTrackerInternal::AllocCount];
+    site.allocBytes = node->value[StackWalkerTrackerInternal::AllocBytes];
+    site.liveCount = node->value[StackWalkerTrackerInternal::LiveCount];
+    site.liveBytes = node->value[StackWalkerTrackerInternal::LiveBytes];
+  }
+  ::LeaveCriticalSection(&m_at->m_critsec);
+  bool result = true;
+  for (int i = 0; i < n; i++)
+    if (!sw.ShowRawCallstack(sites[i].frames, sites[i].framesCount, &sites[i]))
+      result = false;
+  free(sites);
+  return result;
+}
+
+void StackWalkerAllocTracker::Reset() STKWLK_NOEXCEPT
+{
+  if (m_at == NULL)
+    return;
+  ::EnterCriticalSection(&m_at->m_critsec);
+  StackTableFree(m_at->m_stacks);
+  m_at->m_ptrs = NULL;
+  m_at->m_freePtrs = NULL;
+  m_at->m_sampledCount = 0;
+  ::LeaveCriticalSection(&m_at->m_critsec);
+}
+
+// ===========================================================================================
+
+class StackWalkerContentionInternal
+{
+public:
+  // TStackNode::value
+  enum { WaitCount = 0, WaitTicks, WaiterFrames };
+
+  CRITICAL_SECTION  m_critsec;
+  TStackTable       m_stacks;     // waiter's frames, 0, holder's frames
+
+  StackWalkerContentionInternal() STKWLK_NOEXCEPT
+  {
+    InitializeCriticalSection(&m_critsec);
+    memset(&m_stacks, 0, sizeof(m_stacks));
+  }
+
+  ~StackWalkerContentionInternal() STKWLK_NOEXCEPT
+  {
+    StackTableFree(m_stacks);
+    DeleteCriticalSection(&m_critsec);
+  }
+};
+
+StackWalkerLockProfiler::TLock::TLock(StackWalkerLockProfiler & profiler) STKWLK_NOEXCEPT
+{
+  InitializeCriticalSection(&m_cs);
+  m_profiler = &profiler;
+  m_recursion = 0;
+  m_acquired = 0;
+  m_holderCount = 0;
+}
+
+StackWalkerLockProfiler::TLock::~TLock() STKWLK_NOEXCEPT
+{
+  DeleteCriticalSection(&m_cs);
+}
+
+void StackWalkerLockProfiler::TLock::lock() STKWLK_NOEXCEPT
+{
+  if (TryEnterCriticalSection(&m_cs) == FALSE)
+  {
+    LARGE_INTEGER t0, t1;
+    QueryPerformanceCounter(&t0);
+    ::EnterCriticalSection(&m_cs);
+    QueryPerformanceCounter(&t1);
+    LONGLONG ticks = t1.QuadPart - t0.QuadPart;
+    if (ticks >= m_profiler->m_thresholdTicks)
+    {
+      // the lock is owned now, so m_holderFrames still contains the previous holder
+      DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+      int count = StackWalkerBase::CaptureRawCallstack(frames, STKWLK_MAX_RAW_FRAMES, 1);  // skip lock()
+      m_profiler->OnContention(*this, ticks, frames, count);
+    }
+  }
+  if (OnAcquired())
+    m_holderCount = StackWalkerBase::CaptureRawCallstack(m_holderFrames, STKWLK_MAX_RAW_FRAMES, 1);  // skip lock()
+}
+
+bool StackWalkerLockProfiler::TLock::try_lock() STKWLK_NOEXCEPT
+{
+  if (TryEnterCriticalSection(&m_cs) == FALSE)
+    return false;
+  if (OnAcquired())
+    m_holderCount = StackWalkerBase::CaptureRawCallstack(m_holderFrames, STKWLK_MAX_RAW_FRAMES, 1);  // skip try_lock()
+  return true;
+}
+
+void StackWalkerLockProfiler::TLock::unlock() STKWLK_NOEXCEPT
+{
+  m_recursion--;
+  ::LeaveCriticalSection(&m_cs);
+}
+
+// returns true if the callstack of the new holder should be sampled
+bool StackWalkerLockProfiler::TLock::OnAcquired() STKWLK_NOEXCEPT
+{
+  if (m_recursion++ > 0)
+    return false;
+  m_holderCount = 0;
+  ULONG rate = m_profiler->m_holderSampleRate;
+  return (rate != 0 && (++m_acquired % rate) == 0);
+}
+
+StackWalkerLockProfiler::StackWalkerLockProfiler(DWORD thresholdUs, ULONG holderSampleRate) STKWLK_NOEXCEPT
+{
+  LARGE_INTEGER freq;
+  if (QueryPerformanceFrequency(&freq) == FALSE)
+    freq.QuadPart = 1000000;
+  m_thresholdTicks = (LONGLONG)thresholdUs * freq.QuadPart / 1000000;
+  m_holderSampleRate = holderSampleRate;
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerContentionInternal));
+  m_lp = (buf == NULL) ? NULL : new(buf) StackWalkerContentionInternal();  // placement new
+}
+
+StackWalkerLockProfiler::~StackWalkerLockProfiler() STKWLK_NOEXCEPT
+{
+  if (m_lp != NULL)
+  {
+    m_lp->~StackWalkerContentionInternal();
+    free(m_lp);
+  }
+  m_lp = NULL;
+}
+
+void StackWalkerLockProfiler::OnContention(const TLock & lock, LONGLONG waitTicks, const DWORD64 * frames, int count) STKWLK_NOEXCEPT
+{
+  if (m_lp == NULL)
+    return;
+  // one interned stack per pair of callstacks (0 is never a return address)
+  DWORD64 pair[STKWLK_MAX_RAW_FRAMES * 2 + 1];
+  memcpy(pair, frames, count * sizeof(DWORD64));
+  pair[count] = 0;
+  memcpy(pair + count + 1, lock.m_holderFrames, lock.m_holderCount * sizeof(DWORD64));
+  ::EnterCriticalSection(&m_lp->m_critsec);
+  TStackNode * node = StackTableIntern(m_lp->m_stacks, pair, count + 1 + lock.m_holderCount);
+  if (node != NULL)
+  {
+    node->value[StackWalkerContentionInternal::WaitCount]++;
+    node->value[StackWalkerContentionInternal::WaitTicks] += waitTicks;
+    node->value[StackWalkerContentionInternal::WaiterFrames] = count;
+  }
+  ::LeaveCriticalSection(&m_lp->m_critsec);
+}
+
+bool StackWalkerLockProfiler::Dump(StackWalkerBase & sw) STKWLK_NOEXCEPT
+{
+  LARGE_INTEGER freq;
+  if (m_lp == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (QueryPerformanceFrequency(&freq) == FALSE || freq.QuadPart == 0)
+    freq.QuadPart = 1000000;
+  ::EnterCriticalSection(&m_lp->m_critsec);
+  int count = m_lp->m_stacks.count;
+  TContentionSite * sites = (count == 0) ? NULL : (TContentionSite *) malloc(count * sizeof(TContentionSite));
+  int n = 0;
+  for (const TStackNode * node = m_lp->m_stacks.all; sites != NULL && node != NULL; node = node->nextAll)
+  {
+    TContentionSite & site = sites[n++];
+    ULONGLONG ticks = node->value[StackWalkerContentionInternal::WaitTicks];
+    site.id = node->id;
+    site.waiterCount = (int)node->value[StackWalkerContentionInternal::WaiterFrames];
+    site.waiterFrames = node->frames;
+    site.holderCount = node->count - site.waiterCount - 1;
+    site.holderFrames = node->frames + site.waiterCount + 1;
+    site.count = node->value[StackWalkerContentionInternal::WaitCount];
+    site.waitNs = (ticks / freq.QuadPart) * 1000000000 + (ticks % freq.QuadPart) * 1000000000 / freq.QuadPart;
+    site.isHolder = false;
+  }
+  ::LeaveCriticalSection(&m_lp->m_critsec);
+  if (count > 0 && sites == NULL)
+  {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return false;
+  }
+  bool result = true;
+  for (int i = 0; i < n; i++)
+  {
+    TContentionSite & site = sites[i];
+    if (!sw.ShowRawCallstack(site.waiterFrames, site.waiterCount, &site))
+      result = false;
+    site.isHolder = true;
+    if (site.holderCount > 0 && !sw.ShowRawCallstack(site.holderFrames, site.holderCount, &site))
+      result = false;
+  }
+  free(sites);
+  return result;
+}
+
+void StackWalkerLockProfiler::Reset() STKWLK_NOEXCEPT
+{
+  if (m_lp == NULL)
+    return;
+  ::EnterCriticalSection(&m_lp->m_critsec);
+  StackTableFree(m_lp->m_stacks);
+  ::LeaveCriticalSection(&m_lp->m_critsec);
+}
+
+// ===========================================================================================
+
+class StackWalkerWatchdogInternal
+{
+public:
+  // TStackNode::value
+  enum { LastReport = 0, Hits };
+
+  enum { StackCopySize = 64 * 1024 };
+
+  typedef struct _TSlot
+  {
+    HANDLE  hThread;        // NULL - free slot
+    DWORD   threadId;
+    LONG    lastBeat;
+    DWORD   lastChange;     // tick of the last heartbeat seen
+  } TSlot;
+
+  StackWalkerBase * m_sw;
+  DWORD             m_deadline;
+  DWORD             m_repeat;
+  CRITICAL_SECTION  m_critsec;
+  TSlot             m_slots[StackWalkerWatchdog::MaxThreads];
+  volatile LONG     m_beats[StackWalkerWatchdog::MaxThreads];
+  TStackTable       m_stacks;
+  LPBYTE            m_stackCopy;    // no allocation while a thread is suspended
+  HANDLE            m_hThread;
+  HANDLE            m_evStop;
+  DWORD             m_period;
+
+  StackWalkerWatchdogInternal(StackWalkerBase & sw, DWORD deadlineMs, DWORD repeatMs) STKWLK_NOEXCEPT
+  {
+    m_sw = &sw;
+    m_deadline = deadlineMs;
+    m_repeat = repeatMs;
+    InitializeCriticalSection(&m_critsec);
+    memset(m_slots, 0, sizeof(m_slots));
+    memset((LPVOID)m_beats, 0, sizeof(m_beats));
+    memset(&m_stacks, 0, sizeof(m_stacks));
+    m_stackCopy = (LPBYTE) VirtualAlloc(NULL, StackCopySize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    m_hThread = NULL;
+    m_evStop = NULL;
+    m_period = 1000;
+  }
+
+  ~StackWalkerWatchdogInternal() STKWLK_NOEXCEPT
+  {
+    for (int i = 0; i < StackWalkerWatchdog::MaxThreads; i++)
+      if (m_slots[i].hThread != NULL)
+        CloseHandle(m_slots[i].hThread);
+    if (m_stackCopy != NULL)
+      VirtualFree(m_stackCopy, 0, MEM_RELEASE);
+    StackTableFree(m_stacks);
+    DeleteCriticalSection(&m_critsec);
+  }
+
+  static DWORD WINAPI WatchdogProc(LPVOID param) STKWLK_NOEXCEPT
+  {
+    StackWalkerWatchdog * wd = (StackWalkerWatchdog *)param;
+    StackWalkerWatchdogInternal * wdi = wd->m_wd;
+    while (WaitForSingleObject(wdi->m_evStop, wdi->m_period) == WAIT_TIMEOUT)
+      wd->Check();
+    return 0;
+  }
+
+  // returns true if the callstack is reported
+  bool CheckSlot(int slot, StackWalkerWatchdog::THangInfo & info, DWORD64 * frames, int & count) STKWLK_NOEXCEPT
+  {
+    TSlot & sl = m_slots[slot];
+    DWORD now = GetTickCount();
+    LONG beat = m_beats[slot];
+    if (beat != sl.lastBeat)
+    {
+      sl.lastBeat = beat;
+      sl.lastChange = now;
+      return false;
+    }
+    if (now - sl.lastChange < m_deadline)
+      return false;
+    if (m_stackCopy == NULL || sl.threadId == GetCurrentThreadId())
+      return false;   // a thread which calls Check is not stuck
+
+    StackWalkerBase::TSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    if (SuspendThread(sl.hThread) == (DWORD)-1)
+      return false;
+    snap.context.ContextFlags = STKWLK_CONTEXT_FLAGS;
+    BOOL ok = GetThreadContext(sl.hThread, &snap.context);
+    if (ok != FALSE)
+    {
+#if defined(_M_IX86)
+      snap.stackAddr = snap.context.Esp;
+#elif defined(_M_X64)
+      snap.stackAddr = snap.context.Rsp;
+#elif defined(_M_IA64)
+      snap.stackAddr = snap.context.IntSp;
+#endif
+      snap.stackData = m_stackCopy;
+      snap.stackSize = ReadStackMemory(GetCurrentProcess(), snap.stackAddr, m_stackCopy, StackCopySize);
+    }
+    ResumeThread(sl.hThread);
+    if (ok == FALSE)
+      return false;
+    count = m_sw->GetSnapshotFrames(snap, frames, STKWLK_MAX_RAW_FRAMES);
+    if (count <= 0)
+      return false;
+
+    TStackNode * node = StackTableIntern(m_stacks, frames, count);
+    if (node == NULL)
+      return false;
+    node->value[Hits]++;
+    if (node->value[Hits] > 1 && now - (DWORD)node->value[LastReport] < m_repeat)
+      return false;    // this callstack was reported recently
+    node->value[LastReport] = now;
+
+    info.slot = slot;
+    info.threadId = sl.threadId;
+    info.stuckMs = now - sl.lastChange;
+    info.stackId = node->id;
+    info.hits = node->value[Hits];
+    return true;
+  }
+};
+
+StackWalkerWatchdog::StackWalkerWatchdog(StackWalkerBase & sw, DWORD deadlineMs, DWORD repeatMs) STKWLK_NOEXCEPT
+{
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerWatchdogInternal));
+  m_wd = (buf == NULL) ? NULL : new(buf) StackWalkerWatchdogInternal(sw, deadlineMs, repeatMs);  // placement new
+  m_beats = (m_wd == NULL) ? NULL : m_wd->m_beats;
+}
+
+StackWalkerWatchdog::~StackWalkerWatchdog() STKWLK_NOEXCEPT
+{
+  Stop();
+  if (m_wd != NULL)
+  {
+    m_wd->~StackWalkerWatchdogInternal();
+    free(m_wd);
+  }
+  m_wd = NULL;
+  m_beats = NULL;
+}
+
+bool StackWalkerWatchdog::Start(DWORD periodMs) STKWLK_NOEXCEPT
+{
+  if (m_wd == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (m_wd->m_hThread != NULL)
+    return true;
+  m_wd->m_period = periodMs ? periodMs : 1;
+  m_wd->m_evStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (m_wd->m_evStop == NULL)
+    return false;
+  DWORD tid;
+  m_wd->m_hThread = CreateThread(NULL, 0, StackWalkerWatchdogInternal::WatchdogProc, this, 0, &tid);
+  if (m_wd->m_hThread == NULL)
+  {
+    DWORD gle = GetLastError();
+    CloseHandle(m_wd->m_evStop);
+    m_wd->m_evStop = NULL;
+    SetLastError(gle);
+    return false;
+  }
+  return true;
+}
+
+void StackWalkerWatchdog::Stop() STKWLK_NOEXCEPT
+{
+  if (m_wd == NULL || m_wd->m_hThread == NULL)
+    return;
+  SetEvent(m_wd->m_evStop);
+  WaitForSingleObject(m_wd->m_hThread, INFINITE);
+  CloseHandle(m_wd->m_hThread);
+  CloseHandle(m_wd->m_evStop);
+  m_wd->m_hThread = NULL;
+  m_wd->m_evStop = NULL;
+}
+
+int StackWalkerWatchdog::RegisterThread() STKWLK_NOEXCEPT
+{
+  int slot = -1;
+  HANDLE hThread = NULL;
+  if (m_wd == NULL)
+    return -1;
+  if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &hThread,
+                       THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0))
+    return -1;
+  ::EnterCriticalSection(&m_wd->m_critsec);
+  for (int i = 0; i < MaxThreads; i++)
+  {
+    StackWalkerWatchdogInternal::TSlot & sl = m_wd->m_slots[i];
+    if (sl.hThread != NULL)
+      continue;
+    sl.hThread = hThread;
+    sl.threadId = GetCurrentThreadId();
+    sl.lastBeat = m_beats[i];
+    sl.lastChange = GetTickCount();
+    slot = i;
+    break;
+  }
+  ::LeaveCriticalSection(&m_wd->m_critsec);
+  if (slot < 0)
+  {
+    CloseHandle(hThread);
+    SetLastError(ERROR_TOO_MANY_THREADS);
+  }
+  return slot;
+}
+
+void StackWalkerWatchdog::UnregisterThread(int slot) STKWLK_NOEXCEPT
+{
+  if (m_wd == NULL || slot < 0 || slot >= MaxThreads)
+    return;
+  ::EnterCriticalSection(&m_wd->m_critsec);
+  if (m_wd->m_slots[slot].hThread != NULL)
+    CloseHandle(m_wd->m_slots[slot].hThread);
+  m_wd->m_slots[slot].hThread = NULL;
+  ::LeaveCriticalSection(&m_wd->m_critsec);
+}
+
+int StackWalkerWatchdog::Check() STKWLK_NOEXCEPT
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int     count;
+  int     reported = 0;
+  int     next = 0;
+  if (m_wd == NULL)
+    return 0;
+  for (;;)
+  {
+    // the symbolization is slow, so it is done without the lock (RegisterThread and
+    // UnregisterThread of the other threads are not blocked by it)
+    THangInfo info;
+    bool found = false;
+    ::EnterCriticalSection(&m_wd->m_critsec);
+    while (next < MaxThreads && !found)
+    {
+      int i = next++;
+      if (m_wd->m_slots[i].hThread != NULL)
+        found = m_wd->CheckSlot(i, info, frames, count);
+    }
+    ::LeaveCriticalSection(&m_wd->m_critsec);
+    if (!found)
+      break;
+    m_wd->m_sw->ShowRawCallstack(frames, count, &info);
+    reported++;
+  }
+  return reported;
+}
+
+// ===========================================================================================
+// Per-thread rings of raw callstacks. Every ring has a single producer (its thread) and a single
+// consumer (Drain, serialized by the critical section), so the indexes are published by plain
+// stores: `volatile` accesses are acquire/release with MSVC on x86 and x64 (/volatile:ms).
+// Drain frees the ring of an exited thread once it is empty.
+
+class StackWalkerTraceInternal
+{
+public:
+  struct TSlot
+  {
+    LONGLONG   time;
+    ULONG_PTR  event;
+    int        count;
+    DWORD64    frames[1];     // m_maxFrames
+  };
+
+  struct TRing
+  {
+    TRing *         next;
+    DWORD           threadId;
+    HANDLE          hThread;    // SYNCHRONIZE, NULL - never retired
+    ULONG volatile  head;       // written only by the producer
+    ULONG volatile  tail;       // written only by the consumer
+    ULONG volatile  dropped;    // written only by the producer
+    DWORD64         data[1];    // m_ringSize slots
+  };
+
+  CRITICAL_SECTION  m_critsec;     // list of the rings, Drain
+  TRing *           m_rings;
+  ULONGLONG         m_retiredDropped;   // dropped records of the freed rings
+  DWORD             m_tlsIndex;
+  ULONG             m_ringSize;    // power of 2
+  int               m_maxFrames;
+  size_t            m_slotSize;    // multiple of 8
+
+  StackWalkerTraceInternal(int ringSize, int maxFrames) STKWLK_NOEXCEPT
+  {
+    InitializeCriticalSection(&m_critsec);
+    m_rings = NULL;
+    m_retiredDropped = 0;
+    m_tlsIndex = TlsAlloc();
+    m_ringSize = 2;
+    while (m_ringSize < (ULONG)ringSize && m_ringSize < 0x100000)
+      m_ringSize <<= 1;
+    m_maxFrames = (maxFrames < 1) ? 1 : (maxFrames > STKWLK_MAX_RAW_FRAMES) ? STKWLK_MAX_RAW_FRAMES : maxFrames;
+    m_slotSize = (size_t)&((TSlot *)0)->frames[m_maxFrames];
+  }
+
+  ~StackWalkerTraceInternal() STKWLK_NOEXCEPT
+  {
+    if (m_tlsIndex != TLS_OUT_OF_INDEXES)
+      TlsFree(m_tlsIndex);
+    while (m_rings != NULL)
+    {
+      TRing * ring = m_rings;
+      m_rings = ring->next;
+      FreeRing(ring);
+    }
+    DeleteCriticalSection(&m_critsec);
+  }
+
+  static void FreeRing(TRing * ring) STKWLK_NOEXCEPT
+  {
+    if (ring->hThread != NULL)
+      CloseHandle(ring->hThread);
+    VirtualFree(ring, 0, MEM_RELEASE);
+  }
+
+  // the owner has exited and all its records are drained (called under m_critsec)
+  static bool IsRetired(const TRing * ring) STKWLK_NOEXCEPT
+  {
+    if (ring->hThread == NULL || WaitForSingleObject(ring->hThread, 0) != WAIT_OBJECT_0)
+      return false;
+    return ring->tail == ring->head;    // head is final after the exit
+  }
+
+  TSlot * Slot(TRing * ring, ULONG pos) STKWLK_NOEXCEPT
+  {
+    return (TSlot *)((LPBYTE)ring->data + (pos & (m_ringSize - 1)) * m_slotSize);
+  }
+
+  // The only lock taken by a producer: once per thread
+  TRing * GetRing() STKWLK_NOEXCEPT
+  {
+    if (m_tlsIndex == TLS_OUT_OF_INDEXES)
+      return NULL;
+    TRing * ring = (TRing *)TlsGetValue(m_tlsIndex);
+    if (ring != NULL)
+      return ring;
+    size_t size = (size_t)&((TRing *)0)->data + m_ringSize * m_slotSize;
+    ring = (TRing *)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (ring == NULL)
+      return NULL;
+    ring->threadId = GetCurrentThreadId();
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &ring->hThread,
+                         SYNCHRONIZE, FALSE, 0))
+      ring->hThread = NULL;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ::EnterCriticalSection(&m_critsec);
+    ring->next = m_rings;
+    m_rings = ring;
+    ::LeaveCriticalSection(&m_critsec);
+    TlsSetValue(m_tlsIndex, ring);
+    return ring;
+  }
+};
+
+StackWalkerTraceBuffer::StackWalkerTraceBuffer(int ringSize, int maxFrames) STKWLK_NOEXCEPT
+{
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerTraceInternal));
+  m_tb = (buf == NULL) ? NULL : new(buf) StackWalkerTraceInternal(ringSize, maxFrames);  // placement new
+}
+
+StackWalkerTraceBuffer::~StackWalkerTraceBuffer() STKWLK_NOEXCEPT
+{
+  if (m_tb != NULL)
+  {
+    m_tb->~StackWalkerTraceInternal();
+    free(m_tb);
+  }
+  m_tb = NULL;
+}
+
+bool StackWalkerTraceBuffer::Record(ULONG_PTR event, int framesToSkip) STKWLK_NOEXCEPT
+{
+  if (m_tb == NULL)
+    return false;
+  StackWalkerTraceInternal::TRing * ring = m_tb->GetRing();
+  if (ring == NULL)
+    return false;
+  ULONG head = ring->head;
+  if (head - ring->tail >= m_tb->m_ringSize)
+  {
+    ring->dropped = ring->dropped + 1;
+    return false;
+  }
+  StackWalkerTraceInternal::TSlot * slot = m_tb->Slot(ring, head);
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  slot->time = now.QuadPart;
+  slot->event = event;
+  slot->count = StackWalkerBase::CaptureRawCallstack(slot->frames, m_tb->m_maxFrames, framesToSkip + 1);
+  ring->head = head + 1;    // publish
+  return true;
+}
+
+int StackWalkerTraceBuffer::Drain(PDrainRoutine pDrainFunc, LPVOID pUserData, int maxRecords) STKWLK_NOEXCEPT
+{
+  int drained = 0;
+  if (m_tb == NULL || pDrainFunc == NULL)
+    return 0;
+  ::EnterCriticalSection(&m_tb->m_critsec);
+  StackWalkerTraceInternal::TRing * ring;
+  for (StackWalkerTraceInternal::TRing ** pring = &m_tb->m_rings; (ring = *pring) != NULL; )
+  {
+    ULONG tail = ring->tail;
+    ULONG head = ring->head;
+    for (; tail != head && (maxRecords <= 0 || drained < maxRecords); tail++)
+    {
+      const StackWalkerTraceInternal::TSlot * slot = m_tb->Slot(ring, tail);
+      TTraceRecord rec;
+      rec.threadId = ring->threadId;
+      rec.time = slot->time;
+      rec.event = slot->event;
+      rec.framesCount = slot->count;
+      rec.frames = slot->frames;
+      pDrainFunc(rec, pUserData);
+      drained++;
+    }
+    ring->tail = tail;    // release the slots to the producer
+    if (StackWalkerTraceInternal::IsRetired(ring))
+    {
+      *pring = ring->next;
+      m_tb->m_retiredDropped += ring->dropped;
+      StackWalkerTraceInternal::FreeRing(ring);
+      continue;
+    }
+    pring = &ring->next;
   }
+  ::LeaveCriticalSection(&m_tb->m_critsec);
+  return drained;
+}
+
+ULONGLONG StackWalkerTraceBuffer::GetDroppedCount() STKWLK_NOEXCEPT
+{
+  if (m_tb == NULL)
+    return 0;
+  ::EnterCriticalSection(&m_tb->m_critsec);
+  ULONGLONG dropped = m_tb->m_retiredDropped;
+  for (StackWalkerTraceInternal::TRing * ring = m_tb->m_rings; ring != NULL; ring = ring->next)
+    dropped += ring->dropped;
+  ::LeaveCriticalSection(&m_tb->m_critsec);
+  return dropped;
+}
 
-  typedef struct _TThreadData
-  {
-    ULONGLONG             qwMagic;    // must be qwThreadDataMagic
-    StackWalkerInternal * swi;
-    PReadMemRoutine       pReadMemFunc;
-    LPVOID                pUserData;
-  } TThreadData;
+// ===========================================================================================
+// Sampling profiler. The threads are suspended only to read the context and copy the top of
+// the stack into a preallocated buffer: nothing is allocated while a thread is suspended (it
+// could hold the heap lock). The copy is unwound after the thread is resumed.
 
-  bool ShowCallstack(HANDLE          hThread,
-                     const CONTEXT & context,
-                     TThreadData   & tdata) STKWLK_NOEXCEPT;
+class StackWalkerSamplerInternal
+{
+public:
+  // TStackNode::value
+  enum { Hits = 0 };
 
-  static BOOL WINAPI MyReadProcMem(HANDLE  hProcess,
-                                   DWORD64 qwBaseAddress,
-                                   PVOID   lpBuffer,
-                                   DWORD   nSize,
-                                   LPDWORD lpNumberOfBytesRead) STKWLK_NOEXCEPT;
+  enum { StackCopySize = 64 * 1024 };
 
-  bool InitAndLoad(bool showLoadModules = false) STKWLK_NOEXCEPT;
-};
+#define TH32CS_SNAPTHREAD 0x00000004
+#pragma pack(push, 8)
+  typedef struct tagTHREADENTRY32
+  {
+    DWORD   dwSize;
+    DWORD   cntUsage;
+    DWORD   th32ThreadID;       // this thread
+    DWORD   th32OwnerProcessID; // process this thread is associated with
+    LONG    tpBasePri;
+    LONG    tpDeltaPri;
+    DWORD   dwFlags;
+  } THREADENTRY32;
+  typedef THREADENTRY32* LPTHREADENTRY32;
+#pragma pack(pop)
 
-const ULONGLONG qwThreadDataMagic = 0x00A1B2F4D9F00D33;
-typedef StackWalkerInternal::TThreadData          TThreadData;
-typedef StackWalkerInternal::T_SW_SYM_INFO        T_SW_SYM_INFO;
-typedef StackWalkerInternal::T_IMAGEHLP_MODULE64  T_IMAGEHLP_MODULE64;
+  typedef HANDLE (WINAPI * TCreateToolhelp32Snapshot)(DWORD dwFlags, DWORD th32ProcessID);
+  typedef BOOL (WINAPI * TThread32Next)(HANDLE hSnapshot, LPTHREADENTRY32 lpte);
+  typedef HANDLE (WINAPI * TOpenThread)(DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwThreadId);
+
+  StackWalkerBase *           m_sw;
+  CRITICAL_SECTION            m_critsec;
+  TStackTable                 m_stacks;
+  ULONGLONG                   m_samples;
+  LPBYTE                      m_stackCopy;
+  HANDLE                      m_hThread;
+  HANDLE                      m_evStop;
+  DWORD                       m_period;
+  TCreateToolhelp32Snapshot   m_createSnapshot;
+  TThread32Next               m_thread32First;
+  TThread32Next               m_thread32Next;
+  TOpenThread                 m_openThread;
+
+  StackWalkerSamplerInternal(StackWalkerBase & sw) STKWLK_NOEXCEPT
+  {
+    m_sw = &sw;
+    InitializeCriticalSection(&m_critsec);
+    memset(&m_stacks, 0, sizeof(m_stacks));
+    m_samples = 0;
+    m_stackCopy = (LPBYTE) VirtualAlloc(NULL, StackCopySize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    m_hThread = NULL;
+    m_evStop = NULL;
+    m_period = 10;
+    HMODULE hKernel = GetModuleHandleW(L"kernel32");
+    int fcnt = 0;
+    GetProcAddrEx(fcnt, hKernel, "CreateToolhelp32Snapshot", (LPVOID*)&m_createSnapshot);
+    GetProcAddrEx(fcnt, hKernel, "Thread32First", (LPVOID*)&m_thread32First);
+    GetProcAddrEx(fcnt, hKernel, "Thread32Next", (LPVOID*)&m_thread32Next);
+    GetProcAddrEx(fcnt, hKernel, "OpenThread", (LPVOID*)&m_openThread);
+    if (fcnt != 4)
+      m_createSnapshot = NULL;    // not supported (NT4 or Win9x)
+  }
 
-// #############################################################
+  ~StackWalkerSamplerInternal() STKWLK_NOEXCEPT
+  {
+    if (m_stackCopy != NULL)
+      VirtualFree(m_stackCopy, 0, MEM_RELEASE);
+    StackTableFree(m_stacks);
+    DeleteCriticalSection(&m_critsec);
+  }
 
-StackWalkerBase::TDbgHelpErr::TDbgHelpErr(SW_CSTR szFuncName, DWORD gle, DWORD64 addr) STKWLK_NOEXCEPT
+  static DWORD WINAPI SamplerProc(LPVOID param) STKWLK_NOEXCEPT
+  {
+    StackWalkerSampler * sp = (StackWalkerSampler *)param;
+    StackWalkerSamplerInternal * spi = sp->m_sp;
+    while (WaitForSingleObject(spi->m_evStop, spi->m_period) == WAIT_TIMEOUT)
+      sp->Sample();
+    return 0;
+  }
+
+  // must be called under m_critsec
+  bool SampleThread(HANDLE hThread, DWORD64 * frames) STKWLK_NOEXCEPT
+  {
+    StackWalkerBase::TSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    if (SuspendThread(hThread) == (DWORD)-1)
+      return false;
+    snap.context.ContextFlags = STKWLK_CONTEXT_FLAGS;
+    BOOL ok = GetThreadContext(hThread, &snap.context);
+    if (ok != FALSE)
+    {
+#if defined(_M_IX86)
+      snap.stackAddr = snap.context.Esp;
+#elif defined(_M_X64)
+      snap.stackAddr = snap.context.Rsp;
+#elif defined(_M_IA64)
+      snap.stackAddr = snap.context.IntSp;
+#endif
+      snap.stackData = m_stackCopy;
+      snap.stackSize = ReadStackMemory(GetCurrentProcess(), snap.stackAddr, m_stackCopy, StackCopySize);
+    }
+    ResumeThread(hThread);
+    if (ok == FALSE)
+      return false;
+    int count = m_sw->GetSnapshotFrames(snap, frames, STKWLK_MAX_RAW_FRAMES);
+    if (count <= 0)
+      return false;
+    TStackNode * node = StackTableIntern(m_stacks, frames, count);
+    if (node == NULL)
+      return false;
+    node->value[Hits]++;
+    m_samples++;
+    return true;
+  }
+};
+
+StackWalkerSampler::StackWalkerSampler(StackWalkerBase & sw) STKWLK_NOEXCEPT
 {
-  this->szFuncName = szFuncName;
-  this->gle = gle;
-  this->addr = addr;
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerSamplerInternal));
+  m_sp = (buf == NULL) ? NULL : new(buf) StackWalkerSamplerInternal(sw);  // placement new
 }
 
-// =============================================================
-
-#define STKWLK_CURRENT_THREAD_HANDLE  ((HANDLE)(ULONG_PTR)-2)
+StackWalkerSampler::~StackWalkerSampler() STKWLK_NOEXCEPT
+{
+  Stop();
+  if (m_sp != NULL)
+  {
+    m_sp->~StackWalkerSamplerInternal();
+    free(m_sp);
+  }
+  m_sp = NULL;
+}
 
-typedef LONG (WINAPI * TNtQueryInfoThread)(HANDLE thread, DWORD infoClass, PVOID info, ULONG infoLen, PULONG retLen);
+bool StackWalkerSampler::Start(DWORD periodMs) STKWLK_NOEXCEPT
+{
+  if (m_sp == NULL || m_sp->m_stackCopy == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (m_sp->m_createSnapshot == NULL)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return false;
+  }
+  if (m_sp->m_hThread != NULL)
+    return true;
+  m_sp->m_period = periodMs ? periodMs : 1;
+  m_sp->m_evStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (m_sp->m_evStop == NULL)
+    return false;
+  m_sp->m_hThread = CreateThread(NULL, 0, StackWalkerSamplerInternal::SamplerProc, this, 0, NULL);
+  if (m_sp->m_hThread == NULL)
+  {
+    CloseHandle(m_sp->m_evStop);
+    m_sp->m_evStop = NULL;
+    return false;
+  }
+  SetThreadPriority(m_sp->m_hThread, THREAD_PRIORITY_HIGHEST);
+  return true;
+}
 
-static TNtQueryInfoThread NtQueryInfoThread = NULL;
+void StackWalkerSampler::Stop() STKWLK_NOEXCEPT
+{
+  if (m_sp == NULL || m_sp->m_hThread == NULL)
+    return;
+  SetEvent(m_sp->m_evStop);
+  WaitForSingleObject(m_sp->m_hThread, INFINITE);
+  CloseHandle(m_sp->m_hThread);
+  CloseHandle(m_sp->m_evStop);
+  m_sp->m_hThread = NULL;
+  m_sp->m_evStop = NULL;
+}
 
-typedef struct _ThreadBasicInfo
+int StackWalkerSampler::Sample() STKWLK_NOEXCEPT
 {
-  LONG      ExitStatus;
-  LPVOID    TebBaseAddress;
-  HANDLE    UniqueProcess;
-  HANDLE    UniqueThread; 
-  ULONG_PTR AffinityMask;
-  LONG      Priority;
-  LONG      BasePriority;
-} ThreadBasicInfo;
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int     sampled = 0;
+  if (m_sp == NULL || m_sp->m_stackCopy == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return 0;
+  }
+  if (m_sp->m_createSnapshot == NULL)
+  {
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return 0;
+  }
+  HANDLE hSnap = m_sp->m_createSnapshot(TH32CS_SNAPTHREAD, 0);
+  if (hSnap == INVALID_HANDLE_VALUE)
+    return 0;
+  DWORD pid = GetCurrentProcessId();
+  DWORD self = GetCurrentThreadId();
+  StackWalkerSamplerInternal::THREADENTRY32 te;
+  te.dwSize = sizeof(te);
+  ::EnterCriticalSection(&m_sp->m_critsec);
+  for (BOOL ok = m_sp->m_thread32First(hSnap, &te); ok != FALSE; ok = m_sp->m_thread32Next(hSnap, &te))
+  {
+    if (te.th32OwnerProcessID != pid || te.th32ThreadID == self)
+      continue;
+    HANDLE hThread = m_sp->m_openThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION,
+                                        FALSE, te.th32ThreadID);
+    if (hThread == NULL)
+      continue;    // e.g. the thread has exited
+    if (m_sp->SampleThread(hThread, frames))
+      sampled++;
+    CloseHandle(hThread);
+  }
+  ::LeaveCriticalSection(&m_sp->m_critsec);
+  CloseHandle(hSnap);
+  return sampled;
+}
 
-static DWORD GetThreadIdByHandle(HANDLE thread) STKWLK_NOEXCEPT
+ULONGLONG StackWalkerSampler::GetSamplesCount() STKWLK_NOEXCEPT
 {
-  if (thread == STKWLK_CURRENT_THREAD_HANDLE)
-    return GetCurrentThreadId();
-  if (thread == NULL)
+  if (m_sp == NULL)
     return 0;
-#if _WIN32_WINNT >= 0x0502
-  return GetThreadId(thread);
-#else
-  if (NtQueryInfoThread == NULL)
+  ::EnterCriticalSection(&m_sp->m_critsec);
+  ULONGLONG samples = m_sp->m_samples;
+  ::LeaveCriticalSection(&m_sp->m_critsec);
+  return samples;
+}
+
+bool StackWalkerSampler::Dump() STKWLK_NOEXCEPT
+{
+  if (m_sp == NULL)
   {
-    HMODULE ntdll = GetModuleHandleW(L"ntdll");
-    if (ntdll == NULL)
-      return 0;
-    NtQueryInfoThread = (TNtQueryInfoThread) GetProcAddress(ntdll, "NtQueryInformationThread");
-    if (NtQueryInfoThread == NULL)
-      return 0;
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
   }
-  ThreadBasicInfo tbi = { 0 };
-  ULONG len;
-  LONG ns = NtQueryInfoThread(thread, 0, (PVOID)&tbi, sizeof(tbi), &len);
-  return (ns == 0) ? (DWORD)(ULONG_PTR)tbi.UniqueThread : 0;
-#endif
+  ::EnterCriticalSection(&m_sp->m_critsec);
+  int count = m_sp->m_stacks.count;
+  ::LeaveCriticalSection(&m_sp->m_critsec);
+  if (count == 0)
+    return true;
+  TSampleSite * sites = (TSampleSite *) malloc(count * sizeof(TSampleSite));
+  if (sites == NULL)
+  {
+    SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+    return false;
+  }
+  int n = 0;
+  ::EnterCriticalSection(&m_sp->m_critsec);
+  for (const TStackNode * node = m_sp->m_stacks.all; node != NULL && n < count; node = node->nextAll)
+  {
+    TSampleSite & site = sites[n++];
+    site.id = node->id;
+    site.framesCount = node->count;
+    site.frames = node->frames;    // the nodes are never freed before Reset
+    site.hits = node->value[StackWalkerSamplerInternal::Hits];
+  }
+  ::LeaveCriticalSection(&m_sp->m_critsec);
+  bool result = true;
+  for (int i = 0; i < n; i++)
+    if (!m_sp->m_sw->ShowRawCallstack(sites[i].frames, sites[i].framesCount, &sites[i]))
+      result = false;
+  free(sites);
+  return result;
 }
 
-static PNT_TIB GetCurrentTIB() STKWLK_NOEXCEPT
+void StackWalkerSampler::Reset() STKWLK_NOEXCEPT
 {
-#if _MSC_VER >= 1400
-  return (PNT_TIB)NtCurrentTeb();
+  if (m_sp == NULL)
+    return;
+  ::EnterCriticalSection(&m_sp->m_critsec);
+  StackTableFree(m_sp->m_stacks);
+  m_sp->m_samples = 0;
+  ::LeaveCriticalSection(&m_sp->m_critsec);
+}
+
+// ===========================================================================================
+
+static bool SwStrToUtf8(SW_CSTR str, char * buf, int bufSize) STKWLK_NOEXCEPT
+{
+#ifdef STKWLK_ANSI
+  WCHAR wbuf[STACKWALK_MAX_NAMELEN];
+  if (MultiByteToWideChar(CP_ACP, 0, str, -1, wbuf, _countof(wbuf)) <= 0)
+    return false;
+  LPCWSTR wstr = wbuf;
 #else
-  PNT_TIB lpTIB;
-  __asm mov eax, fs:[0x18]
-  __asm mov[lpTIB], eax
-  return lpTIB;
+  LPCWSTR wstr = str;
 #endif
+  return WideCharToMultiByte(CP_UTF8, 0, wstr, -1, buf, bufSize, NULL, NULL) > 0;
 }
 
-// =============================================================
+// ===========================================================================================
+// pprof writer (https://github.com/google/pprof/blob/main/proto/profile.proto)
 
-#if defined(_MSC_VER) && _MSC_VER < 1900
-extern "C" void* __cdecl _getptd();
-#endif
-#if defined(_MSC_VER) && _MSC_VER >= 1900
-extern "C" void** __cdecl __current_exception_context();
-#endif
+// field numbers of the messages
+enum
+{
+  PbProfileSampleType = 1, PbProfileSample = 2, PbProfileMapping = 3, PbProfileLocation = 4,
+  PbProfileFunction = 5, PbProfileStringTable = 6, PbProfileTimeNanos = 9, PbProfileDurationNanos = 10,
+  PbValueTypeType = 1, PbValueTypeUnit = 2,
+  PbSampleLocationId = 1, PbSampleValue = 2,
+  PbMappingId = 1, PbMappingStart = 2, PbMappingLimit = 3, PbMappingFilename = 5,
+  PbMappingHasFunctions = 7, PbMappingHasFilenames = 8, PbMappingHasLineNumbers = 9,
+  PbLocationId = 1, PbLocationMappingId = 2, PbLocationAddress = 3, PbLocationLine = 4,
+  PbLineFunctionId = 1, PbLineLine = 2,
+  PbFunctionId = 1, PbFunctionName = 2, PbFunctionSystemName = 3, PbFunctionFilename = 4,
+};
 
-static PCONTEXT get_current_exception_context() STKWLK_NOEXCEPT
+enum { PbVarint = 0, PbLen = 2 };
+
+static LPBYTE PutVarint(LPBYTE p, DWORD64 v) STKWLK_NOEXCEPT
 {
-  PCONTEXT * pctx = NULL;
-#if _MSC_VER < 1400 && !defined(_MT)
-  return NULL;
-#elif _MSC_VER < 1900
-  char * ptd = (char *)_getptd();
-  if (ptd == NULL)
-    return NULL;
-#if _MSC_VER >= 1200 && _MSC_VER < 1300
-  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x70 : 0xC0));  // VC6
-#elif _MSC_VER >= 1300 && _MSC_VER < 1400
-  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x7C : 0xE0));  // VC7 ... vs2003
-#else
-  pctx = (PCONTEXT *)(ptd + (sizeof(void*) == 4 ? 0x8C : 0xF8));  // vs2005 ... vs2013
-#endif
-#else // _MSC_VER >= 1900
-  pctx = (PCONTEXT *)__current_exception_context();
-#endif
-  return pctx ? *pctx : NULL;
+  while (v >= 0x80)
+  {
+    *p++ = (BYTE)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (BYTE)v;
+  return p;
+}
+
+static LPBYTE PbPutTag(LPBYTE p, int field, int wireType) STKWLK_NOEXCEPT
+{
+  return PutVarint(p, (DWORD64)((field << 3) | wireType));
 }
 
-// =============================================================
+// zero values are omitted (proto3 defaults)
+static LPBYTE PbPutField(LPBYTE p, int field, DWORD64 v) STKWLK_NOEXCEPT
+{
+  if (v == 0)
+    return p;
+  p = PbPutTag(p, field, PbVarint);
+  return PutVarint(p, v);
+}
+
+// Record of a table: string, function, location or mapping. The records are listed in
+// the order of their ids (starting with 1, strings with 0).
+typedef struct _TPprofNode
+{
+  struct _TPprofNode * next;        // hash chain
+  struct _TPprofNode * nextAll;     // list of all records
+  DWORD64              key;
+  int                  id;
+  DWORD64              v[3];        // fields of the record
+  char                 text[1];     // only strings
+} TPprofNode;
+
+typedef struct _TPprofTable
+{
+  enum { Buckets = 4096 };
+  TPprofNode *  buckets[Buckets];
+  TPprofNode *  first;
+  TPprofNode *  last;
+  int           count;
+} TPprofTable;
+
+class StackWalkerPprofInternal
+{
+public:
+  // TPprofNode::v
+  enum { FuncName = 0, FuncSysName, FuncFile };
+  enum { LocMapping = 0, LocFunction, LocLine };
+  enum { MapLimit = 0, MapFile, MapMaxAddr };
+
+  HANDLE       m_hFile;
+  BYTE         m_buf[64 * 1024];
+  size_t       m_bufLen;
+  bool         m_error;
+  ULONGLONG    m_timeNanos;
+  ULONGLONG    m_startTicks;
+  int          m_typeStr;
+  int          m_unitStr;
+  TArena       m_arena;
+  TPprofTable  m_strings;
+  TPprofTable  m_functions;
+  TPprofTable  m_locations;
+  TPprofTable  m_mappings;
+
+  StackWalkerPprofInternal() STKWLK_NOEXCEPT
+  {
+    m_hFile = INVALID_HANDLE_VALUE;
+    memset(&m_arena, 0, sizeof(m_arena));
+    Reset();
+  }
+
+  ~StackWalkerPprofInternal() STKWLK_NOEXCEPT
+  {
+    if (m_hFile != INVALID_HANDLE_VALUE)
+      CloseHandle(m_hFile);
+    ArenaFree(m_arena);
+  }
+
+  void Reset() STKWLK_NOEXCEPT
+  {
+    ArenaFree(m_arena);
+    memset(&m_strings, 0, sizeof(m_strings));
+    memset(&m_functions, 0, sizeof(m_functions));
+    memset(&m_locations, 0, sizeof(m_locations));
+    memset(&m_mappings, 0, sizeof(m_mappings));
+    m_bufLen = 0;
+    m_error = false;
+    m_typeStr = 0;
+    m_unitStr = 0;
+  }
+
+  // ---------------------------------------- output
+  void Write(LPCVOID data, size_t size) STKWLK_NOEXCEPT
+  {
+    if (m_bufLen + size > sizeof(m_buf))
+      Flush();
+    if (size > sizeof(m_buf))
+    {
+      DWORD written;
+      if (!WriteFile(m_hFile, data, (DWORD)size, &written, NULL) || written != size)
+        m_error = true;
+      return;
+    }
+    memcpy(m_buf + m_bufLen, data, size);
+    m_bufLen += size;
+  }
+
+  void Flush() STKWLK_NOEXCEPT
+  {
+    DWORD written;
+    if (m_bufLen > 0)
+      if (!WriteFile(m_hFile, m_buf, (DWORD)m_bufLen, &written, NULL) || written != m_bufLen)
+        m_error = true;
+    m_bufLen = 0;
+  }
+
+  // write a length-delimited field of the Profile message
+  void WriteMessage(int field, LPCVOID msg, size_t size) STKWLK_NOEXCEPT
+  {
+    BYTE hdr[16];
+    LPBYTE p = PbPutTag(hdr, field, PbLen);
+    p = PutVarint(p, size);
+    Write(hdr, p - hdr);
+    Write(msg, size);
+  }
+
+  // ---------------------------------------- tables
+  static size_t Bucket(DWORD64 key) STKWLK_NOEXCEPT
+  {
+    return (size_t)((key * (DWORD64)0x9E3779B97F4A7C15) >> 52) & (TPprofTable::Buckets - 1);
+  }
+
+  TPprofNode * Find(TPprofTable & tbl, DWORD64 key) STKWLK_NOEXCEPT
+  {
+    TPprofNode * node = tbl.buckets[Bucket(key)];
+    while (node != NULL && node->key != key)
+      node = node->next;
+    return node;
+  }
+
+  TPprofNode * Add(TPprofTable & tbl, DWORD64 key, size_t textLen = 0) STKWLK_NOEXCEPT
+  {
+    TPprofNode * node = (TPprofNode *) ArenaAlloc(m_arena, sizeof(TPprofNode) + textLen);
+    if (node == NULL)
+      return NULL;
+    memset(node, 0, sizeof(TPprofNode));
+    node->key = key;
+    node->id = ++tbl.count;
+    size_t b = Bucket(key);
+    node->next = tbl.buckets[b];
+    tbl.buckets[b] = node;
+    if (tbl.last)
+      tbl.last->nextAll = node;
+    else
+      tbl.first = node;
+    tbl.last = node;
+    return node;
+  }
+
+  // returns the index of the UTF-8 string in the string table (0 - empty string or out of memory);
+  // string_table[0] is "", so the pooled string N is at the index N
+  int StrU8(const char * str) STKWLK_NOEXCEPT
+  {
+    size_t len;
+    DWORD64 hash = (DWORD64)0xCBF29CE484222325;   // FNV-1a
+    if (str == NULL || str[0] == 0)
+      return 0;
+    for (len = 0; str[len] != 0; len++)
+      hash = (hash ^ (BYTE)str[len]) * (DWORD64)1099511628211;
+    TPprofNode * node = m_strings.buckets[Bucket(hash)];
+    for (; node != NULL; node = node->next)
+      if (node->key == hash && node->v[0] == len && memcmp(node->text, str, len) == 0)
+        return node->id;
+    node = Add(m_strings, hash, len);
+    if (node == NULL)
+      return 0;
+    node->v[0] = len;
+    memcpy(node->text, str, len + 1);
+    return node->id;
+  }
+
+  int Str(SW_CSTR str) STKWLK_NOEXCEPT
+  {
+    char buf[STACKWALK_MAX_NAMELEN * 3];
+    if (str == NULL || str[0] == 0)
+      return 0;
+    if (!SwStrToUtf8(str, buf, sizeof(buf)))
+      return 0;
+    return StrU8(buf);
+  }
+
+  int Mapping(DWORD64 base, DWORD64 limit, SW_CSTR file) STKWLK_NOEXCEPT
+  {
+    TPprofNode * node = Find(m_mappings, base);
+    if (node != NULL)
+      return node->id;
+    node = Add(m_mappings, base);
+    if (node == NULL)
+      return 0;
+    node->v[MapLimit] = limit;
+    node->v[MapFile] = Str(file);
+    return node->id;
+  }
+
+  int Function(SW_CSTR name, SW_CSTR sysName, SW_CSTR file) STKWLK_NOEXCEPT
+  {
+    int nameStr = Str(name);
+    int fileStr = Str(file);
+    if (nameStr == 0)
+      return 0;
+    DWORD64 key = ((DWORD64)nameStr << 32) | (DWORD)fileStr;
+    TPprofNode * node = Find(m_functions, key);
+    if (node != NULL)
+      return node->id;
+    node = Add(m_functions, key);
+    if (node == NULL)
+      return 0;
+    node->v[FuncName] = nameStr;
+    node->v[FuncSysName] = Str(sysName);
+    node->v[FuncFile] = fileStr;
+    return node->id;
+  }
+
+  // ---------------------------------------- Profile message
+  void WriteSample(const DWORD64 * frames, int count, LONGLONG value) STKWLK_NOEXCEPT
+  {
+    BYTE ids[StackWalkerPprofWriter::MaxFrames * 10];
+    BYTE msg[sizeof(ids) + 32];
+    LPBYTE p = ids;
+    for (int i = 0; i < count; i++)
+    {
+      TPprofNode * loc = Find(m_locations, frames[i]);
+      if (loc != NULL)
+        p = PutVarint(p, loc->id);
+    }
+    LPBYTE m = msg;
+    m = PbPutTag(m, PbSampleLocationId, PbLen);   // packed
+    m = PutVarint(m, p - ids);
+    memcpy(m, ids, p - ids);
+    m += p - ids;
+    m = PbPutTag(m, PbSampleValue, PbLen);
+    LPBYTE vlen = m++;
+    LPBYTE vpos = m;
+    m = PutVarint(m, (DWORD64)value);
+    *vlen = (BYTE)(m - vpos);   // at most 10 bytes
+    WriteMessage(PbProfileSample, msg, m - msg);
+  }
+
+  void WriteTables(ULONGLONG durationNanos) STKWLK_NOEXCEPT
+  {
+    BYTE msg[128];
+    BYTE line[32];
+    LPBYTE m;
+    TPprofNode * node;
+
+    m = PbPutField(msg, PbValueTypeType, m_typeStr);
+    m = PbPutField(m, PbValueTypeUnit, m_unitStr);
+    WriteMessage(PbProfileSampleType, msg, m - msg);
+
+    for (node = m_mappings.first; node != NULL; node = node->nextAll)
+    {
+      DWORD64 limit = node->v[MapLimit] ? node->key + node->v[MapLimit] : node->v[MapMaxAddr] + 1;
+      m = PbPutField(msg, PbMappingId, node->id);
+      m = PbPutField(m, PbMappingStart, node->key);
+      m = PbPutField(m, PbMappingLimit, limit);
+      m = PbPutField(m, PbMappingFilename, node->v[MapFile]);
+      m = PbPutField(m, PbMappingHasFunctions, 1);
+      m = PbPutField(m, PbMappingHasFilenames, 1);
+      m = PbPutField(m, PbMappingHasLineNumbers, 1);
+      WriteMessage(PbProfileMapping, msg, m - msg);
+    }
+
+    for (node = m_locations.first; node != NULL; node = node->nextAll)
+    {
+      m = PbPutField(msg, PbLocationId, node->id);
+      m = PbPutField(m, PbLocationMappingId, node->v[LocMapping]);
+      m = PbPutField(m, PbLocationAddress, node->key);
+      if (node->v[LocFunction] != 0)
+      {
+        LPBYTE l = PbPutField(line, PbLineFunctionId, node->v[LocFunction]);
+        l = PbPutField(l, PbLineLine, node->v[LocLine]);
+        m = PbPutTag(m, PbLocationLine, PbLen);
+        m = PutVarint(m, l - line);
+        memcpy(m, line, l - line);
+        m += l - line;
+      }
+      WriteMessage(PbProfileLocation, msg, m - msg);
+    }
 
-bool StackWalkerBase::Init(ExceptType extype, int options, SW_CSTR szSymPath, DWORD dwProcessId,
-                           HANDLE hProcess, PEXCEPTION_POINTERS exp) STKWLK_NOEXCEPT
-{
-  PCONTEXT ctx = NULL;
-  if (extype == AfterCatch)
-    ctx = get_current_exception_context();
-  if (extype == AfterExcept && exp)
-    ctx = exp->ContextRecord;
-  this->m_sw = NULL;
-  /* MSVC ignore std::nothrow specifier for `new` operator */
-  LPVOID buf = malloc(sizeof(StackWalkerInternal));
-  if (!buf)
-    return false;
-  memset(buf, 0, sizeof(StackWalkerInternal));
-  this->m_sw = new(buf) StackWalkerInternal(this, options, hProcess, ctx);  // placement new
-  SetTargetProcess(dwProcessId, hProcess);
-  SetSymPath(szSymPath);
-  return true;
-}
+    for (node = m_functions.first; node != NULL; node = node->nextAll)
+    {
+      m = PbPutField(msg, PbFunctionId, node->id);
+      m = PbPutField(m, PbFunctionName, node->v[FuncName]);
+      m = PbPutField(m, PbFunctionSystemName, node->v[FuncSysName]);
+      m = PbPutField(m, PbFunctionFilename, node->v[FuncFile]);
+      WriteMessage(PbProfileFunction, msg, m - msg);
+    }
 
-StackWalkerBase::StackWalkerBase(DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
-{
-  Init(NonExcept, OptionsAll, NULL, dwProcessId, hProcess);
-}
+    WriteMessage(PbProfileStringTable, "", 0);   // string_table[0] must be ""
+    for (node = m_strings.first; node != NULL; node = node->nextAll)
+      WriteMessage(PbProfileStringTable, node->text, (size_t)node->v[0]);
 
-StackWalkerBase::StackWalkerBase(int options, SW_CSTR szSymPath, DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
-{
-  Init(NonExcept, options, szSymPath, dwProcessId, hProcess);
-}
+    m = PbPutField(msg, PbProfileTimeNanos, m_timeNanos);
+    m = PbPutField(m, PbProfileDurationNanos, durationNanos);
+    Write(msg, m - msg);
+  }
+};
 
-StackWalkerBase::StackWalkerBase(ExceptType extype, int options, PEXCEPTION_POINTERS exp) STKWLK_NOEXCEPT
+StackWalkerPprofWriter::StackWalkerPprofWriter(int options) STKWLK_NOEXCEPT
+  : StackWalkerBase(options, NULL, GetCurrentProcessId(), GetCurrentProcess())
 {
-  Init(extype, options, NULL, GetCurrentProcessId(), GetCurrentProcess(), exp);
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerPprofInternal));
+  m_pp = (buf == NULL) ? NULL : new(buf) StackWalkerPprofInternal();  // placement new
 }
 
-StackWalkerBase::~StackWalkerBase() STKWLK_NOEXCEPT
+StackWalkerPprofWriter::~StackWalkerPprofWriter() STKWLK_NOEXCEPT
 {
-  if (m_sw != NULL) {
-    m_sw->~StackWalkerInternal();  // call the object's destructor
-    free(m_sw);
+  if (m_pp != NULL)
+  {
+    m_pp->~StackWalkerPprofInternal();
+    free(m_pp);
   }
-  m_sw = NULL;
+  m_pp = NULL;
 }
 
-bool StackWalkerBase::SetSymPath(SW_CSTR szSymPath) STKWLK_NOEXCEPT
+bool StackWalkerPprofWriter::Open(LPCWSTR szFileName, const char * sampleType, const char * sampleUnit) STKWLK_NOEXCEPT
 {
-  if (m_sw == NULL)
+  if (m_pp == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
     return false;
-  free((LPVOID)m_sw->m_szSymPath);
-  m_sw->m_szSymPath = NULL;
-  if (szSymPath == NULL)
-    return true;
-  m_sw->m_szSymPath = (SW_CSTR) sw_sdup(szSymPath);
-  if (m_sw->m_szSymPath)
-    m_sw->m_options |= SymBuildPath;
-  return m_sw->m_szSymPath ? true : false;
+  }
+  if (m_pp->m_hFile != INVALID_HANDLE_VALUE)
+  {
+    SetLastError(ERROR_ALREADY_EXISTS);
+    return false;
+  }
+  m_pp->Reset();
+  m_pp->m_hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (m_pp->m_hFile == INVALID_HANDLE_VALUE)
+    return false;
+  m_pp->m_typeStr = m_pp->StrU8(sampleType);
+  m_pp->m_unitStr = m_pp->StrU8(sampleUnit);
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  ULARGE_INTEGER t;
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+  m_pp->m_timeNanos = (t.QuadPart - (ULONGLONG)116444736000000000) * 100;   // since 1970
+  m_pp->m_startTicks = t.QuadPart;
+  ShowModules(m_pp);   // mappings (OnLoadModule)
+  return true;
 }
 
-bool StackWalkerBase::SetDbgHelpPath(LPCWSTR szDllPath) STKWLK_NOEXCEPT
+bool StackWalkerPprofWriter::AddSample(const DWORD64 * frames, int count, LONGLONG value) STKWLK_NOEXCEPT
 {
-  if (m_sw == NULL)
+  DWORD64 unknown[MaxFrames];
+  int     ucount = 0;
+  if (m_pp == NULL || m_pp->m_hFile == INVALID_HANDLE_VALUE)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
     return false;
-  free((LPVOID)m_sw->m_szDbgHelpPath);
-  m_sw->m_szDbgHelpPath = NULL;
-  if (szDllPath == NULL)
-    return true;
-  m_sw->m_szDbgHelpPath = (LPCWSTR)_wcsdup(szDllPath);
-  return m_sw->m_szDbgHelpPath ? true : false;
+  }
+  if (count > MaxFrames)
+    count = MaxFrames;
+  for (int i = 0; i < count; i++)
+    if (frames[i] != 0 && m_pp->Find(m_pp->m_locations, frames[i]) == NULL)
+      unknown[ucount++] = frames[i];
+  if (ucount > 0)
+  {
+    // every new address is symbolized once (OnCallstackEntry adds the location)
+    SymbolizeBatch(unknown, ucount, m_pp);
+    for (int i = 0; i < ucount; i++)
+      if (m_pp->Find(m_pp->m_locations, unknown[i]) == NULL)
+        m_pp->Add(m_pp->m_locations, unknown[i]);   // address only
+  }
+  m_pp->WriteSample(frames, count, value);
+  return !m_pp->m_error;
 }
 
-bool StackWalkerBase::SetTargetProcess(DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT
+bool StackWalkerPprofWriter::Close() STKWLK_NOEXCEPT
 {
-  if (m_sw == NULL)
+  if (m_pp == NULL || m_pp->m_hFile == INVALID_HANDLE_VALUE)
+  {
+    SetLastError(ERROR_INVALID_HANDLE);
     return false;
-  m_sw->m_dwProcessId = dwProcessId;
-  m_sw->m_hProcess = hProcess;
-  return true;
+  }
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  ULARGE_INTEGER t;
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+  m_pp->WriteTables((t.QuadPart - m_pp->m_startTicks) * 100);
+  m_pp->Flush();
+  bool result = !m_pp->m_error;
+  CloseHandle(m_pp->m_hFile);
+  m_pp->m_hFile = INVALID_HANDLE_VALUE;
+  m_pp->Reset();
+  if (!result)
+    SetLastError(ERROR_WRITE_FAULT);
+  return result;
 }
 
-PCONTEXT StackWalkerBase::GetCurrentExceptionContext() STKWLK_NOEXCEPT
+void StackWalkerPprofWriter::OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT
 {
-  return get_current_exception_context();
+  if (m_pp != NULL && GetUserData() == m_pp)
+    m_pp->Mapping(data.baseAddr, data.size, data.imgName);
 }
 
-LPVOID StackWalkerBase::GetUserData() STKWLK_NOEXCEPT
+void StackWalkerPprofWriter::OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
 {
-  return (this->m_sw == NULL) ? NULL : this->m_sw->m_pUserData;
+  typedef StackWalkerPprofInternal TPP;
+  if (m_pp == NULL || GetUserData() != m_pp || entry.type == lastEntry || entry.offset == 0)
+    return;
+  if (m_pp->Find(m_pp->m_locations, entry.offset) != NULL)
+    return;
+  int mappingId = 0;
+  if (entry.baseOfImage != 0)
+  {
+    // module loaded after Open: the limit is extended by the addresses seen
+    mappingId = m_pp->Mapping(entry.baseOfImage, 0, entry.loadedImageName ? entry.loadedImageName : entry.moduleName);
+    TPprofNode * map = m_pp->Find(m_pp->m_mappings, entry.baseOfImage);
+    if (map != NULL && map->v[TPP::MapMaxAddr] < entry.offset)
+      map->v[TPP::MapMaxAddr] = entry.offset;
+  }
+  SW_CSTR name = entry.undName ? entry.undName : entry.name;
+  int functionId = m_pp->Function(name, entry.name, entry.lineFileName);
+  TPprofNode * loc = m_pp->Add(m_pp->m_locations, entry.offset);
+  if (loc == NULL)
+    return;
+  loc->v[TPP::LocMapping] = mappingId;
+  loc->v[TPP::LocFunction] = functionId;
+  loc->v[TPP::LocLine] = entry.lineNumber;
 }
 
-bool StackWalkerInternal::InitAndLoad(bool showLoadModules) STKWLK_NOEXCEPT
+// ===========================================================================================
+// Folded stacks
+
+typedef struct _TFoldedLine
 {
-  if (m_SymInitialized == true && m_modulesLoaded == true)
-    return true;
+  const char * key;       // "root;...;leaf"
+  ULONGLONG    count;
+} TFoldedLine;
 
-  // Build the sym-path:
-  SW_STR szSymPath = NULL;
-  if (m_SymInitialized == false && (m_options & StackWalkerBase::SymBuildPath) != 0)
+static int __cdecl CompareFoldedLine(const void * a, const void * b)
+{
+  return strcmp(((const TFoldedLine *)a)->key, ((const TFoldedLine *)b)->key);
+}
+
+// read a line without the line break, the buffer is grown as needed
+static bool FoldedReadLine(FILE * f, char *& buf, size_t & cap) STKWLK_NOEXCEPT
+{
+  size_t len = 0;
+  for (;;)
   {
-    const size_t nSymPathLen = 4096;
-    szSymPath = (SW_STR) malloc((nSymPathLen + 8) * sizeof(SW_CHR));
-    if (szSymPath == NULL)
+    if (cap - len < 2)
     {
-      SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-      return false;
+      size_t ncap = cap ? cap * 2 : 4096;
+      char * nbuf = (char *) realloc(buf, ncap);
+      if (nbuf == NULL)
+        return false;
+      buf = nbuf;
+      cap = ncap;
     }
-    szSymPath[0] = 0;
-    // Now first add the (optional) provided sympath:
-    if (this->m_szSymPath != NULL)
+    if (fgets(buf + len, (int)(cap - len), f) == NULL)
+      return len > 0;
+    len += strlen(buf + len);
+    if (len > 0 && buf[len - 1] == '\n')
     {
-      MyStrCat(szSymPath, nSymPathLen, this->m_szSymPath);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
+      buf[--len] = 0;
+      if (len > 0 && buf[len - 1] == '\r')
+        buf[--len] = 0;
+      return true;
     }
+  }
+}
 
-    MyStrCat(szSymPath, nSymPathLen, _T(".;"));
+class StackWalkerFoldedInternal
+{
+public:
+  TStackTable       m_stacks;         // TStackNode::value[0] - count
+  CRITICAL_SECTION  m_critsec;
+  // symbolization of Write
+  TArena            m_names;
+  const DWORD64 *   m_addrs;          // sorted distinct addresses
+  const char **     m_addrNames;      // [m_addrsCount]
+  int               m_addrsCount;
 
-    size_t len;
-    const size_t nTempLen = 1024;
-    SW_CHR       szTemp[nTempLen];
-    // Now add the current directory:
-    len = GetCurrentDirectory(nTempLen, szTemp);
-    if (len > 0 && len < nTempLen-1)
+  StackWalkerFoldedInternal() STKWLK_NOEXCEPT
+  {
+    memset(&m_stacks, 0, sizeof(m_stacks));
+    memset(&m_names, 0, sizeof(m_names));
+    InitializeCriticalSection(&m_critsec);
+    m_addrs = NULL;
+    m_addrNames = NULL;
+    m_addrsCount = 0;
+  }
+
+  ~StackWalkerFoldedInternal() STKWLK_NOEXCEPT
+  {
+    StackTableFree(m_stacks);
+    ArenaFree(m_names);
+    DeleteCriticalSection(&m_critsec);
+  }
+
+  // UTF-8 name of the frame; ';' is the separator of the format
+  const char * NewName(SW_CSTR name) STKWLK_NOEXCEPT
+  {
+    char buf[STACKWALK_MAX_NAMELEN * 3];
+    if (name == NULL || !SwStrToUtf8(name, buf, sizeof(buf)))
+      return NULL;
+    size_t len = strlen(buf);
+    char * res = (char *) ArenaAlloc(m_names, len + 1);
+    if (res == NULL)
+      return NULL;
+    for (size_t i = 0; i <= len; i++)
+      res[i] = (buf[i] == ';') ? ':' : buf[i];
+    return res;
+  }
+
+  const char * AddrName(DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    int i = FindAddr(m_addrs, m_addrsCount, addr);
+    if (m_addrNames[i] == NULL)
     {
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
+      char buf[32];
+      MyStrFmt(buf, _countof(buf), "0x%p", (LPVOID)addr);
+      char * res = (char *) ArenaAlloc(m_names, strlen(buf) + 1);
+      if (res == NULL)
+        return "?";
+      strcpy(res, buf);
+      m_addrNames[i] = res;
     }
+    return m_addrNames[i];
+  }
 
-    // Now add the path for the main-module:
-    len = GetModuleFileName(NULL, szTemp, nTempLen);
-    if (len > 0 && len < nTempLen-1)
+  // build the sorted lines of all stacks, the equal lines are not combined yet
+  TFoldedLine * BuildLines(TArena & arena) STKWLK_NOEXCEPT
+  {
+    TFoldedLine * lines = (TFoldedLine *) malloc((m_stacks.count + 1) * sizeof(TFoldedLine));
+    if (lines == NULL)
+      return NULL;
+    int n = 0;
+    for (TStackNode * node = m_stacks.all; node != NULL; node = node->nextAll)
     {
-      for (SW_STR p = (szTemp + sw_slen(szTemp) - 1); p >= szTemp; --p)
+      size_t len = 0;
+      int i;
+      for (i = 0; i < node->count; i++)
+        len += strlen(AddrName(node->frames[i])) + 1;
+      char * key = (char *) ArenaAlloc(arena, len + 1);
+      if (key == NULL)
       {
-        // locate the rightmost path separator
-        if ((*p == '\\') || (*p == '/') || (*p == ':'))
-        {
-          *p = 0;
-          break;
-        }
-      } // for (search for path separator...)
-      if (sw_slen(szTemp) > 0)
+        free(lines);
+        return NULL;
+      }
+      char * p = key;
+      for (i = node->count - 1; i >= 0; i--)   // the frames are leaf first
       {
-        MyStrCat(szSymPath, nSymPathLen, szTemp);
-        MyStrCat(szSymPath, nSymPathLen, _T(";"));
+        const char * name = AddrName(node->frames[i]);
+        size_t nlen = strlen(name);
+        memcpy(p, name, nlen);
+        p += nlen;
+        *p++ = ';';
       }
+      if (p > key)
+        p--;
+      *p = 0;
+      lines[n].key = key;
+      lines[n].count = node->value[0];
+      n++;
     }
-    len = GetEnvironmentVariable(_T("_NT_SYMBOL_PATH"), szTemp, nTempLen);
-    if (len > 0 && len < nTempLen-1)
-    {
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
-    }
-    len = GetEnvironmentVariable(_T("_NT_ALTERNATE_SYMBOL_PATH"), szTemp, nTempLen);
-    if (len > 0 && len < nTempLen-1)
-    {
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
-    }
-    len = GetEnvironmentVariable(_T("SYSTEMROOT"), szTemp, nTempLen);
-    if (len > 0 && len < nTempLen-1)
-    {
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
-      // also add the "system32"-directory:
-      MyStrCat(szTemp, nTempLen, _T("\\system32"));
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T(";"));
-    }
+    qsort(lines, n, sizeof(TFoldedLine), CompareFoldedLine);
+    lines[n].key = NULL;
+    return lines;
+  }
+};
 
-    if ((this->m_options & StackWalkerBase::SymUseSymSrv) != 0)
+StackWalkerFoldedStacks::StackWalkerFoldedStacks(int options) STKWLK_NOEXCEPT
+  : StackWalkerBase(options, NULL, GetCurrentProcessId(), GetCurrentProcess())
+{
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerFoldedInternal));
+  m_fs = (buf == NULL) ? NULL : new(buf) StackWalkerFoldedInternal();  // placement new
+}
+
+StackWalkerFoldedStacks::~StackWalkerFoldedStacks() STKWLK_NOEXCEPT
+{
+  if (m_fs != NULL)
+  {
+    m_fs->~StackWalkerFoldedInternal();
+    free(m_fs);
+  }
+  m_fs = NULL;
+}
+
+bool StackWalkerFoldedStacks::AddSample(const DWORD64 * frames, int count, ULONGLONG value) STKWLK_NOEXCEPT
+{
+  if (m_fs == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (frames == NULL || count <= 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  ::EnterCriticalSection(&m_fs->m_critsec);
+  TStackNode * node = StackTableIntern(m_fs->m_stacks, frames, count);
+  if (node != NULL)
+    node->value[0] += value;
+  ::LeaveCriticalSection(&m_fs->m_critsec);
+  if (node == NULL)
+    SetLastError(ERROR_OUTOFMEMORY);
+  return node != NULL;
+}
+
+int StackWalkerFoldedStacks::GetStacksCount() STKWLK_NOEXCEPT
+{
+  return (m_fs == NULL) ? 0 : m_fs->m_stacks.count;
+}
+
+void StackWalkerFoldedStacks::Reset() STKWLK_NOEXCEPT
+{
+  if (m_fs == NULL)
+    return;
+  ::EnterCriticalSection(&m_fs->m_critsec);
+  StackTableFree(m_fs->m_stacks);
+  ::LeaveCriticalSection(&m_fs->m_critsec);
+}
+
+bool StackWalkerFoldedStacks::Write(LPCWSTR szFileName) STKWLK_NOEXCEPT
+{
+  bool          result = false;
+  TArena        keys = { 0 };
+  TFoldedLine * lines = NULL;
+  DWORD64 *     addrs = NULL;
+  FILE *        f = NULL;
+  int           total = 0;
+  int           ucount = 0;
+  int           i;
+  TStackNode *  node;
+
+  if (m_fs == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  ::EnterCriticalSection(&m_fs->m_critsec);
+  for (node = m_fs->m_stacks.all; node != NULL; node = node->nextAll)
+    total += node->count;
+  addrs = (DWORD64 *) malloc((total + 1) * sizeof(DWORD64));
+  m_fs->m_addrNames = (const char **) calloc(total + 1, sizeof(const char *));
+  if (addrs == NULL || m_fs->m_addrNames == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    goto fin;
+  }
+  for (node = m_fs->m_stacks.all; node != NULL; node = node->nextAll)
+  {
+    memcpy(addrs + ucount, node->frames, node->count * sizeof(DWORD64));
+    ucount += node->count;
+  }
+  qsort(addrs, ucount, sizeof(DWORD64), CompareAddr);
+  for (i = 0, total = ucount, ucount = 0; i < total; i++)
+    if (ucount == 0 || addrs[ucount - 1] != addrs[i])
+      addrs[ucount++] = addrs[i];
+  m_fs->m_addrs = addrs;
+  m_fs->m_addrsCount = ucount;
+  if (ucount > 0)
+    SymbolizeBatch(addrs, ucount, m_fs);    // names of the addresses (OnCallstackEntry)
+
+  lines = m_fs->BuildLines(keys);
+  if (lines == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    goto fin;
+  }
+  f = _wfopen(szFileName, L"wb");
+  if (f == NULL)
+    goto fin;
+  for (i = 0; lines[i].key != NULL; )
+  {
+    const char * key = lines[i].key;
+    ULONGLONG count = 0;
+    for (; lines[i].key != NULL && strcmp(lines[i].key, key) == 0; i++)
+      count += lines[i].count;    // different addresses of the same functions
+    fprintf(f, "%s %I64u\n", key, count);
+  }
+  result = (ferror(f) == 0);
+  if (fclose(f) != 0)
+    result = false;
+  if (!result)
+    SetLastError(ERROR_WRITE_FAULT);
+
+fin:
+  free(lines);
+  free(addrs);
+  free((LPVOID)m_fs->m_addrNames);
+  m_fs->m_addrs = NULL;
+  m_fs->m_addrNames = NULL;
+  m_fs->m_addrsCount = 0;
+  ArenaFree(m_fs->m_names);
+  ArenaFree(keys);
+  ::LeaveCriticalSection(&m_fs->m_critsec);
+  return result;
+}
+
+void StackWalkerFoldedStacks::OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+{
+  if (m_fs == NULL || GetUserData() != m_fs || entry.type == lastEntry || entry.offset == 0)
+    return;
+  if (m_fs->m_addrsCount <= 0)
+    return;
+  int i = FindAddr(m_fs->m_addrs, m_fs->m_addrsCount, entry.offset);
+  if (m_fs->m_addrs[i] == entry.offset && m_fs->m_addrNames[i] == NULL)
+    m_fs->m_addrNames[i] = m_fs->NewName(entry.undName ? entry.undName : entry.name);
+}
+
+bool StackWalkerFoldedStacks::Merge(const LPCWSTR * inputs, int count, LPCWSTR szOutput) STKWLK_NOEXCEPT
+{
+  typedef struct _TInput
+  {
+    FILE *      f;
+    char *      line;
+    size_t      cap;
+    const char* key;      // NULL - end of file
+    ULONGLONG   count;
+  } TInput;
+
+  bool      result = false;
+  TInput *  in = NULL;
+  FILE *    out = NULL;
+  char *    pend = NULL;      // pending output line (counts of the equal keys are summed)
+  size_t    pendCap = 0;
+  ULONGLONG pendCount = 0;
+  int       i;
+
+  if (inputs == NULL || count <= 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  in = (TInput *) calloc(count, sizeof(TInput));
+  if (in == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  for (i = 0; i < count; i++)
+  {
+    in[i].f = _wfopen(inputs[i], L"rb");
+    if (in[i].f == NULL)
+      goto fin;
+  }
+  out = _wfopen(szOutput, L"wb");
+  if (out == NULL)
+    goto fin;
+
+  for (;;)
+  {
+    int best = -1;
+    for (i = 0; i < count; i++)
     {
-      SW_CSTR drive = _T("c:\\");
-      len = GetEnvironmentVariable(_T("SYSTEMDRIVE"), szTemp, nTempLen);
-      if (len > 0 && len < nTempLen-1)
+      TInput & inp = in[i];
+      while (inp.key == NULL && inp.f != NULL)
       {
-        drive = szTemp;
+        char * sp;
+        if (!FoldedReadLine(inp.f, inp.line, inp.cap))
+        {
+          fclose(inp.f);
+          inp.f = NULL;
+        }
+        else if ((sp = strrchr(inp.line, ' ')) != NULL)
+        {
+          *sp = 0;
+          inp.key = inp.line;
+          inp.count = _strtoui64(sp + 1, NULL, 10);
+        }
       }
-      MyStrCat(szSymPath, nSymPathLen, _T("SRV*"));
-      MyStrCat(szSymPath, nSymPathLen, szTemp);
-      MyStrCat(szSymPath, nSymPathLen, _T("\\websymbols*"));
-      MyStrCat(szSymPath, nSymPathLen, _T("https://msdl.microsoft.com/download/symbols;"));
+      // the inputs are few, a linear search of the smallest key is enough
+      if (inp.key != NULL && (best < 0 || strcmp(inp.key, in[best].key) < 0))
+        best = i;
     }
-  } // if SymBuildPath
-
-  bool bRet = false;
-  if (m_SymInitialized == false)
-  {
-    // First Init the whole stuff...
-    bRet = !!this->Init(szSymPath);
-    if (szSymPath != NULL)
-      free(szSymPath);
-    szSymPath = NULL;
-    if (bRet == false)
+    if (best < 0)
+      break;
+    TInput & inp = in[best];
+    if (pend != NULL && strcmp(pend, inp.key) == 0)
+      pendCount += inp.count;
+    else
     {
-      this->OnDbgHelpErr(_T("Error while initializing dbghelp.dll"));
-      SetLastError(ERROR_DLL_INIT_FAILED);
-      return false;
+      if (pend != NULL)
+        fprintf(out, "%s %I64u\n", pend, pendCount);
+      size_t len = strlen(inp.key) + 1;
+      if (len > pendCap)
+      {
+        char * npend = (char *) realloc(pend, len);
+        if (npend == NULL)
+        {
+          SetLastError(ERROR_OUTOFMEMORY);
+          goto fin;
+        }
+        pend = npend;
+        pendCap = len;
+      }
+      memcpy(pend, inp.key, len);
+      pendCount = inp.count;
     }
+    inp.key = NULL;
   }
-  this->m_showLoadModules = showLoadModules;
-  bRet = this->LoadModules(this->m_hProcess, this->m_dwProcessId);
-  return bRet;
+  if (pend != NULL)
+    fprintf(out, "%s %I64u\n", pend, pendCount);
+  result = (ferror(out) == 0);
+
+fin:
+  for (i = 0; i < count; i++)
+  {
+    if (in[i].f != NULL)
+      fclose(in[i].f);
+    free(in[i].line);
+  }
+  free(in);
+  free(pend);
+  if (out != NULL && fclose(out) != 0)
+    result = false;
+  return result;
 }
 
-bool StackWalkerBase::ShowModules(LPVOID pUserData) STKWLK_NOEXCEPT
+// ===========================================================================================
+// Comparison of folded files
+
+typedef StackWalkerFoldedStacks::TDiff      TDiff;
+typedef StackWalkerFoldedStacks::TDiffItem  TDiffItem;
+
+typedef struct _TDiffFunc
 {
-  if (this->m_sw == NULL)
-  {
-    SetLastError(ERROR_OUTOFMEMORY);
+  struct _TDiffFunc * next;
+  DWORD               hash;
+  ULONGLONG           count[2];     // before, after
+  ULONGLONG           lastLine[2];  // the function is counted once per stack
+  char                name[1];
+} TDiffFunc;
+
+typedef struct _TDiffFuncs
+{
+  enum { Buckets = 4096 };
+  TArena        arena;
+  TDiffFunc **  buckets;
+} TDiffFuncs;
+
+// split "key count" at the last space
+static bool FoldedParseLine(char * line, ULONGLONG & count) STKWLK_NOEXCEPT
+{
+  char * sp = strrchr(line, ' ');
+  if (sp == NULL)
     return false;
+  *sp = 0;
+  count = _strtoui64(sp + 1, NULL, 10);
+  return true;
+}
+
+static bool DiffCountFunc(TDiffFuncs & funcs, const char * name, size_t len, int side, ULONGLONG line, ULONGLONG count) STKWLK_NOEXCEPT
+{
+  DWORD hash = 2166136261U;   // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (BYTE)name[i]) * 16777619U;
+  TDiffFunc ** bucket = &funcs.buckets[hash & (TDiffFuncs::Buckets - 1)];
+  TDiffFunc * fn;
+  for (fn = *bucket; fn != NULL; fn = fn->next)
+    if (fn->hash == hash && strncmp(fn->name, name, len) == 0 && fn->name[len] == 0)
+      break;
+  if (fn == NULL)
+  {
+    fn = (TDiffFunc *) ArenaAlloc(funcs.arena, sizeof(TDiffFunc) + len);
+    if (fn == NULL)
+      return false;
+    memset(fn, 0, sizeof(TDiffFunc));
+    fn->hash = hash;
+    memcpy(fn->name, name, len);
+    fn->name[len] = 0;
+    fn->next = *bucket;
+    *bucket = fn;
+  }
+  if (fn->lastLine[side] != line)
+  {
+    fn->lastLine[side] = line;
+    fn->count[side] += count;
   }
-  this->m_sw->EnterCriticalSection();
-  this->m_sw->m_pUserData = pUserData;
-  this->m_sw->UnloadModules();
-  bool bRet = this->m_sw->InitAndLoad(true);
-  this->m_sw->LeaveCriticalSection();
-  if (bRet == false)
-    SetLastError(ERROR_DLL_INIT_FAILED);
   return true;
 }
 
-bool StackWalkerBase::ShowCallstack(HANDLE          hThread,
-                                    const CONTEXT * context,
-                                    PReadMemRoutine pReadMemFunc,
-                                    LPVOID          pUserData) STKWLK_NOEXCEPT
+// keep the item if it is among the largest changes
+static bool DiffOffer(TDiff & diff, int maxItems, double minZ, const char * key, ULONGLONG before, ULONGLONG after) STKWLK_NOEXCEPT
 {
-  bool          result = false;
-  CONTEXT       c;
-  bool          isCurrentThread = false;
-  bool          isThreadSuspended = false;
-  PNT_TIB       lpTIB = NULL;
-  LPVOID        ArbitraryUserPointer = NULL;
-  TThreadData   tdata = { 0 };
+  double nb = (double)(LONGLONG)diff.totalBefore;
+  double na = (double)(LONGLONG)diff.totalAfter;
+  double pb = (double)(LONGLONG)before / nb;
+  double pa = (double)(LONGLONG)after / na;
+  double p = ((double)(LONGLONG)before + (double)(LONGLONG)after) / (nb + na);
+  double se = sqrt(p * (1 - p) * (1 / nb + 1 / na));
+  double z = (se > 0) ? (pa - pb) / se : 0;
+  double delta = pa - pb;
+  if (fabs(z) < minZ || delta == 0)
+    return true;
+  if (diff.count == maxItems && fabs(diff.items[diff.count - 1].delta) >= fabs(delta))
+    return true;
+  size_t len = strlen(key) + 1;
+  char * copy = (char *) malloc(len);
+  if (copy == NULL)
+    return false;
+  memcpy(copy, key, len);
+  if (diff.count == maxItems)
+    free(diff.items[--diff.count].key);
+  int i = diff.count++;
+  for (; i > 0 && fabs(diff.items[i - 1].delta) < fabs(delta); i--)
+    diff.items[i] = diff.items[i - 1];
+  diff.items[i].key = copy;
+  diff.items[i].before = before;
+  diff.items[i].after = after;
+  diff.items[i].delta = delta;
+  diff.items[i].zScore = z;
+  return true;
+}
 
-  if (this->m_sw == NULL)
+bool StackWalkerFoldedStacks::Compare(LPCWSTR szBefore, LPCWSTR szAfter, DiffMode mode, int maxItems,
+                                      TDiff & diff, double minZScore) STKWLK_NOEXCEPT
+{
+  bool        result = false;
+  FILE *      f[2] = { NULL, NULL };
+  char *      line[2] = { NULL, NULL };
+  size_t      cap[2] = { 0, 0 };
+  bool        has[2];
+  ULONGLONG   cnt[2];
+  TDiffFuncs  funcs;
+  int         side;
+
+  memset(&diff, 0, sizeof(diff));
+  memset(&funcs, 0, sizeof(funcs));
+  if (szBefore == NULL || szAfter == NULL || maxItems <= 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  diff.items = (TDiffItem *) calloc(maxItems, sizeof(TDiffItem));
+  if (diff.items == NULL)
   {
     SetLastError(ERROR_OUTOFMEMORY);
     return false;
   }
+  f[0] = _wfopen(szBefore, L"rb");
+  f[1] = _wfopen(szAfter, L"rb");
+  if (f[0] == NULL || f[1] == NULL)
+    goto fin;
 
-  tdata.qwMagic = qwThreadDataMagic;
-  tdata.swi = m_sw;
-  tdata.pReadMemFunc = pReadMemFunc;
-  tdata.pUserData = pUserData;
-
-  if (hThread == NULL)
-    hThread = STKWLK_CURRENT_THREAD_HANDLE;
-
-  if (hThread == STKWLK_CURRENT_THREAD_HANDLE || GetThreadIdByHandle(hThread) == GetCurrentThreadId())
-    isCurrentThread = true;
-
-  if (context == NULL)
+  if (mode == DiffStacks)
   {
-    if (isCurrentThread == true)
+    // the totals first, then a merge join of the sorted files
+    ULONGLONG * total[2] = { &diff.totalBefore, &diff.totalAfter };
+    for (side = 0; side < 2; side++)
     {
-      memset(&c, 0, sizeof(c));
-      if (m_sw->m_ctx.ContextFlags != 0)
-        c = m_sw->m_ctx;   // context taken at Init
-      else
+      while (FoldedReadLine(f[side], line[side], cap[side]))
+        if (FoldedParseLine(line[side], cnt[side]))
+          *total[side] += cnt[side];
+      fseek(f[side], 0, SEEK_SET);
+    }
+    if (diff.totalBefore == 0 || diff.totalAfter == 0)
+    {
+      SetLastError(ERROR_INVALID_DATA);
+      goto fin;
+    }
+    has[0] = has[1] = false;
+    for (;;)
+    {
+      for (side = 0; side < 2; side++)
+        while (!has[side] && f[side] != NULL)
+        {
+          if (!FoldedReadLine(f[side], line[side], cap[side]))
+          {
+            fclose(f[side]);
+            f[side] = NULL;
+          }
+          else
+            has[side] = FoldedParseLine(line[side], cnt[side]);
+        }
+      if (!has[0] && !has[1])
+        break;
+      int c = !has[0] ? 1 : !has[1] ? -1 : strcmp(line[0], line[1]);
+      const char * key = (c <= 0) ? line[0] : line[1];
+      if (!DiffOffer(diff, maxItems, minZScore, key, (c <= 0) ? cnt[0] : 0, (c >= 0) ? cnt[1] : 0))
       {
-        c.ContextFlags = STKWLK_CONTEXT_FLAGS;
-#if defined(_M_IX86)
-        // The following should be enough for walking the callstack...
-        __asm    call x
-        __asm x: pop eax
-        __asm    mov c.Eip, eax
-        __asm    mov c.Ebp, ebp
-        __asm    mov c.Esp, esp
-#else
-        // The following is defined for x86 (XP and higher), x64 and IA64
-        RtlCaptureContext(&c);
-#endif
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fin;
       }
+      if (c <= 0)
+        has[0] = false;
+      if (c >= 0)
+        has[1] = false;
     }
   }
-
-  this->m_sw->EnterCriticalSection();
-  this->m_sw->m_pUserData = pUserData;
-
-  if (context == NULL)
+  else
   {
-    if (isCurrentThread == false)
+    funcs.buckets = (TDiffFunc **) calloc(TDiffFuncs::Buckets, sizeof(TDiffFunc *));
+    if (funcs.buckets == NULL)
     {
-      DWORD dwCount = SuspendThread(hThread);
-      if (dwCount == (DWORD)-1)
-        goto fin;
-      isThreadSuspended = true;
-      memset(&c, 0, sizeof(CONTEXT));
-      c.ContextFlags = STKWLK_CONTEXT_FLAGS;
-
-      // TODO: Detect if you want to get a thread context of a different process, which is running a different processor architecture...
-      // This does only work if we are x64 and the target process is x64 or x86;
-      // It cannot work, if this process is x64 and the target process is x64... this is not supported...
-      // See also: http://www.howzatt.demon.co.uk/articles/DebuggingInWin64.html
-      if (GetThreadContext(hThread, &c) == FALSE)
-        goto fin;
+      SetLastError(ERROR_OUTOFMEMORY);
+      goto fin;
+    }
+    for (side = 0; side < 2; side++)
+    {
+      ULONGLONG lineNum = 0;
+      ULONGLONG & total = side ? diff.totalAfter : diff.totalBefore;
+      while (FoldedReadLine(f[side], line[side], cap[side]))
+      {
+        if (!FoldedParseLine(line[side], cnt[side]))
+          continue;
+        total += cnt[side];
+        lineNum++;
+        const char * name = line[side];
+        for (;;)
+        {
+          const char * end = strchr(name, ';');
+          bool leaf = (end == NULL);
+          if (leaf)
+            end = name + strlen(name);
+          if ((mode == DiffTotal || leaf) &&
+              !DiffCountFunc(funcs, name, end - name, side, lineNum, cnt[side]))
+          {
+            SetLastError(ERROR_OUTOFMEMORY);
+            goto fin;
+          }
+          if (leaf)
+            break;
+          name = end + 1;
+        }
+      }
+    }
+    if (diff.totalBefore == 0 || diff.totalAfter == 0)
+    {
+      SetLastError(ERROR_INVALID_DATA);
+      goto fin;
     }
+    for (int b = 0; b < TDiffFuncs::Buckets; b++)
+      for (TDiffFunc * fn = funcs.buckets[b]; fn != NULL; fn = fn->next)
+        if (!DiffOffer(diff, maxItems, minZScore, fn->name, fn->count[0], fn->count[1]))
+        {
+          SetLastError(ERROR_OUTOFMEMORY);
+          goto fin;
+        }
   }
+  result = true;
 
-  if (context != NULL)
-    c = *context;
-
-  this->m_sw->UnloadModules();
-  if (this->m_sw->InitAndLoad() == false)
+fin:
+  for (side = 0; side < 2; side++)
   {
-    SetLastError(ERROR_DLL_INIT_FAILED);
-    goto fin;
+    if (f[side] != NULL)
+      fclose(f[side]);
+    free(line[side]);
   }
-
-  lpTIB = GetCurrentTIB();
-  ArbitraryUserPointer = lpTIB->ArbitraryUserPointer;  // save original value
-
-  result = m_sw->ShowCallstack(hThread, c, tdata);
-
-fin:
-  if (lpTIB)
-    lpTIB->ArbitraryUserPointer = ArbitraryUserPointer;   // restore original value
-  if (isThreadSuspended)
-    ResumeThread(hThread);
-  this->m_sw->LeaveCriticalSection();
+  free(funcs.buckets);
+  ArenaFree(funcs.arena);
+  if (!result)
+    FreeDiff(diff);
   return result;
 }
 
-bool StackWalkerInternal::ShowCallstack(HANDLE          hThread,
-                                        const CONTEXT & c,
-                                        TThreadData   & tdata) STKWLK_NOEXCEPT
-{  
-  TCallstackEntry      csEntry;
-  SW_CHR               undName[STACKWALK_MAX_NAMELEN];
-  SW_CHR               undFullName[STACKWALK_MAX_NAMELEN];
-  T_SW_SYM_INFO        symInf;
-  T_IMAGEHLP_MODULE64  Module;
-  T_IMAGEHLP_LINE64    Line;
-  int                  frameNum;
-  bool                 bLastEntryCalled = true;
-  int                  curRecursionCount = 0;
+void StackWalkerFoldedStacks::FreeDiff(TDiff & diff) STKWLK_NOEXCEPT
+{
+  for (int i = 0; diff.items != NULL && i < diff.count; i++)
+    free(diff.items[i].key);
+  free(diff.items);
+  memset(&diff, 0, sizeof(diff));
+}
 
-  PNT_TIB lpTIB = GetCurrentTIB();
+// ===========================================================================================
+// Encoded raw callstacks
+//
+//   BYTE    version (1)
+//   varint  generation of the module map
+//   varint  number of frames
+//   frame:  varint  (offset << 1) | 1, varint zigzag(slot - previous slot)   -- another module
+//           varint  zigzag(offset - previous offset) << 1                      -- same module
+// slot 0 is "no module", its offset is the address.
+
+enum { EncodedVersion = 1 };
+
+static bool GetVarint(const BYTE *& p, const BYTE * end, DWORD64 & v) STKWLK_NOEXCEPT
+{
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7)
+  {
+    BYTE b = *p++;
+    v |= (DWORD64)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
 
-  // init STACKFRAME for first call
-  STACKFRAME64 s; // in/out stackframe
-  memset(&s, 0, sizeof(s));
-  DWORD imageType;
-#ifdef _M_IX86
-  // normally, call ImageNtHeader() and use machine info from PE header
-  imageType = IMAGE_FILE_MACHINE_I386;
-  s.AddrPC.Offset = c.Eip;
-  s.AddrPC.Mode = AddrModeFlat;
-  s.AddrFrame.Offset = c.Ebp;
-  s.AddrFrame.Mode = AddrModeFlat;
-  s.AddrStack.Offset = c.Esp;
-  s.AddrStack.Mode = AddrModeFlat;
-#elif _M_X64
-  imageType = IMAGE_FILE_MACHINE_AMD64;
-  s.AddrPC.Offset = c.Rip;
-  s.AddrPC.Mode = AddrModeFlat;
-  s.AddrFrame.Offset = c.Rsp;
-  s.AddrFrame.Mode = AddrModeFlat;
-  s.AddrStack.Offset = c.Rsp;
-  s.AddrStack.Mode = AddrModeFlat;
-#elif _M_IA64
-  imageType = IMAGE_FILE_MACHINE_IA64;
-  s.AddrPC.Offset = c.StIIP;
-  s.AddrPC.Mode = AddrModeFlat;
-  s.AddrFrame.Offset = c.IntSp;
-  s.AddrFrame.Mode = AddrModeFlat;
-  s.AddrBStore.Offset = c.RsBSP;
-  s.AddrBStore.Mode = AddrModeFlat;
-  s.AddrStack.Offset = c.IntSp;
-  s.AddrStack.Mode = AddrModeFlat;
-#else
-#error "Platform not supported!"
-#endif
+static DWORD64 ZigZag(LONGLONG v) STKWLK_NOEXCEPT
+{
+  return ((DWORD64)v << 1) ^ (DWORD64)(v >> 63);
+}
 
-  for (frameNum = 0;; ++frameNum)
+static LONGLONG UnZigZag(DWORD64 v) STKWLK_NOEXCEPT
+{
+  return (LONGLONG)(v >> 1) ^ -(LONGLONG)(v & 1);
+}
+
+int StackWalkerBase::EncodeRawCallstack(const DWORD64 * frames, int count, LPBYTE buf, int bufSize) STKWLK_NOEXCEPT
+{
+  if (this->m_sw == NULL)
   {
-    LPVOID ArbitraryUserPointer = lpTIB->ArbitraryUserPointer;   // save
-    lpTIB->ArbitraryUserPointer = (LPVOID)&tdata;
-    // get next stack frame (StackWalk64(), SymFunctionTableAccess64(), SymGetModuleBase64())
-    // if this returns ERROR_INVALID_ADDRESS (487) or ERROR_NOACCESS (998), you can
-    // assume that either you are done, or that the stack is so hosed that the next
-    // deeper frame could not be found.
-    // CONTEXT need not to be supplied if imageTyp is IMAGE_FILE_MACHINE_I386!
-    BOOL rc = Sym.StackWalk(imageType, m_hProcess, hThread, &s, (PVOID)&c, MyReadProcMem, 
-                            Sym.FunctionTableAccess, Sym.GetModuleBase, NULL);
-    lpTIB->ArbitraryUserPointer = ArbitraryUserPointer;  // restore
-    if (rc == FALSE)
+    SetLastError(ERROR_OUTOFMEMORY);
+    return 0;
+  }
+  if ((frames == NULL && count > 0) || count < 0 || buf == NULL)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return 0;
+  }
+  if (bufSize < STKWLK_MAX_ENCODED_SIZE(count))
+  {
+    SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return 0;
+  }
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->ModuleMapLoad();
+  LPBYTE p = buf;
+  *p++ = EncodedVersion;
+  p = PutVarint(p, this->m_sw->m_mapGeneration);
+  p = PutVarint(p, (DWORD64)count);
+  int     prevSlot = 0;
+  DWORD64 prevOffset = 0;
+  for (int i = 0; i < count; i++)
+  {
+    int slot = this->m_sw->ModuleMapSlot(frames[i]);
+    DWORD64 offset = slot ? frames[i] - this->m_sw->m_mapBases[slot - 1] : frames[i];
+    if (slot != prevSlot)
     {
-      // INFO: "StackWalk64" does not set "GetLastError"...
-      this->OnDbgHelpErr(_T("StackWalk64"), 0, s.AddrPC.Offset);
-      break;
+      p = PutVarint(p, (offset << 1) | 1);
+      p = PutVarint(p, ZigZag(slot - prevSlot));
     }
+    else
+      p = PutVarint(p, ZigZag((LONGLONG)(offset - prevOffset)) << 1);
+    prevSlot = slot;
+    prevOffset = offset;
+  }
+  this->m_sw->LeaveCriticalSection();
+  return (int)(p - buf);
+}
 
-    memset(&Line, 0, sizeof(Line));
-    Line.SizeOfStruct = sizeof(Line);
+int StackWalkerBase::DecodeRawCallstack(const BYTE * buf, int size, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT
+{
+  const BYTE * p = buf;
+  const BYTE * end = buf + size;
+  DWORD64      generation;
+  DWORD64      count;
+  int          result = -1;
 
-    memset((LPVOID)&csEntry, 0, sizeof(csEntry));
-    csEntry.offset = s.AddrPC.Offset;
-    if (s.AddrPC.Offset == s.AddrReturn.Offset)
+  if (this->m_sw == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return -1;
+  }
+  if (buf == NULL || size < 1 || *p++ != EncodedVersion || !GetVarint(p, end, generation) ||
+      !GetVarint(p, end, count) || (frames == NULL && count > 0))
+  {
+    SetLastError(ERROR_INVALID_DATA);
+    return -1;
+  }
+  if (count > (DWORD64)maxFrames)
+  {
+    SetLastError(ERROR_INSUFFICIENT_BUFFER);
+    return -1;
+  }
+  this->m_sw->EnterCriticalSection();
+  if (generation != this->m_sw->m_mapGeneration)
+  {
+    SetLastError(ERROR_INVALID_DATA);   // the module map was changed
+    goto fin;
+  }
+  {
+    LONGLONG slot = 0;
+    DWORD64  offset = 0;
+    for (int i = 0; i < (int)count; i++)
     {
-      if ((m_MaxRecursionCount > 0) && (curRecursionCount > m_MaxRecursionCount))
+      DWORD64 v, d;
+      if (!GetVarint(p, end, v))
       {
-        this->OnDbgHelpErr(_T("StackWalk64-Endless-Callstack!"), 0, s.AddrPC.Offset);
-        break;
+        SetLastError(ERROR_INVALID_DATA);
+        goto fin;
       }
-      curRecursionCount++;
-    }
-    else
-      curRecursionCount = 0;
-
-    if (s.AddrPC.Offset != 0)
-    {
-      DWORD err_sym = 0;    // SymFromAddr
-      DWORD err_lfa = 0;    // GetLineFromAddr
-      DWORD err_gmi = 0;    // GetModuleInfo
-
-      // we seem to have a valid PC
-      // show procedure info (SymGetSymFromAddr64())
-      SW_CSTR sname = SymFromAddr(m_hProcess, s.AddrPC.Offset, &csEntry.offsetFromSymbol, symInf);
-      if (sname != NULL)
+      if (v & 1)
       {
-        csEntry.name = sname;
-        Sym.UnDecorateName(sname, undName, _countof(undName), UNDNAME_NAME_ONLY);
-        csEntry.undName = undName;
-        Sym.UnDecorateName(sname, undFullName, _countof(undFullName), UNDNAME_COMPLETE);
-        csEntry.undFullName = undFullName;
-      }
-      else
-        err_sym = GetLastError() ? GetLastError() : ERROR_INVALID_STATE;
-
-      // show line number info, NT5.0-method (SymGetLineFromAddr64())
-      if (Sym.GetLineFromAddr != NULL)
-      { // yes, we have SymGetLineFromAddr64()
-        BOOL rc = Sym.GetLineFromAddr(m_hProcess, s.AddrPC.Offset, &csEntry.offsetFromLine, &Line);
-        if (rc != FALSE)
+        if (!GetVarint(p, end, d))
         {
-          csEntry.lineNumber = Line.LineNumber;
-          csEntry.lineFileName = Line.FileName;
+          SetLastError(ERROR_INVALID_DATA);
+          goto fin;
         }
-        else
-          if (GetLastError() != ERROR_INVALID_ADDRESS)
-            err_lfa = GetLastError();
-      } // yes, we have SymGetLineFromAddr64()
-
-      // show module info (SymGetModuleInfo64())
-      if (this->GetModuleInfo(this->m_hProcess, s.AddrPC.Offset, Module) != false)
-      {
-        // got module info OK
-        csEntry.symTypeString = GetSymTypeNameById(Module.SymType);
-        csEntry.moduleName = Module.ModuleName;
-        csEntry.baseOfImage = Module.BaseOfImage;
-        csEntry.loadedImageName = Module.LoadedImageName;
+        offset = v >> 1;
+        slot += UnZigZag(d);
       }
       else
-        err_gmi = GetLastError() ? GetLastError() : ERROR_INVALID_STATE;
-
-      if (err_gmi)
-        this->OnDbgHelpErr(_T("SymGetModuleInfo64"), err_gmi, s.AddrPC.Offset);
-      else if (err_sym)
-        this->OnDbgHelpErr(_T("SymGetSymFromAddr"), err_sym, s.AddrPC.Offset);
-      else if (err_lfa)
-        this->OnDbgHelpErr(_T("SymGetLineFromAddr64"), err_lfa, s.AddrPC.Offset);
-    } // we seem to have a valid PC
-
-    csEntry.type = (frameNum == 0) ? StackWalkerBase::firstEntry : StackWalkerBase::nextEntry;
-    bLastEntryCalled = false;
-    this->m_parent->OnCallstackEntry(csEntry);
-
-    if (s.AddrReturn.Offset == 0)
-    {
-      bLastEntryCalled = true;
-      csEntry.type = StackWalkerBase::lastEntry;
-      this->m_parent->OnCallstackEntry(csEntry);
-      SetLastError(ERROR_SUCCESS);
-      break;
+        offset += (DWORD64)UnZigZag(v >> 1);
+      if (slot < 0 || slot > this->m_sw->m_mapCount)
+      {
+        SetLastError(ERROR_INVALID_DATA);
+        goto fin;
+      }
+      frames[i] = slot ? this->m_sw->m_mapBases[slot - 1] + offset : offset;
     }
-  } // for ( frameNum )
-
-  csEntry.type = StackWalkerBase::lastEntry;
-  if (bLastEntryCalled == false)
-    this->m_parent->OnCallstackEntry(csEntry);
-
-  return true;
-}
-
-bool StackWalkerBase::ShowCallstack(const CONTEXT * context, LPVOID pUserData) STKWLK_NOEXCEPT
-{
-  return ShowCallstack(STKWLK_CURRENT_THREAD_HANDLE, context, NULL, pUserData);
+  }
+  result = (int)count;
+fin:
+  this->m_sw->LeaveCriticalSection();
+  return result;
 }
 
-bool StackWalkerBase::ShowObject(LPVOID pObject, LPVOID pUserData) STKWLK_NOEXCEPT
+int StackWalkerBase::GetModuleMap(DWORD64 * bases, DWORD * sizes, int maxCount, DWORD * pGeneration) STKWLK_NOEXCEPT
 {
-  bool result = false;
-  SW_CSTR sname = NULL;
   if (this->m_sw == NULL)
   {
     SetLastError(ERROR_OUTOFMEMORY);
-    return false;
+    return -1;
   }
-  this->m_sw->EnterCriticalSection();
-  this->m_sw->m_pUserData = pUserData;
-  this->m_sw->UnloadModules();
-  if (this->m_sw->InitAndLoad() == false)
+  if (maxCount < 0 || (maxCount > 0 && (bases == NULL || sizes == NULL)))
   {
-    SetLastError(ERROR_DLL_INIT_FAILED);
-    goto fin;
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return -1;
   }
-  // SymGetSymFromAddr64 or SymFromAddr is required
-  if (m_sw->Sym.GetSymFromAddr == NULL && m_sw->Sym.FromAddr == NULL)
-    goto fin;
-
+  this->m_sw->EnterCriticalSection();
+  this->m_sw->ModuleMapLoad();
+  int count = this->m_sw->m_mapCount;
+  int copied = (count < maxCount) ? count : maxCount;
+  if (copied > 0)
   {
-    // Show object info (SymGetSymFromAddr64())
-    T_SW_SYM_INFO symInf;
-    DWORD64 dwAddress = (DWORD64)pObject;
-    DWORD64 dwDisplacement = 0;
-    sname = m_sw->SymFromAddr(m_sw->m_hProcess, dwAddress, &dwDisplacement, symInf);
-    if (sname == NULL)
-      this->OnDbgHelpErr(TDbgHelpErr(_T("SymGetSymFromAddr"), GetLastError(), dwAddress));
-    else
-      result = true;
+    memcpy(bases, this->m_sw->m_mapBases, copied * sizeof(DWORD64));
+    memcpy(sizes, this->m_sw->m_mapSizes, copied * sizeof(DWORD));
   }
-fin:  
-  // Object name output
-  TShowObject data;
-  data.pObject = pObject;
-  data.szName = sname;
-  this->OnShowObject(data);
+  if (pGeneration != NULL)
+    *pGeneration = this->m_sw->m_mapGeneration;
   this->m_sw->LeaveCriticalSection();
-  return result;
-};
+  return count;
+}
 
-BOOL WINAPI StackWalkerInternal::MyReadProcMem(HANDLE  hProcess,
-                                               DWORD64 qwBaseAddress,
-                                               PVOID   lpBuffer,
-                                               DWORD   nSize,
-                                               LPDWORD lpNumberOfBytesRead) STKWLK_NOEXCEPT
+DWORD StackWalkerBase::GetModuleMapGeneration() STKWLK_NOEXCEPT
 {
-  PNT_TIB lpTIB = GetCurrentTIB();
-  TThreadData * tdata = (TThreadData *)lpTIB->ArbitraryUserPointer;
-  if (tdata == NULL)
-    return FALSE;
-  if (tdata->qwMagic != qwThreadDataMagic)
-    return FALSE;
-  if (tdata->swi == NULL)
-    return FALSE;
+  if (this->m_sw == NULL)
+    return 0;
+  this->m_sw->EnterCriticalSection();
+  DWORD generation = this->m_sw->m_mapGeneration;
+  this->m_sw->LeaveCriticalSection();
+  return generation;
+}
 
-  if (tdata->pReadMemFunc == NULL)
+// ===========================================================================================
+// Call tree. The nodes are kept in a flat array, the children of a node are linked by
+// indexes. The child of a node with an address is found by an open addressing hash table of
+// the node indexes keyed by (parent, address).
+
+class StackWalkerCallTreeInternal
+{
+public:
+  typedef StackWalkerCallTree::TNode  TNode;
+
+  CRITICAL_SECTION  m_critsec;
+  TNode *           m_nodes;
+  int               m_count;
+  int               m_capacity;
+  int *             m_hash;        // node index + 1, 0 - free
+  int               m_hashSize;    // power of 2
+
+  StackWalkerCallTreeInternal() STKWLK_NOEXCEPT
   {
-    SIZE_T st;
-    BOOL   bRet = ReadProcessMemory(hProcess, (LPVOID)qwBaseAddress, lpBuffer, nSize, &st);
-    *lpNumberOfBytesRead = (DWORD)st;
-    //printf("ReadMemory: hProcess: %p, baseAddr: %p, buffer: %p, size: %d, read: %d, result: %d\n", hProcess, (LPVOID) qwBaseAddress, lpBuffer, nSize, (DWORD) st, (DWORD) bRet);
-    return bRet;
+    InitializeCriticalSection(&m_critsec);
+    m_nodes = NULL;
+    m_count = 0;
+    m_capacity = 0;
+    m_hash = NULL;
+    m_hashSize = 0;
   }
 
-  return tdata->pReadMemFunc(hProcess, qwBaseAddress, lpBuffer, nSize, lpNumberOfBytesRead, tdata->pUserData);
-}
+  ~StackWalkerCallTreeInternal() STKWLK_NOEXCEPT
+  {
+    Clear();
+    DeleteCriticalSection(&m_critsec);
+  }
 
-// =====================================================================================
+  void Clear() STKWLK_NOEXCEPT
+  {
+    free(m_nodes);
+    free(m_hash);
+    m_nodes = NULL;
+    m_count = 0;
+    m_capacity = 0;
+    m_hash = NULL;
+    m_hashSize = 0;
+  }
 
-void StackWalkerDemo::OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT
-{
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  SW_CHR ver[80] = { 0 };
-  SW_CHR res[24] = { 0 };
+  static size_t NodeHash(int parent, DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    return (size_t)(((addr ^ ((DWORD64)parent << 40)) * (DWORD64)0x9E3779B97F4A7C15) >> 32);
+  }
 
-  if (data.result != 0)
-    MyStrFmt(res, _countof(res), _T(" [result: %d]"), data.result);
+  bool Grow() STKWLK_NOEXCEPT
+  {
+    if (m_count >= m_capacity)
+    {
+      int cap = m_capacity ? m_capacity * 2 : 1024;
+      TNode * nodes = (TNode *) realloc(m_nodes, cap * sizeof(TNode));
+      if (nodes == NULL)
+        return false;
+      m_nodes = nodes;
+      m_capacity = cap;
+    }
+    if (m_count * 2 >= m_hashSize)
+    {
+      int size = m_hashSize ? m_hashSize * 2 : 2048;
+      int * hash = (int *) malloc(size * sizeof(int));
+      if (hash == NULL)
+        return false;
+      memset(hash, 0, size * sizeof(int));
+      for (int i = 1; i < m_count; i++)    // the root is not in the table
+      {
+        size_t h = NodeHash(m_nodes[i].parent, m_nodes[i].addr) & (size - 1);
+        while (hash[h] != 0)
+          h = (h + 1) & (size - 1);
+        hash[h] = i + 1;
+      }
+      free(m_hash);
+      m_hash = hash;
+      m_hashSize = size;
+    }
+    return true;
+  }
 
-  if (data.ver.isEmpty() == false)
-    MyStrFmt(ver, _countof(ver), _T(" v%d.%d.%d.%d"),
-              data.ver.wMajor, data.ver.wMinor, data.ver.wBuild, data.ver.wRevis);
+  int NewNode(int parent, DWORD64 addr) STKWLK_NOEXCEPT
+  {
+    TNode & node = m_nodes[m_count];
+    node.addr = addr;
+    node.parent = parent;
+    node.firstChild = -1;
+    node.nextSibling = -1;
+    node.depth = (parent < 0) ? 0 : m_nodes[parent].depth + 1;
+    node.self = 0;
+    node.total = 0;
+    if (parent >= 0)
+    {
+      node.nextSibling = m_nodes[parent].firstChild;
+      m_nodes[parent].firstChild = m_count;
+    }
+    return m_count++;
+  }
 
-  SW_CSTR pdbName = NULL;
-  if (sw_scmp(data.symType, _T("PDB")) == 0)
+  // must be called under m_critsec
+  int Child(int parent, DWORD64 addr) STKWLK_NOEXCEPT
   {
-    pdbName = data.pdbName;
-    if (data.pdbName && sw_srchr(data.pdbName, _T('\\')))
-      pdbName = sw_srchr(data.pdbName, _T('\\'));
+    if (!Grow())
+      return -1;
+    size_t h = NodeHash(parent, addr) & (m_hashSize - 1);
+    for (; m_hash[h] != 0; h = (h + 1) & (m_hashSize - 1))
+    {
+      const TNode & node = m_nodes[m_hash[h] - 1];
+      if (node.parent == parent && node.addr == addr)
+        return m_hash[h] - 1;
+    }
+    int idx = NewNode(parent, addr);
+    m_hash[h] = idx + 1;
+    return idx;
   }
-  MyStrFmt(buf, _countof(buf), _T("%p %s  (size: %d)%s%s, SymType: %s, PDB: \"%s\"\n"),
-            (LPVOID)data.baseAddr, data.modName, (int)data.size, ver, res, data.symType, pdbName);
-  OnOutput(buf);
+};
+
+StackWalkerCallTree::StackWalkerCallTree() STKWLK_NOEXCEPT
+{
+  /* MSVC ignore std::nothrow specifier for `new` operator */
+  LPVOID buf = malloc(sizeof(StackWalkerCallTreeInternal));
+  m_ct = (buf == NULL) ? NULL : new(buf) StackWalkerCallTreeInternal();  // placement new
 }
 
-void StackWalkerDemo::OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+StackWalkerCallTree::~StackWalkerCallTree() STKWLK_NOEXCEPT
 {
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  if ((entry.type != lastEntry) && (entry.offset != 0))
+  if (m_ct != NULL)
   {
-    //if (entry.type == firstEntry)
-    //  OnOutput(_T("Callstack:\n"));
+    m_ct->~StackWalkerCallTreeInternal();
+    free(m_ct);
+  }
+  m_ct = NULL;
+}
 
-    TCallstackEntry e = entry;
-    if (entry.name == NULL || entry.name[0] == 0)
-      e.name = _T("(function-name not available)");
-    if (entry.undName && entry.undName[0] != 0)
-      e.name = entry.undName;
-    if (entry.undFullName && entry.undFullName[0] != 0)
-      e.name = entry.undFullName;
-    if (entry.lineFileName == NULL || entry.lineFileName[0] == 0)
+bool StackWalkerCallTree::AddSample(const DWORD64 * frames, int count, ULONGLONG value) STKWLK_NOEXCEPT
+{
+  bool result = true;
+  if (m_ct == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  if (frames == NULL && count > 0)
+  {
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return false;
+  }
+  ::EnterCriticalSection(&m_ct->m_critsec);
+  if (m_ct->m_count == 0)
+  {
+    if (m_ct->Grow())
+      m_ct->NewNode(-1, 0);    // root
+    else
+      result = false;
+  }
+  if (result)
+  {
+    // the path of every node up to the root is counted in `total`, so first find the leaf
+    int node = 0;
+    for (int i = count - 1; i >= 0 && node >= 0; i--)    // the frames are leaf first
+      node = m_ct->Child(node, frames[i]);
+    if (node < 0)
     {
-      e.lineFileName = _T("(filename not available)");
-      if (entry.moduleName == NULL || entry.moduleName[0] == 0)
-        e.moduleName = _T("(module-name not available)");
-      MyStrFmt(buf, _countof(buf), _T("%p (%s): %s: %s\n"),
-                (LPVOID)e.offset, e.moduleName, e.lineFileName, e.name);
+      SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      result = false;
     }
     else
-      MyStrFmt(buf, _countof(buf), _T("%s (%d): %s\n"),
-                e.lineFileName, e.lineNumber, e.name);
-    OnOutput(buf);
+    {
+      m_ct->m_nodes[node].self += value;
+      for (; node >= 0; node = m_ct->m_nodes[node].parent)
+        m_ct->m_nodes[node].total += value;
+    }
   }
+  ::LeaveCriticalSection(&m_ct->m_critsec);
+  return result;
 }
 
-void StackWalkerDemo::OnShowObject(const TShowObject & data) STKWLK_NOEXCEPT
+int StackWalkerCallTree::GetNodesCount() STKWLK_NOEXCEPT
 {
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  MyStrFmt(buf, _countof(buf), _T("Object: Addr: %p, Name: \"%s\"\n"), data.pObject, data.szName);
-  OnOutput(buf);
+  if (m_ct == NULL)
+    return 0;
+  ::EnterCriticalSection(&m_ct->m_critsec);
+  int count = m_ct->m_count;
+  ::LeaveCriticalSection(&m_ct->m_critsec);
+  return count;
 }
 
-void StackWalkerDemo::OnDbgHelpErr(const TDbgHelpErr & data) STKWLK_NOEXCEPT
+bool StackWalkerCallTree::Snapshot(TCallTree & tree, bool reset) STKWLK_NOEXCEPT
 {
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  MyStrFmt(buf, _countof(buf), _T("ERROR: %s, GetLastError: %d (Address: %p)\n"),
-            data.szFuncName, data.gle, (LPVOID)data.addr);
-  OnOutput(buf);
+  memset(&tree, 0, sizeof(tree));
+  if (m_ct == NULL)
+  {
+    SetLastError(ERROR_OUTOFMEMORY);
+    return false;
+  }
+  bool result = true;
+  ::EnterCriticalSection(&m_ct->m_critsec);
+  if (reset)
+  {
+    // hand over the nodes, the producers continue with an empty tree
+    tree.nodes = m_ct->m_nodes;
+    tree.count = m_ct->m_count;
+    m_ct->m_nodes = NULL;
+    m_ct->Clear();
+  }
+  else if (m_ct->m_count > 0)
+  {
+    tree.nodes = (TNode *) malloc(m_ct->m_count * sizeof(TNode));
+    if (tree.nodes != NULL)
+    {
+      memcpy(tree.nodes, m_ct->m_nodes, m_ct->m_count * sizeof(TNode));
+      tree.count = m_ct->m_count;
+    }
+    else
+    {
+      SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+      result = false;
+    }
+  }
+  ::LeaveCriticalSection(&m_ct->m_critsec);
+  return result;
 }
 
-void StackWalkerDemo::OnLoadDbgHelp(const TLoadDbgHelp & a) STKWLK_NOEXCEPT
+void StackWalkerCallTree::FreeSnapshot(TCallTree & tree) STKWLK_NOEXCEPT
 {
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  MyStrFmt(buf, _countof(buf), _T("LoadDbgHelp: FileVer: %d.%d.%d.%d, Path: \"%s\"\n"),
-            a.ver.wMajor, a.ver.wMinor, a.ver.wBuild, a.ver.wRevis, a.szDllPath);
-  OnOutput(buf);
+  free(tree.nodes);
+  memset(&tree, 0, sizeof(tree));
 }
 
-void StackWalkerDemo::OnSymInit(const TSymInit & data) STKWLK_NOEXCEPT
+int StackWalkerCallTree::GetNodeFrames(const TCallTree & tree, int node, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT
 {
-  SW_CHR buf[STACKWALK_MAX_NAMELEN];
-  MyStrFmt(buf, _countof(buf), _T("SymInit: symOptions: 0x%08X, UserName: \"%s\"\n"),
-            data.dwSymOptions, data.szUserName);
-  OnOutput(buf);
-
-  MyStrFmt(buf, _countof(buf), _T("Symbol-SearchPath: \"%s\"\n"), data.szSearchPath);
-  OnOutput(buf);
-
-  // Also display the OS-version
-  T_OSVERSIONINFOEX ver = { 0 };
-  ver.dwOSVersionInfoSize = sizeof(ver);
-#pragma warning(push)
-#pragma warning(disable : 4996)  // For fix warning "GetVersionExW was declared deprecated"
-  if (GetVersionEx((T_OSVERSIONINFO*)&ver) != FALSE)
-  {
-    MyStrFmt(buf, _countof(buf), _T("OS-Version: %d.%d.%d (%s) 0x%04x-%d\n"),
-              ver.dwMajorVersion, ver.dwMinorVersion, ver.dwBuildNumber, ver.szCSDVersion,
-              ver.wSuiteMask, ver.wProductType);
-    OnOutput(buf);
-  }
-#pragma warning(pop)
+  int count = 0;
+  if (frames == NULL || node < 0 || node >= tree.count)
+    return 0;
+  for (; node > 0 && count < maxFrames; node = tree.nodes[node].parent)
+    frames[count++] = tree.nodes[node].addr;
+  return count;
 }
 
-void StackWalkerDemo::OnOutput(SW_CSTR buffer) STKWLK_NOEXCEPT
+void StackWalkerCallTree::Reset() STKWLK_NOEXCEPT
 {
-  OutputDebugString(buffer);
+  if (m_ct == NULL)
+    return;
+  ::EnterCriticalSection(&m_ct->m_critsec);
+  m_ct->Clear();
+  ::LeaveCriticalSection(&m_ct->m_critsec);
 }
@@ -82,7 +82,28 @@ typedef   LPCSTR   SW_CSTR;
 #endif
 
 
+// max number of frames in a raw callstack (RtlCaptureStackBackTrace limit on WinXP)
+#ifndef STKWLK_MAX_RAW_FRAMES
+#define STKWLK_MAX_RAW_FRAMES  62
+#endif
+
+// max size of an encoded raw callstack (EncodeRawCallstack)
+#define STKWLK_MAX_ENCODED_SIZE(frames)  (12 + (frames) * 15)
+
+// max number of idle symbol engines kept for reuse (option ShareEngine)
+#ifndef STKWLK_MAX_SHARED_ENGINES
+#define STKWLK_MAX_SHARED_ENGINES  4
+#endif
+
 class StackWalkerInternal; // forward
+class StackWalkerTrackerInternal; // forward
+class StackWalkerContentionInternal; // forward
+class StackWalkerWatchdogInternal; // forward
+class StackWalkerTraceInternal; // forward
+class StackWalkerSamplerInternal; // forward
+class StackWalkerPprofInternal; // forward
+class StackWalkerFoldedInternal; // forward
+class StackWalkerCallTreeInternal; // forward
 
 class StackWalkerBase
 {
@@ -120,6 +141,25 @@ public:
     // DbgHelp.DLL will be loaded once in a separate place in the process memory
     SymIsolated = 0x40,
 
+    // Collect counters and timers of the internal phases (see GetStats)
+    CollectStats = 0x80,
+
+    // On destruction the initialized symbol engine (dbghelp and the loaded modules) is kept in
+    // a process-wide pool and reused by the next walker with the same options, target process
+    // and symbol path, so a short-lived walker does not initialize dbghelp again. Requires
+    // SymIsolated; an engine changed by SetSymPath, SetDbgHelpPath or SetTargetProcess is not kept
+    ShareEngine = 0x100,
+
+    // OnLoadModule and OnUnloadModule are called for the modules loaded or unloaded since the
+    // previous walk. In the current process the modules are enumerated again only after a DLL
+    // was loaded or unloaded (loader notifications, Vista+)
+    NotifyModules = 0x200,
+
+    // With RetrieveFileVersion the versions of many modules are read by several threads. Not for
+    // walkers used under the loader lock (DllMain, TLS callbacks); ignored by the exception walkers.
+    // The modules are still loaded one by one: dbghelp is single-threaded
+    PrefetchVersions = 0x400,
+
   } StackWalkOptions;
 
   // Contains all the "Retrieve"-options
@@ -159,10 +199,60 @@ public:
 
   bool SetTargetProcess(DWORD dwProcessId, HANDLE hProcess) STKWLK_NOEXCEPT;
 
+  // Keep resolved frames (symbol, line and module info) in memory, so repeated
+  // addresses are not looked up in dbghelp again. 0 disables the cache (default).
+  void SetSymCacheSize(size_t maxBytes) STKWLK_NOEXCEPT;
+
+  enum FrameFilter
+  {
+    FrameDrop = 0,      // drop the frames of the module
+    FrameAllow,         // if a module is allowed, the frames of the not listed modules are dropped
+    FrameCollapse,      // consecutive frames of the module are shown once (the top one)
+  };
+
+  // Frame filters are applied before any symbol lookup of ShowCallstack and ShowRawCallstack
+  // (also of the snapshots and the async callstacks), so the dropped frames cost no symbol
+  // lookups. szModule is the module name or the image file name (case insensitive).
+  bool AddModuleFilter(SW_CSTR szModule, FrameFilter filter) STKWLK_NOEXCEPT;
+
+  // Drop the frames in [startAddr, endAddr)
+  bool AddRangeFilter(DWORD64 startAddr, DWORD64 endAddr) STKWLK_NOEXCEPT;
+
+  // Drop the top `count` frames of every callstack
+  void SetSkipFrames(int count) STKWLK_NOEXCEPT;
+
+  void ClearFrameFilters() STKWLK_NOEXCEPT;
+
   PCONTEXT GetCurrentExceptionContext() STKWLK_NOEXCEPT;
 
   LPVOID GetUserData() STKWLK_NOEXCEPT;
 
+  enum StatsPhase
+  {
+    StatLoadModules = 0,     // enumeration and loading of the modules
+    StatSymLoadModule,       // SymLoadModule64 / SymLoadModuleEx
+    StatStackWalk,           // StackWalk64
+    StatSymFromAddr,         // SymFromAddr and UnDecorateSymbolName
+    StatGetLineFromAddr,     // SymGetLineFromAddr64
+    StatGetModuleInfo,       // SymGetModuleInfo64
+    StatOutput,              // OnCallstackEntry
+    StatPhasesCount
+  };
+
+  struct TStats
+  {
+    ULONGLONG count[StatPhasesCount];    // number of calls
+    ULONGLONG timeNs[StatPhasesCount];   // cumulative time in nanoseconds
+  };
+
+  // Statistics are collected only with option `CollectStats`
+  bool GetStats(TStats & stats) STKWLK_NOEXCEPT;
+
+  void ResetStats() STKWLK_NOEXCEPT;
+
+  // Destroy the idle symbol engines of the pool (option ShareEngine). Done also at exit.
+  static void ReleaseSharedEngines() STKWLK_NOEXCEPT;
+
 private:
   bool Init(ExceptType extype, int options, SW_CSTR szSymPath, DWORD dwProcessId,
             HANDLE hProcess, PEXCEPTION_POINTERS exp = NULL) STKWLK_NOEXCEPT;
@@ -188,6 +278,103 @@ public:
 
   bool ShowObject(LPVOID pObject, LPVOID pUserData = NULL) STKWLK_NOEXCEPT;
 
+  struct TSnapshotModule
+  {
+    DWORD64  baseAddr;
+    DWORD    size;
+    SW_STR   imgName;
+    SW_STR   modName;
+  };
+
+  struct TSnapshot            // Saved state of a thread for unwinding it later
+  {
+    CONTEXT           context;
+    DWORD64           stackAddr;     // address of the first saved byte (stack pointer)
+    DWORD             stackSize;
+    LPBYTE            stackData;
+    int               modulesCount;
+    TSnapshotModule * modules;       // NULL - modules of the target process are used
+  };
+
+  // Capture the context and the top dwMaxStackSize bytes of the thread stack. This is cheap, the
+  // unwinding and symbolization can be done later by ShowCallstack(snap), e.g. in another thread.
+  // The module map is required for unwinding outside of the target process (withModules = true).
+  bool CaptureSnapshot(TSnapshot &     snap,
+                       HANDLE          hThread = GetCurrentThread(),
+                       const CONTEXT * context = NULL,
+                       DWORD           dwMaxStackSize = 16 * 1024,
+                       bool            withModules = false) STKWLK_NOEXCEPT;
+
+  static void FreeSnapshot(TSnapshot & snap) STKWLK_NOEXCEPT;
+
+  bool ShowCallstack(const TSnapshot & snap, LPVOID pUserData = NULL) STKWLK_NOEXCEPT;
+
+  // Unwind the snapshot without symbol lookups. Returns the number of frames.
+  int GetSnapshotFrames(const TSnapshot & snap, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT;
+
+  // Fast capture of the return addresses of the current thread (without any symbol lookups).
+  // Returns the number of captured frames.
+  static int CaptureRawCallstack(DWORD64 * frames, int maxFrames, int framesToSkip = 0) STKWLK_NOEXCEPT;
+
+  // Symbolize the raw addresses and pass them to OnCallstackEntry
+  bool ShowRawCallstack(const DWORD64 * frames, int count, LPVOID pUserData = NULL) STKWLK_NOEXCEPT;
+
+  // Save the raw callstack of every thrown C++ exception in a slot of the throwing thread (vectored
+  // exception handler). A catch block gets it with GetThrowCallstack and symbolizes it later, e.g.
+  // by ShowRawCallstack. The slot is freed when its thread exits; disabling only removes the handler.
+  static bool EnableThrowCapture(bool enable = true) STKWLK_NOEXCEPT;
+
+  // Callstack of the last exception thrown by the current thread (a rethrow keeps the original
+  // throw site). pException - the thrown object (e.g. &e when caught by reference) or NULL.
+  // Returns the number of frames (0 - no capture or the last throw was another object).
+  static int GetThrowCallstack(DWORD64 * frames, int maxFrames, const void * pException = NULL) STKWLK_NOEXCEPT;
+
+  // Compact binary form of a raw callstack (about 3 bytes per frame): the module index and the
+  // offset of every frame as varints, delta coded against the previous frame. The indexes refer
+  // to the module map of the walker, its generation is stored in the header (any walker with the
+  // same module map can decode it). Returns the size of the data (0 - the buffer is too small,
+  // see STKWLK_MAX_ENCODED_SIZE).
+  int EncodeRawCallstack(const DWORD64 * frames, int count, LPBYTE buf, int bufSize) STKWLK_NOEXCEPT;
+
+  // Returns the number of frames or -1 (invalid data or another generation of the module map)
+  int DecodeRawCallstack(const BYTE * buf, int size, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT;
+
+  // Hash of the module map, changed whenever a reload of the modules finds another set of modules
+  DWORD GetModuleMapGeneration() STKWLK_NOEXCEPT;
+
+  // Export the module map of the encoded callstacks (the modules sorted by the base address, the
+  // index in the encoded data is the position + 1). Copies up to maxCount modules and returns the
+  // number of modules in the map (-1 - error).
+  int GetModuleMap(DWORD64 * bases, DWORD * sizes, int maxCount, DWORD * pGeneration = NULL) STKWLK_NOEXCEPT;
+
+  // Symbolize a large set of addresses (e.g. samples of a profiler). Every distinct address
+  // is resolved only once; OnCallstackEntry is called for each address in the original order.
+  bool SymbolizeBatch(const DWORD64 * addrs, int count, LPVOID pUserData = NULL) STKWLK_NOEXCEPT;
+
+  // Asynchronous symbolization: ShowCallstackAsync only captures the raw callstack of the current
+  // thread and puts it into a bounded queue. The worker threads symbolize it and call
+  // OnCallstackEntry (from the worker thread). If the queue is full, the callstack is dropped and
+  // counted, the caller is never blocked. Note: calls into dbghelp are serialized, so more than
+  // one worker is useful only when the callbacks are slow.
+  // The workers call the virtual methods, so a derived class that starts them must call StopAsync
+  // in its own destructor (~StackWalkerBase asserts that they are stopped).
+  bool StartAsync(int workers = 1, int queueSize = 256) STKWLK_NOEXCEPT;
+
+  void StopAsync(bool drain = true) STKWLK_NOEXCEPT;   // drain: symbolize the queued callstacks
+
+  bool ShowCallstackAsync(LPVOID pUserData = NULL, int framesToSkip = 0) STKWLK_NOEXCEPT;
+
+  // Wait until all queued callstacks are symbolized
+  bool FlushAsync(DWORD dwTimeout = INFINITE) STKWLK_NOEXCEPT;
+
+  LONG GetAsyncDropCount() STKWLK_NOEXCEPT;
+
+  // Write a minidump (module list, context and stack of every thread) of the target process.
+  // dwMaxStackSize limits the saved part of each stack, counted from the stack pointer (0 - no limit).
+  bool WriteMiniDump(LPCWSTR             szDumpFile,
+                     PEXCEPTION_POINTERS exp = NULL,
+                     DWORD               dwMaxStackSize = 0) STKWLK_NOEXCEPT;
+
   struct TFileVer
   {
     WORD  wMajor;
@@ -227,6 +414,16 @@ public:
   };
   virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT = 0;
 
+  struct TUnloadModule
+  {
+    SW_CSTR  imgName;
+    SW_CSTR  modName;
+    DWORD64  baseAddr;
+    DWORD    size;
+  };
+  // The cached symbols of the module are already removed
+  virtual void OnUnloadModule(const TUnloadModule & data) STKWLK_NOEXCEPT { }
+
   enum CallstackEntryType
   {
     firstEntry,
@@ -300,6 +497,8 @@ public:
 
   virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT;
 
+  virtual void OnUnloadModule(const TUnloadModule & data) STKWLK_NOEXCEPT;
+
   virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT;
 
   virtual void OnShowObject(const TShowObject & data) STKWLK_NOEXCEPT;
@@ -311,6 +510,439 @@ public:
 }; // class StackWalkerDemo
 
 
+// Allocation profiler. Call OnAlloc / OnFree from your allocation hooks (e.g. from the
+// replaced operator new / delete). On average one allocation per `sampleInterval` bytes is
+// sampled: its raw callstack is captured and the estimated allocated and live bytes are
+// aggregated per callstack. The tracker never uses the CRT heap, so it does not recurse
+// into the hooked allocator. Symbol lookups are done only by Dump.
+class StackWalkerAllocTracker
+{
+public:
+  StackWalkerAllocTracker(size_t sampleInterval = 512 * 1024) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerAllocTracker(const StackWalkerAllocTracker & ) STKWLK_DELETED;
+  const StackWalkerAllocTracker & operator = ( const StackWalkerAllocTracker & ) STKWLK_DELETED;
+
+  ~StackWalkerAllocTracker() STKWLK_NOEXCEPT;
+
+  void OnAlloc(LPVOID ptr, size_t size) STKWLK_NOEXCEPT;
+
+  void OnFree(LPVOID ptr) STKWLK_NOEXCEPT;
+
+  struct TAllocSite
+  {
+    int             id;           // id of the interned callstack
+    int             framesCount;
+    const DWORD64 * frames;
+    ULONGLONG       allocCount;   // estimated number of allocations
+    ULONGLONG       allocBytes;   // estimated allocated bytes
+    ULONGLONG       liveCount;    // estimated number of not freed allocations
+    ULONGLONG       liveBytes;    // estimated not freed bytes
+  };
+
+  // Symbolize the callstack of every allocation site with the walker. OnCallstackEntry
+  // gets the `const TAllocSite *` as user data (see StackWalkerBase::GetUserData).
+  bool Dump(StackWalkerBase & sw, bool liveOnly = true) STKWLK_NOEXCEPT;
+
+  void Reset() STKWLK_NOEXCEPT;
+
+private:
+  StackWalkerTrackerInternal * m_at;
+}; // class StackWalkerAllocTracker
+
+
+// Lock-contention profiler. A TLock of the profiler is a critical section which records the
+// raw callstack of a waiter that waited longer than the threshold, together with the sampled
+// callstack of the previous holder, and aggregates the wait time per pair of callstacks.
+// The uncontended path costs only TryEnterCriticalSection (and a sampled holder capture).
+// TLock has lock / try_lock / unlock, so it can be used with std::lock_guard.
+class StackWalkerLockProfiler
+{
+public:
+  class TLock
+  {
+  public:
+    TLock(StackWalkerLockProfiler & profiler) STKWLK_NOEXCEPT;
+    ~TLock() STKWLK_NOEXCEPT;
+
+    void lock() STKWLK_NOEXCEPT;
+    bool try_lock() STKWLK_NOEXCEPT;
+    void unlock() STKWLK_NOEXCEPT;
+
+  private:
+    TLock(const TLock & ) STKWLK_DELETED;
+    const TLock & operator = ( const TLock & ) STKWLK_DELETED;
+
+    bool OnAcquired() STKWLK_NOEXCEPT;
+
+    CRITICAL_SECTION          m_cs;
+    StackWalkerLockProfiler * m_profiler;
+    int                       m_recursion;
+    ULONG                     m_acquired;      // number of acquisitions (for sampling)
+    int                       m_holderCount;   // 0 - the holder was not sampled
+    DWORD64                   m_holderFrames[STKWLK_MAX_RAW_FRAMES];
+
+    friend class StackWalkerLockProfiler;
+  };
+
+  // thresholdUs - minimal wait time to be recorded (in microseconds)
+  // holderSampleRate - capture the callstack of every N-th holder (0 - never)
+  StackWalkerLockProfiler(DWORD thresholdUs = 1000, ULONG holderSampleRate = 100) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerLockProfiler(const StackWalkerLockProfiler & ) STKWLK_DELETED;
+  const StackWalkerLockProfiler & operator = ( const StackWalkerLockProfiler & ) STKWLK_DELETED;
+
+  ~StackWalkerLockProfiler() STKWLK_NOEXCEPT;
+
+  struct TContentionSite
+  {
+    int             id;
+    int             waiterCount;
+    const DWORD64 * waiterFrames;
+    int             holderCount;    // 0 - the holder was not sampled
+    const DWORD64 * holderFrames;
+    ULONGLONG       count;          // number of waits longer than the threshold
+    ULONGLONG       waitNs;         // total wait time in nanoseconds
+    bool            isHolder;       // which callstack is symbolized now (see Dump)
+  };
+
+  // Symbolize the waiter's and then the holder's callstack of every contention site.
+  // OnCallstackEntry gets the `const TContentionSite *` as user data.
+  bool Dump(StackWalkerBase & sw) STKWLK_NOEXCEPT;
+
+  void Reset() STKWLK_NOEXCEPT;
+
+private:
+  void OnContention(const TLock & lock, LONGLONG waitTicks, const DWORD64 * frames, int count) STKWLK_NOEXCEPT;
+
+  StackWalkerContentionInternal * m_lp;
+  LONGLONG                        m_thresholdTicks;
+  ULONG                           m_holderSampleRate;
+
+  friend class TLock;
+}; // class StackWalkerLockProfiler
+
+
+// Hang detector. Registered threads call Heartbeat (a single store) while they make progress.
+// The watchdog thread checks them every `periodMs`. A thread without a heartbeat for
+// `deadlineMs` is captured (snapshot of its stack, unwound without symbol lookups) and its
+// callstack is interned. The same stuck callstack is reported at most once per `repeatMs`:
+// the callstack is symbolized with the walker and OnCallstackEntry gets `const THangInfo *`
+// as user data.
+class StackWalkerWatchdog
+{
+public:
+  enum { MaxThreads = 256 };
+
+  StackWalkerWatchdog(StackWalkerBase & sw, DWORD deadlineMs = 5000, DWORD repeatMs = 60000) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerWatchdog(const StackWalkerWatchdog & ) STKWLK_DELETED;
+  const StackWalkerWatchdog & operator = ( const StackWalkerWatchdog & ) STKWLK_DELETED;
+
+  ~StackWalkerWatchdog() STKWLK_NOEXCEPT;
+
+  bool Start(DWORD periodMs = 1000) STKWLK_NOEXCEPT;
+
+  void Stop() STKWLK_NOEXCEPT;
+
+  // Register the current thread. Returns the slot for Heartbeat or -1.
+  int RegisterThread() STKWLK_NOEXCEPT;
+
+  void UnregisterThread(int slot) STKWLK_NOEXCEPT;
+
+  // Only the registered thread writes its counter, so no interlocked operation is needed.
+  // An invalid slot (-1 of a failed RegisterThread) is ignored.
+  void Heartbeat(int slot) STKWLK_NOEXCEPT
+  {
+    if (m_beats != NULL && (unsigned)slot < MaxThreads)
+      m_beats[slot] = m_beats[slot] + 1;
+  }
+
+  struct THangInfo
+  {
+    int        slot;
+    DWORD      threadId;
+    DWORD      stuckMs;       // time since the last heartbeat
+    int        stackId;       // id of the interned callstack
+    ULONGLONG  hits;          // how many times this callstack was found stuck
+  };
+
+  // Check the registered threads now (done periodically by the watchdog thread).
+  // Returns the number of reported threads.
+  int Check() STKWLK_NOEXCEPT;
+
+private:
+  StackWalkerWatchdogInternal * m_wd;
+  volatile LONG *               m_beats;
+
+  friend class StackWalkerWatchdogInternal;
+}; // class StackWalkerWatchdog
+
+
+// Raw callstacks for high-rate tracing. Record captures the callstack of the current thread into
+// a ring of the thread (allocated on its first Record), without locks or interlocked operations:
+// each ring has one producer (its thread) and one consumer (Drain). A record is dropped and
+// counted if the ring of the thread is full. Drain frees the ring of an exited thread once all
+// its records are drained.
+class StackWalkerTraceBuffer
+{
+public:
+  // ringSize - records per thread (rounded up to a power of 2)
+  // maxFrames - frames per record (at most STKWLK_MAX_RAW_FRAMES)
+  StackWalkerTraceBuffer(int ringSize = 1024, int maxFrames = 32) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerTraceBuffer(const StackWalkerTraceBuffer & ) STKWLK_DELETED;
+  const StackWalkerTraceBuffer & operator = ( const StackWalkerTraceBuffer & ) STKWLK_DELETED;
+
+  ~StackWalkerTraceBuffer() STKWLK_NOEXCEPT;
+
+  // can be called from any thread; returns false if the record was dropped
+  bool Record(ULONG_PTR event = 0, int framesToSkip = 0) STKWLK_NOEXCEPT;
+
+  struct TTraceRecord
+  {
+    DWORD           threadId;
+    LONGLONG        time;          // QueryPerformanceCounter
+    ULONG_PTR       event;         // passed to Record
+    int             framesCount;
+    const DWORD64 * frames;        // valid only in the drain routine
+  };
+
+  typedef void (* PDrainRoutine)(const TTraceRecord & rec, LPVOID pUserData);
+
+  // Pass the published records of all threads to the routine (e.g. to aggregate them with
+  // StackWalkerFoldedStacks::AddSample) and free their slots. maxRecords = 0 - no limit.
+  // Returns the number of drained records.
+  int Drain(PDrainRoutine pDrainFunc, LPVOID pUserData = NULL, int maxRecords = 0) STKWLK_NOEXCEPT;
+
+  ULONGLONG GetDroppedCount() STKWLK_NOEXCEPT;
+
+private:
+  StackWalkerTraceInternal * m_tb;
+}; // class StackWalkerTraceBuffer
+
+
+// Sampling profiler of the current process. Every `periodMs` the sampler thread suspends each
+// other thread only to copy its context and the top of its stack, the copy is unwound by the
+// walker (no symbol lookups) after the thread is resumed. The callstacks are interned and
+// counted; Dump symbolizes them with the walker and OnCallstackEntry gets `const TSampleSite *`
+// as user data. Without the ToolHelp thread enumeration Start and Sample fail with
+// ERROR_NOT_SUPPORTED.
+class StackWalkerSampler
+{
+public:
+  StackWalkerSampler(StackWalkerBase & sw) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerSampler(const StackWalkerSampler & ) STKWLK_DELETED;
+  const StackWalkerSampler & operator = ( const StackWalkerSampler & ) STKWLK_DELETED;
+
+  ~StackWalkerSampler() STKWLK_NOEXCEPT;
+
+  bool Start(DWORD periodMs = 10) STKWLK_NOEXCEPT;
+
+  void Stop() STKWLK_NOEXCEPT;
+
+  // Sample all the other threads now (done periodically by the sampler thread).
+  // Returns the number of sampled threads.
+  int Sample() STKWLK_NOEXCEPT;
+
+  ULONGLONG GetSamplesCount() STKWLK_NOEXCEPT;
+
+  struct TSampleSite
+  {
+    int             id;           // id of the interned callstack
+    int             framesCount;
+    const DWORD64 * frames;
+    ULONGLONG       hits;         // number of samples with this callstack
+  };
+
+  bool Dump() STKWLK_NOEXCEPT;
+
+  void Reset() STKWLK_NOEXCEPT;
+
+private:
+  StackWalkerSamplerInternal * m_sp;
+
+  friend class StackWalkerSamplerInternal;
+}; // class StackWalkerSampler
+
+
+// Writer of raw callstacks in the pprof format (profile.proto, uncompressed, `pprof` reads it
+// as is). The samples are streamed to the file, only the deduplicated tables of the locations,
+// functions, mappings and strings are kept in memory; they are written by Close. Every address
+// is symbolized once, the mappings are taken from the module list.
+class StackWalkerPprofWriter : public StackWalkerBase
+{
+public:
+  enum { MaxFrames = 256 };   // longer samples are truncated
+
+  StackWalkerPprofWriter(int options = OptionsAll) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerPprofWriter(const StackWalkerPprofWriter & ) STKWLK_DELETED;
+  const StackWalkerPprofWriter & operator = ( const StackWalkerPprofWriter & ) STKWLK_DELETED;
+
+  virtual ~StackWalkerPprofWriter() STKWLK_NOEXCEPT;
+
+  // Create the output file. The type and unit of the sample value are UTF-8 strings,
+  // e.g. "samples"/"count", "alloc_space"/"bytes", "contentions"/"count".
+  bool Open(LPCWSTR szFileName, const char * sampleType = "samples", const char * sampleUnit = "count") STKWLK_NOEXCEPT;
+
+  bool AddSample(const DWORD64 * frames, int count, LONGLONG value = 1) STKWLK_NOEXCEPT;
+
+  // Write the tables and close the file
+  bool Close() STKWLK_NOEXCEPT;
+
+  virtual void OnLoadDbgHelp(const TLoadDbgHelp & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnSymInit(const TSymInit & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT;
+
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT;
+
+  virtual void OnShowObject(const TShowObject & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnDbgHelpErr(const TDbgHelpErr & data) STKWLK_NOEXCEPT { }
+
+private:
+  StackWalkerPprofInternal * m_pp;
+}; // class StackWalkerPprofWriter
+
+
+// Aggregator of raw callstacks in the folded (collapsed) format of flame graphs. The samples
+// are counted per interned callstack; Write symbolizes every distinct address once and writes
+// "root;...;leaf count" lines sorted by the stack. Sorted files can be combined by Merge, which
+// reads the inputs line by line (k-way merge), so any number of dumps can be merged.
+class StackWalkerFoldedStacks : public StackWalkerBase
+{
+public:
+  StackWalkerFoldedStacks(int options = OptionsAll) STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerFoldedStacks(const StackWalkerFoldedStacks & ) STKWLK_DELETED;
+  const StackWalkerFoldedStacks & operator = ( const StackWalkerFoldedStacks & ) STKWLK_DELETED;
+
+  virtual ~StackWalkerFoldedStacks() STKWLK_NOEXCEPT;
+
+  // can be called from any thread
+  bool AddSample(const DWORD64 * frames, int count, ULONGLONG value = 1) STKWLK_NOEXCEPT;
+
+  int GetStacksCount() STKWLK_NOEXCEPT;
+
+  bool Write(LPCWSTR szFileName) STKWLK_NOEXCEPT;
+
+  void Reset() STKWLK_NOEXCEPT;
+
+  // Combine the sorted folded files (of Write or Merge) into one; the counts of equal stacks are summed.
+  static bool Merge(const LPCWSTR * inputs, int count, LPCWSTR szOutput) STKWLK_NOEXCEPT;
+
+  enum DiffMode
+  {
+    DiffStacks,     // whole callstacks
+    DiffSelf,       // functions on the top of the stacks
+    DiffTotal,      // functions anywhere in the stacks (counted once per stack)
+  };
+
+  struct TDiffItem
+  {
+    char *     key;           // callstack or function name (UTF-8)
+    ULONGLONG  before;
+    ULONGLONG  after;
+    double     delta;         // change of the share of all samples (after - before)
+    double     zScore;        // two-proportion z-test, |z| > 3 is significant
+  };
+
+  struct TDiff
+  {
+    ULONGLONG   totalBefore;
+    ULONGLONG   totalAfter;
+    TDiffItem * items;        // sorted by |delta|, descending
+    int         count;
+  };
+
+  // Compare two folded files (of Write or Merge), normalized by their total samples. Only the
+  // `maxItems` largest changes with |zScore| >= minZScore are kept. Release with FreeDiff.
+  static bool Compare(LPCWSTR szBefore, LPCWSTR szAfter, DiffMode mode, int maxItems, TDiff & diff,
+                      double minZScore = 0) STKWLK_NOEXCEPT;
+
+  static void FreeDiff(TDiff & diff) STKWLK_NOEXCEPT;
+
+  virtual void OnLoadDbgHelp(const TLoadDbgHelp & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnSymInit(const TSymInit & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT;
+
+  virtual void OnShowObject(const TShowObject & data) STKWLK_NOEXCEPT { }
+
+  virtual void OnDbgHelpErr(const TDbgHelpErr & data) STKWLK_NOEXCEPT { }
+
+private:
+  StackWalkerFoldedInternal * m_fs;
+}; // class StackWalkerFoldedStacks
+
+
+// Aggregation of raw callstacks as a call tree: a node per distinct path from the root, so
+// the memory is proportional to the number of distinct call paths, not to the number of
+// samples. The nodes are stored in a flat array, node 0 is the root (addr = 0).
+class StackWalkerCallTree
+{
+public:
+  StackWalkerCallTree() STKWLK_NOEXCEPT;
+
+  // delete copy constructor
+  StackWalkerCallTree(const StackWalkerCallTree & ) STKWLK_DELETED;
+  const StackWalkerCallTree & operator = ( const StackWalkerCallTree & ) STKWLK_DELETED;
+
+  ~StackWalkerCallTree() STKWLK_NOEXCEPT;
+
+  // can be called from any thread; the frames are leaf first (as of CaptureRawCallstack)
+  bool AddSample(const DWORD64 * frames, int count, ULONGLONG value = 1) STKWLK_NOEXCEPT;
+
+  int GetNodesCount() STKWLK_NOEXCEPT;
+
+  struct TNode
+  {
+    DWORD64    addr;
+    int        parent;        // -1 for the root
+    int        firstChild;    // -1 - no children
+    int        nextSibling;   // -1 - the last child
+    int        depth;
+    ULONGLONG  self;          // samples ending in this node
+    ULONGLONG  total;         // samples passing through this node
+  };
+
+  struct TCallTree
+  {
+    TNode *    nodes;
+    int        count;
+  };
+
+  // Copy of the tree, the producers are blocked only for the copy of the array. With reset the
+  // nodes are handed over without a copy and the producers continue with an empty tree.
+  // Release with FreeSnapshot.
+  bool Snapshot(TCallTree & tree, bool reset = false) STKWLK_NOEXCEPT;
+
+  static void FreeSnapshot(TCallTree & tree) STKWLK_NOEXCEPT;
+
+  // Raw callstack of the path to the node (leaf first), e.g. for ShowRawCallstack
+  static int GetNodeFrames(const TCallTree & tree, int node, DWORD64 * frames, int maxFrames) STKWLK_NOEXCEPT;
+
+  void Reset() STKWLK_NOEXCEPT;
+
+private:
+  StackWalkerCallTreeInternal * m_ct;
+}; // class StackWalkerCallTree
+
+
 #endif //defined(_MSC_VER)
 
 #endif // __STACKWALKER_H__
@@ -8,6 +8,11 @@
 #include <stdio.h>
 #include <vector>
 
+#pragma pack(push, 8)
+#include <dbghelp.h>
+#pragma pack(pop)
+#pragma comment(lib, "dbghelp.lib")  // for "MiniDumpReadDumpStream"
+
 #pragma optimize( "", off )
 
 bool g_EHasync = false;   // true if compiled with option /EHa
@@ -48,6 +53,12 @@ public:
     // nothing
   }
 
+  explicit StackWalker(int options) STKWLK_NOEXCEPT
+    : StackWalkerDemo(options)
+  {
+    // nothing
+  }
+
   StackWalker(ExceptType extype, PEXCEPTION_POINTERS exp = NULL) STKWLK_NOEXCEPT
     : StackWalkerDemo(extype, OptionsAll, exp)
   {
@@ -446,6 +457,1719 @@ int run()
 
 } // namespace
 
+// =========================================================================================
+namespace test5 {
+
+const char caption[] = "Test minidump writer and unwinding from the dump.";
+
+TestContext ctx;
+
+HANDLE g_evReady = NULL;
+HANDLE g_evDone  = NULL;
+
+struct DumpFile
+{
+  HANDLE                hFile;
+  HANDLE                hMap;
+  LPBYTE                base;
+  PMINIDUMP_THREAD_LIST threads;
+  PMINIDUMP_MEMORY_LIST memory;
+  PMINIDUMP_MODULE_LIST modules;
+} g_dump;
+
+LPVOID ReadStream(ULONG type)
+{
+  PMINIDUMP_DIRECTORY dir = NULL;
+  LPVOID stream = NULL;
+  ULONG size = 0;
+  if (!MiniDumpReadDumpStream(g_dump.base, type, &dir, &stream, &size))
+    return NULL;
+  return stream;
+}
+
+bool CopyDumpMem(const MINIDUMP_MEMORY_DESCRIPTOR & md, DWORD64 addr, PVOID buf, DWORD size, LPDWORD read)
+{
+  if (addr < md.StartOfMemoryRange || addr + size > md.StartOfMemoryRange + md.Memory.DataSize)
+    return false;
+  memcpy(buf, g_dump.base + md.Memory.Rva + (addr - md.StartOfMemoryRange), size);
+  *read = size;
+  return true;
+}
+
+BOOL WINAPI ReadDumpMem(HANDLE hProcess, DWORD64 addr, PVOID buf, DWORD size, LPDWORD read, LPVOID pUserData)
+{
+  *read = 0;
+  for (ULONG i = 0; i < g_dump.threads->NumberOfThreads; i++)
+    if (CopyDumpMem(g_dump.threads->Threads[i].Stack, addr, buf, size, read))
+      return TRUE;
+  for (ULONG i = 0; g_dump.memory && i < g_dump.memory->NumberOfMemoryRanges; i++)
+    if (CopyDumpMem(g_dump.memory->MemoryRanges[i], addr, buf, size, read))
+      return TRUE;
+  // image memory is not saved in the dump, take it from the (still loaded) modules
+  for (ULONG i = 0; i < g_dump.modules->NumberOfModules; i++)
+  {
+    const MINIDUMP_MODULE & m = g_dump.modules->Modules[i];
+    if (addr >= m.BaseOfImage && addr + size <= m.BaseOfImage + m.SizeOfImage)
+    {
+      SIZE_T st = 0;
+      BOOL rc = ReadProcessMemory(GetCurrentProcess(), (LPVOID)addr, buf, size, &st);
+      *read = (DWORD)st;
+      return rc;
+    }
+  }
+  return FALSE;
+}
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (!ctx.UpdateLevel(entry.name, L"test5::WaitSignal"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void WaitSignal()
+{
+  SetEvent(g_evReady);
+  WaitForSingleObject(g_evDone, INFINITE);
+}
+
+void Func4()
+{
+  CALL2(WaitSignal);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+DWORD WINAPI ThreadProc(LPVOID param)
+{
+  CALL(Func1);
+  return 0;
+}
+
+int run()
+{
+  WCHAR path[MAX_PATH];
+  DWORD len = GetTempPathW(MAX_PATH - 32, path);
+  if (len == 0 || len >= MAX_PATH - 32)
+    ExitWithError(1, L"Cannot get temp path \n");
+  wcscat_s(path, L"sw_test5.dmp");
+
+  ctx.reset(-2, testCallstackEntry);
+  g_evReady = CreateEventW(NULL, TRUE, FALSE, NULL);
+  g_evDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+  DWORD tid = 0;
+  HANDLE hThread = CreateThread(NULL, 0, ThreadProc, NULL, 0, &tid);
+  WaitForSingleObject(g_evReady, INFINITE);
+
+  StackWalker sw;
+  if (!sw.WriteMiniDump(path, NULL, 64 * 1024))
+    ExitWithError(1, L"Cannot write minidump \"%s\" \n", path);
+
+  memset(&g_dump, 0, sizeof(g_dump));
+  g_dump.hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (g_dump.hFile == INVALID_HANDLE_VALUE)
+    ExitWithError(1, L"Cannot open minidump \n");
+  g_dump.hMap = CreateFileMappingW(g_dump.hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  g_dump.base = g_dump.hMap ? (LPBYTE)MapViewOfFile(g_dump.hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (g_dump.base == NULL)
+    ExitWithError(1, L"Cannot map minidump \n");
+  g_dump.threads = (PMINIDUMP_THREAD_LIST)ReadStream(ThreadListStream);
+  g_dump.modules = (PMINIDUMP_MODULE_LIST)ReadStream(ModuleListStream);
+  g_dump.memory = (PMINIDUMP_MEMORY_LIST)ReadStream(MemoryListStream);
+  if (!g_dump.threads || !g_dump.modules || g_dump.modules->NumberOfModules < 2)
+    ExitWithError(1, L"Incorrect minidump content \n");
+
+  const MINIDUMP_THREAD * thread = NULL;
+  for (ULONG i = 0; i < g_dump.threads->NumberOfThreads; i++)
+    if (g_dump.threads->Threads[i].ThreadId == tid)
+      thread = &g_dump.threads->Threads[i];
+  if (thread == NULL || thread->ThreadContext.DataSize < sizeof(CONTEXT))
+    ExitWithError(1, L"Thread %d not found in minidump \n", tid);
+
+  CONTEXT c;
+  memcpy(&c, g_dump.base + thread->ThreadContext.Rva, sizeof(c));
+  sw.ShowCallstack(hThread, &c, ReadDumpMem, &ctx);
+
+  UnmapViewOfFile(g_dump.base);
+  CloseHandle(g_dump.hMap);
+  CloseHandle(g_dump.hFile);
+  DeleteFileW(path);
+  SetEvent(g_evDone);
+  WaitForSingleObject(hThread, INFINITE);
+  CloseHandle(hThread);
+  CloseHandle(g_evReady);
+  CloseHandle(g_evDone);
+  return ctx.m_level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test6 {
+
+const char caption[] = "Test offline unwinding of a saved snapshot.";
+
+TestContext ctx;
+
+StackWalkerBase::TSnapshot snap;
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (!ctx.UpdateLevel(entry.name, L"::CaptureSnapshot"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void Func5()
+{
+  StackWalker sw;
+  CALL2(sw.CaptureSnapshot, snap, GetCurrentThread(), NULL, 64 * 1024, true);
+}
+
+void Func4()
+{
+  CALL(Func5);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+int run()
+{
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  if (snap.stackSize == 0 || snap.modulesCount < 2)
+    ExitWithError(1, L"Incorrect snapshot \n");
+  // the frames of Func1 ... Func5 are already overwritten, only the snapshot keeps them
+  StackWalker sw;
+  sw.StackWalkerDemo::ShowCallstack(snap, &ctx);
+  StackWalkerBase::FreeSnapshot(snap);
+  return ctx.m_level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test7 {
+
+const char caption[] = "Test asynchronous symbolization.";
+
+TestContext ctx;
+
+StackWalker * g_sw = NULL;
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (!ctx.UpdateLevel(entry.name, L"::ShowCallstackAsync"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void Func5()
+{
+  CALL2(g_sw->ShowCallstackAsync, &ctx);
+}
+
+void Func4()
+{
+  CALL(Func5);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+int run()
+{
+  StackWalker sw;
+  g_sw = &sw;
+  if (!sw.StartAsync(1, 4))
+    ExitWithError(1, L"Cannot start async workers \n");
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  if (!sw.FlushAsync(60 * 1000))
+    ExitWithError(1, L"Async symbolization timed out \n");
+  sw.StopAsync();
+  g_sw = NULL;
+  return ctx.m_level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test8 {
+
+const char caption[] = "Test repeated symbolization with the symbol cache.";
+
+TestContext ctx;
+
+StackWalker * g_sw = NULL;
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (!ctx.UpdateLevel(entry.name, L"::ShowCallstack"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void Func5()
+{
+  CALL2(g_sw->ShowCallstack, NULL, &ctx);
+}
+
+void Func4()
+{
+  CALL(Func5);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+int run()
+{
+  StackWalkerBase::TStats st1, st2;
+  StackWalker sw(StackWalker::OptionsAll | StackWalkerBase::CollectStats);
+  g_sw = &sw;
+  sw.SetSymCacheSize(1024 * 1024);
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  int level = ctx.m_level;
+  sw.GetStats(st1);
+  // the second callstack is resolved from the cache
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  sw.GetStats(st2);
+  g_sw = NULL;
+  if (st1.count[StackWalkerBase::StatSymFromAddr] == 0)
+    ExitWithError(1, L"No symbol lookups counted \n");
+  // only the return address in run() differs, the other frames are cache hits
+  ULONGLONG lookups = st2.count[StackWalkerBase::StatSymFromAddr] - st1.count[StackWalkerBase::StatSymFromAddr];
+  if (lookups > 2)
+    ExitWithError(1, L"Repeated addresses not resolved from the cache (%d lookups) \n", (int)lookups);
+  return (ctx.m_level == level) ? level : 0;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test9 {
+
+const char caption[] = "Test batch symbolization of repeated addresses.";
+
+TestContext ctx;
+
+DWORD64 addrs[STKWLK_MAX_RAW_FRAMES * 2];
+int     addrsCount = 0;
+int     entryNum = 0;
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (entry.type == StackWalkerBase::lastEntry)
+    return 0;
+  if (entryNum >= addrsCount || entry.offset != addrs[entryNum])
+    ExitWithError(1, L"Incorrect order of the batch entries \n");
+  if (entryNum == addrsCount / 2)
+    ctx.m_level = -2;   // the second copy is checked again
+  entryNum++;
+  if (!ctx.UpdateLevel(entry.name, L"::Func5"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void Func5()
+{
+  int count = StackWalkerBase::CaptureRawCallstack(addrs, STKWLK_MAX_RAW_FRAMES);
+  // the same callstack twice
+  memcpy(addrs + count, addrs, count * sizeof(DWORD64));
+  addrsCount = count * 2;
+}
+
+void Func4()
+{
+  CALL(Func5);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+int run()
+{
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  entryNum = 0;
+  StackWalker sw;
+  if (!sw.SymbolizeBatch(addrs, addrsCount, &ctx))
+    ExitWithError(1, L"SymbolizeBatch failed \n");
+  if (entryNum != addrsCount)
+    ExitWithError(1, L"Incorrect number of the batch entries \n");
+  return ctx.m_level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test10 {
+
+const char caption[] = "Test allocation call-site tracker.";
+
+TestContext ctx;
+
+StackWalkerAllocTracker * g_tracker = NULL;
+int g_sites = 0;
+
+class AllocSiteWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    typedef StackWalkerAllocTracker::TAllocSite TAllocSite;
+    const TAllocSite * site = (const TAllocSite *)GetUserData();
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (entry.type == firstEntry)
+    {
+      g_sites++;
+      if (site == NULL || site->liveCount != 1 || site->liveBytes != 100)
+        ExitWithError(1, L"Incorrect allocation site \n");
+    }
+    if (entry.type != lastEntry && ctx.UpdateLevel(entry.name, L"::Func5"))
+      ctx.CheckEntry(entry);
+  }
+};
+
+void Func5()
+{
+  g_tracker->OnAlloc((LPVOID)0x1000, 100);
+}
+
+void Func4()
+{
+  CALL(Func5);
+}
+
+void Func3()
+{
+  CALL(Func4);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+int run()
+{
+  StackWalkerAllocTracker tracker(1);   // sample every allocation
+  g_tracker = &tracker;
+  ctx.reset(-2);
+  CALL(Func1);
+  tracker.OnAlloc((LPVOID)0x2000, 100);
+  tracker.OnFree((LPVOID)0x2000);       // not reported as live
+  AllocSiteWalker sw;
+  if (!tracker.Dump(sw))
+    ExitWithError(1, L"Dump of the allocation sites failed \n");
+  if (g_sites != 1)
+    ExitWithError(1, L"Incorrect number of the allocation sites \n");
+  g_tracker = NULL;
+  return ctx.m_level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test11 {
+
+const char caption[] = "Test lock-contention profiler.";
+
+StackWalkerLockProfiler::TLock * g_lock = NULL;
+HANDLE g_evStarted = NULL;
+int g_waiterShown = 0;
+int g_holderShown = 0;
+
+class ContentionWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    typedef StackWalkerLockProfiler::TContentionSite TContentionSite;
+    const TContentionSite * site = (const TContentionSite *)GetUserData();
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (entry.type != firstEntry)
+      return;
+    if (site == NULL || site->count != 1 || site->waitNs < 1000 * 1000)
+      ExitWithError(1, L"Incorrect contention site \n");
+    LPCWSTR expected = site->isHolder ? L"::HoldLock" : L"::WaiterProc";
+    if (entry.name == NULL || wcsstr(entry.name, expected) == NULL)
+      ExitWithError(1, L"Incorrect callstack of the contention site. Expected: \"%s\" \n", expected);
+    if (site->isHolder)
+      g_holderShown++;
+    else
+      g_waiterShown++;
+  }
+};
+
+DWORD WINAPI WaiterProc(LPVOID param)
+{
+  SetEvent(g_evStarted);
+  g_lock->lock();    // waits for HoldLock
+  g_lock->unlock();
+  return 0;
+}
+
+void HoldLock()
+{
+  g_lock->lock();
+  DWORD tid;
+  HANDLE hThread = CreateThread(NULL, 0, WaiterProc, NULL, 0, &tid);
+  WaitForSingleObject(g_evStarted, INFINITE);
+  Sleep(100);
+  g_lock->unlock();
+  WaitForSingleObject(hThread, INFINITE);
+  CloseHandle(hThread);
+}
+
+int run()
+{
+  StackWalkerLockProfiler profiler(1000, 1);   // 1 ms, sample every holder
+  StackWalkerLockProfiler::TLock lock(profiler);
+  g_lock = &lock;
+  g_evStarted = CreateEvent(NULL, TRUE, FALSE, NULL);
+  HoldLock();
+  CloseHandle(g_evStarted);
+  ContentionWalker sw;
+  if (!profiler.Dump(sw))
+    ExitWithError(1, L"Dump of the contention sites failed \n");
+  g_lock = NULL;
+  if (g_waiterShown != 1 || g_holderShown != 1)
+    ExitWithError(1, L"Incorrect number of the contention sites \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test12 {
+
+const char caption[] = "Test watchdog for stuck threads.";
+
+HANDLE g_evStuck = NULL;
+HANDLE g_evRelease = NULL;
+int g_stuckShown = 0;
+
+class HangWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    const StackWalkerWatchdog::THangInfo * info = (const StackWalkerWatchdog::THangInfo *)GetUserData();
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (info == NULL || info->stuckMs < 50 || info->hits != 1)
+      ExitWithError(1, L"Incorrect hang info \n");
+    if (entry.type != lastEntry && entry.name != NULL && wcsstr(entry.name, L"::StuckFunc") != NULL)
+      g_stuckShown++;
+  }
+};
+
+void StuckFunc()
+{
+  SetEvent(g_evStuck);
+  WaitForSingleObject(g_evRelease, INFINITE);
+}
+
+DWORD WINAPI WorkerProc(LPVOID param)
+{
+  StackWalkerWatchdog * wd = (StackWalkerWatchdog *)param;
+  int slot = wd->RegisterThread();
+  if (slot < 0)
+    return 1;
+  wd->Heartbeat(slot);
+  StuckFunc();
+  wd->UnregisterThread(slot);
+  return 0;
+}
+
+int run()
+{
+  HangWalker sw;
+  StackWalkerWatchdog wd(sw, 50, 60000);   // 50 ms deadline, report every stack only once
+  g_evStuck = CreateEvent(NULL, TRUE, FALSE, NULL);
+  g_evRelease = CreateEvent(NULL, TRUE, FALSE, NULL);
+  DWORD tid;
+  HANDLE hThread = CreateThread(NULL, 0, WorkerProc, &wd, 0, &tid);
+  WaitForSingleObject(g_evStuck, INFINITE);
+  wd.Check();    // sees the last heartbeat
+  Sleep(200);
+  if (wd.Check() != 1)
+    ExitWithError(1, L"Stuck thread not reported \n");
+  if (wd.Check() != 0)
+    ExitWithError(1, L"Repeated report of the same stuck callstack \n");
+  SetEvent(g_evRelease);
+  WaitForSingleObject(hThread, INFINITE);
+  CloseHandle(hThread);
+  CloseHandle(g_evStuck);
+  CloseHandle(g_evRelease);
+  if (g_stuckShown != 1)
+    ExitWithError(1, L"Incorrect callstack of the stuck thread \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test13 {
+
+const char caption[] = "Test reuse of the shared symbol engine.";
+
+TestContext ctx;
+
+StackWalker * g_sw = NULL;
+
+int testCallstackEntry(const StackWalkerBase::TCallstackEntry & entry)
+{
+  if (!ctx.UpdateLevel(entry.name, L"::ShowCallstack"))
+    return 0;
+  return ctx.CheckEntry(entry);
+}
+
+void Func3()
+{
+  CALL2(g_sw->ShowCallstack, NULL, &ctx);
+}
+
+void Func2()
+{
+  CALL(Func3);
+}
+
+void Func1()
+{
+  CALL(Func2);
+}
+
+const int options = StackWalker::OptionsAll | StackWalkerBase::ShareEngine | StackWalkerBase::CollectStats;
+
+int walk(StackWalkerBase::TStats & stats, int opt = options | StackWalkerBase::SymIsolated, SW_CSTR symPath = NULL)
+{
+  StackWalker sw(opt);
+  if (symPath)
+    sw.SetSymPath(symPath);
+  g_sw = &sw;
+  ctx.reset(-2, testCallstackEntry);
+  CALL(Func1);
+  g_sw = NULL;
+  sw.GetStats(stats);
+  return ctx.m_level;
+}
+
+int run()
+{
+  StackWalkerBase::TStats stats;
+  int level = walk(stats);
+  if (stats.count[StackWalkerBase::StatSymLoadModule] == 0)
+    ExitWithError(1, L"Modules not loaded by the first walker \n");
+  // the second walker gets the engine of the first one with the modules already loaded
+  if (walk(stats) != level)
+    return 0;
+  if (stats.count[StackWalkerBase::StatSymLoadModule] != 0)
+    ExitWithError(1, L"Shared symbol engine not reused \n");
+  StackWalkerBase::ReleaseSharedEngines();
+  // an engine with a changed symbol path is not kept
+  walk(stats, options | StackWalkerBase::SymIsolated, L".");
+  walk(stats);
+  if (stats.count[StackWalkerBase::StatSymLoadModule] == 0)
+    ExitWithError(1, L"Changed symbol engine reused \n");
+  StackWalkerBase::ReleaseSharedEngines();
+  // the shared dbghelp session is not kept
+  walk(stats, options);
+  walk(stats, options);
+  if (stats.count[StackWalkerBase::StatSymLoadModule] == 0)
+    ExitWithError(1, L"Not isolated symbol engine reused \n");
+  StackWalkerBase::ReleaseSharedEngines();
+  return level;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test14 {
+
+const char caption[] = "Test pprof writer.";
+
+DWORD64 g_frames[STKWLK_MAX_RAW_FRAMES];
+int g_count = 0;
+
+void SampleFunc()
+{
+  g_count = StackWalkerBase::CaptureRawCallstack(g_frames, STKWLK_MAX_RAW_FRAMES);
+}
+
+const int MaxStrings = 4096;
+const BYTE * g_strings[MaxStrings];   // string_table of the profile
+size_t g_stringLens[MaxStrings];
+int g_stringsCount = 0;
+
+bool ReadVarint(const BYTE *& p, const BYTE * end, ULONGLONG & value)
+{
+  value = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7)
+  {
+    BYTE b = *p++;
+    value |= (ULONGLONG)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+// next field of a protobuf message: `value` of a varint or the length of `data`
+bool NextField(const BYTE *& p, const BYTE * end, int & field, ULONGLONG & value, const BYTE *& data)
+{
+  ULONGLONG tag;
+  data = NULL;
+  if (p >= end || !ReadVarint(p, end, tag) || !ReadVarint(p, end, value))
+    return false;
+  field = (int)(tag >> 3);
+  if ((tag & 7) == 2)
+  {
+    if (value > (ULONGLONG)(end - p))
+      return false;
+    data = p;
+    p += (size_t)value;
+    return true;
+  }
+  return (tag & 7) == 0;
+}
+
+bool StringIs(ULONGLONG index, const char * str)
+{
+  size_t len = strlen(str);
+  return index < (ULONGLONG)g_stringsCount && g_stringLens[index] == len && memcmp(g_strings[index], str, len) == 0;
+}
+
+// field of a nested message (0 - not present)
+ULONGLONG MessageField(const BYTE * msg, ULONGLONG size, int field)
+{
+  const BYTE * p = msg;
+  const BYTE * data;
+  int f;
+  ULONGLONG value;
+  while (NextField(p, msg + (size_t)size, f, value, data))
+    if (f == field && data == NULL)
+      return value;
+  return 0;
+}
+
+// decode the profile: the sample type and a function name must resolve through the string table
+bool CheckProfile(LPCWSTR fileName, const char * funcName)
+{
+  bool typeOk = false;
+  bool funcOk = false;
+  FILE * f = _wfopen(fileName, L"rb");
+  if (f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  BYTE * buf = (BYTE *)malloc(size + 1);
+  if (buf != NULL && fread(buf, 1, size, f) == (size_t)size)
+  {
+    const BYTE * end = buf + size;
+    const BYTE * p;
+    const BYTE * data;
+    int field;
+    ULONGLONG value;
+    g_stringsCount = 0;
+    for (p = buf; NextField(p, end, field, value, data); )
+    {
+      if (field == 6 && data != NULL && g_stringsCount < MaxStrings)    // string_table
+      {
+        g_strings[g_stringsCount] = data;
+        g_stringLens[g_stringsCount++] = (size_t)value;
+      }
+    }
+    for (p = buf; g_stringsCount > 0 && g_stringLens[0] == 0 && NextField(p, end, field, value, data); )
+    {
+      if (field == 1 && data != NULL)    // sample_type: type, unit
+        typeOk = StringIs(MessageField(data, value, 1), "samples") && StringIs(MessageField(data, value, 2), "count");
+      if (field == 5 && data != NULL && StringIs(MessageField(data, value, 2), funcName))   // Function.name
+        funcOk = true;
+    }
+  }
+  free(buf);
+  fclose(f);
+  return typeOk && funcOk;
+}
+
+int run()
+{
+  WCHAR fileName[MAX_PATH + 32];
+  GetTempPathW(MAX_PATH, fileName);
+  wcscat(fileName, L"stackwalker_test.pb");
+  SampleFunc();
+  if (g_count <= 0)
+    ExitWithError(1, L"Raw callstack not captured \n");
+  StackWalkerPprofWriter writer;
+  if (!writer.Open(fileName))
+    ExitWithError(1, L"Cannot create the profile \n");
+  for (int i = 0; i < 1000; i++)
+    if (!writer.AddSample(g_frames, g_count))
+      ExitWithError(1, L"Cannot add the sample \n");
+  if (!writer.Close())
+    ExitWithError(1, L"Cannot write the profile \n");
+  bool valid = CheckProfile(fileName, "test14::SampleFunc");
+  DeleteFileW(fileName);
+  if (!valid)
+    ExitWithError(1, L"Incorrect sample type or function in the profile \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test15 {
+
+const char caption[] = "Test folded stacks and their merge.";
+
+DWORD64 g_frames[STKWLK_MAX_RAW_FRAMES];
+int g_count = 0;
+
+void SampleFunc()
+{
+  g_count = StackWalkerBase::CaptureRawCallstack(g_frames, STKWLK_MAX_RAW_FRAMES);
+}
+
+bool WriteSamples(LPCWSTR fileName, int samples)
+{
+  StackWalkerFoldedStacks fs;
+  for (int i = 0; i < samples; i++)
+    fs.AddSample(g_frames, g_count);
+  return fs.GetStacksCount() == 1 && fs.Write(fileName);
+}
+
+int run()
+{
+  WCHAR files[3][MAX_PATH + 32];
+  LPCWSTR inputs[2] = { files[0], files[1] };
+  char line[16 * 1024];
+  bool found = false;
+  for (int i = 0; i < 3; i++)
+  {
+    GetTempPathW(MAX_PATH, files[i]);
+    wcscat(files[i], (i == 0) ? L"stackwalker_1.folded" : (i == 1) ? L"stackwalker_2.folded" : L"stackwalker.folded");
+  }
+  SampleFunc();
+  if (g_count <= 0)
+    ExitWithError(1, L"Raw callstack not captured \n");
+  if (!WriteSamples(files[0], 3) || !WriteSamples(files[1], 2))
+    ExitWithError(1, L"Cannot write the folded stacks \n");
+  if (!StackWalkerFoldedStacks::Merge(inputs, 2, files[2]))
+    ExitWithError(1, L"Cannot merge the folded stacks \n");
+  FILE * f = _wfopen(files[2], L"rb");
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+  {
+    const char * sp = strrchr(line, ' ');
+    if (strstr(line, "test15::SampleFunc") != NULL && sp != NULL && atoi(sp + 1) == 5)
+      found = true;
+  }
+  if (f != NULL)
+    fclose(f);
+  for (int i = 0; i < 3; i++)
+    DeleteFileW(files[i]);
+  if (!found)
+    ExitWithError(1, L"Merged stack not found \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test16 {
+
+const char caption[] = "Test comparison of folded stacks.";
+
+bool WriteText(LPCWSTR fileName, const char * text)
+{
+  FILE * f = _wfopen(fileName, L"wb");
+  if (f == NULL)
+    return false;
+  fputs(text, f);
+  return fclose(f) == 0;
+}
+
+int run()
+{
+  WCHAR files[2][MAX_PATH + 32];
+  for (int i = 0; i < 2; i++)
+  {
+    GetTempPathW(MAX_PATH, files[i]);
+    wcscat(files[i], i ? L"stackwalker_after.folded" : L"stackwalker_before.folded");
+  }
+  // main;work is twice as hot after, the other stacks did not change their counts
+  if (!WriteText(files[0], "main;gc 1000\nmain;idle 5000\nmain;work 4000\n") ||
+      !WriteText(files[1], "main;gc 1000\nmain;idle 5000\nmain;work 8000\nmain;work;alloc 1000\n"))
+    ExitWithError(1, L"Cannot write the profiles \n");
+
+  StackWalkerFoldedStacks::TDiff diff;
+  if (!StackWalkerFoldedStacks::Compare(files[0], files[1], StackWalkerFoldedStacks::DiffStacks, 10, diff))
+    ExitWithError(1, L"Cannot compare the stacks \n");
+  if (diff.totalBefore != 10000 || diff.totalAfter != 15000 || diff.count != 4 ||
+      strcmp(diff.items[0].key, "main;idle") != 0 || diff.items[0].delta >= 0 ||
+      strcmp(diff.items[1].key, "main;work") != 0 || diff.items[1].zScore < 3)
+    ExitWithError(1, L"Incorrect difference of the stacks \n");
+  StackWalkerFoldedStacks::FreeDiff(diff);
+
+  if (!StackWalkerFoldedStacks::Compare(files[0], files[1], StackWalkerFoldedStacks::DiffTotal, 1, diff, 3))
+    ExitWithError(1, L"Cannot compare the functions \n");
+  if (diff.count != 1 || strcmp(diff.items[0].key, "work") != 0 || diff.items[0].after != 9000)
+    ExitWithError(1, L"Incorrect difference of the functions \n");
+  StackWalkerFoldedStacks::FreeDiff(diff);
+
+  DeleteFileW(files[0]);
+  DeleteFileW(files[1]);
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test17 {
+
+const char caption[] = "Test binary encoding of raw callstacks.";
+
+int run()
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  DWORD64 decoded[STKWLK_MAX_RAW_FRAMES];
+  BYTE buf[STKWLK_MAX_ENCODED_SIZE(STKWLK_MAX_RAW_FRAMES)];
+  StackWalker sw;
+  int count = StackWalkerBase::CaptureRawCallstack(frames, STKWLK_MAX_RAW_FRAMES);
+  if (count <= 0)
+    ExitWithError(1, L"Raw callstack not captured \n");
+  int size = sw.EncodeRawCallstack(frames, count, buf, sizeof(buf));
+  if (size <= 0 || size > 8 + count * 4)
+    ExitWithError(1, L"Incorrect size of the encoded callstack: %d (%d frames) \n", size, count);
+  if (sw.DecodeRawCallstack(buf, size, decoded, STKWLK_MAX_RAW_FRAMES) != count ||
+      memcmp(frames, decoded, count * sizeof(DWORD64)) != 0)
+    ExitWithError(1, L"Decoded callstack differs \n");
+  if (sw.DecodeRawCallstack(buf, size - 1, decoded, STKWLK_MAX_RAW_FRAMES) >= 0)
+    ExitWithError(1, L"Truncated data not detected \n");
+  // another walker with the same modules has the same generation of the map
+  DWORD64 bases[1024];
+  DWORD sizes[1024];
+  DWORD generation = 0;
+  StackWalker sw2;
+  int modules = sw2.GetModuleMap(bases, sizes, _countof(bases), &generation);
+  if (modules <= 0 || generation == 0 || generation != sw.GetModuleMapGeneration())
+    ExitWithError(1, L"Incorrect module map (%d modules, generation %08X) \n", modules, generation);
+  for (int i = 1; i < modules && i < (int)_countof(bases); i++)
+    if (bases[i - 1] >= bases[i])
+      ExitWithError(1, L"Module map not sorted \n");
+  if (sw2.DecodeRawCallstack(buf, size, decoded, STKWLK_MAX_RAW_FRAMES) != count ||
+      memcmp(frames, decoded, count * sizeof(DWORD64)) != 0)
+    ExitWithError(1, L"Callstack not decoded by another walker \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test18 {
+
+const char caption[] = "Test capture of the throw site of C++ exceptions.";
+
+struct TestError
+{
+  int code;
+};
+
+int g_firstFrame = -1;   // 1 - the top frame is Thrower
+
+class ThrowWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (entry.type == firstEntry)
+      g_firstFrame = (entry.name != NULL && wcsstr(entry.name, L"::Thrower") != NULL) ? 1 : 0;
+  }
+};
+
+void Thrower()
+{
+  TestError err = { 42 };
+  throw err;
+}
+
+void Rethrower()
+{
+  try
+  {
+    Thrower();
+  }
+  catch (TestError &)
+  {
+    throw;
+  }
+}
+
+int run()
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int count = 0;
+  if (!StackWalkerBase::EnableThrowCapture())
+    ExitWithError(1, L"Throw capture not enabled \n");
+  try
+  {
+    Rethrower();
+  }
+  catch (TestError & e)
+  {
+    TestError other = e;
+    if (StackWalkerBase::GetThrowCallstack(frames, STKWLK_MAX_RAW_FRAMES, &other) != 0)
+      ExitWithError(1, L"Callstack of another exception object \n");
+    count = StackWalkerBase::GetThrowCallstack(frames, STKWLK_MAX_RAW_FRAMES, &e);
+  }
+  if (count <= 0)
+    ExitWithError(1, L"Throw site not captured \n");
+  ThrowWalker sw;
+  sw.ShowRawCallstack(frames, count);
+  StackWalkerBase::EnableThrowCapture(false);
+  if (g_firstFrame != 1)
+    ExitWithError(1, L"Incorrect throw site \n");
+  if (StackWalkerBase::GetThrowCallstack(frames, STKWLK_MAX_RAW_FRAMES) != 0)
+    ExitWithError(1, L"Callstack after disabling the capture \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test19 {
+
+const char caption[] = "Test per-thread trace buffers.";
+
+const int Threads = 4;
+const int Events = 100;
+
+struct TDrainData
+{
+  int        count;
+  int        badRecords;
+  ULONGLONG  eventSum;
+};
+
+void OnRecord(const StackWalkerTraceBuffer::TTraceRecord & rec, LPVOID pUserData)
+{
+  TDrainData * data = (TDrainData *)pUserData;
+  data->count++;
+  data->eventSum += rec.event;
+  if (rec.framesCount <= 0 || rec.frames == NULL || rec.threadId == 0)
+    data->badRecords++;
+}
+
+DWORD WINAPI ProducerProc(LPVOID param)
+{
+  StackWalkerTraceBuffer * tb = (StackWalkerTraceBuffer *)param;
+  for (int i = 1; i <= Events; i++)
+    tb->Record(i);
+  return 0;
+}
+
+DWORD WINAPI OverflowProc(LPVOID param)
+{
+  StackWalkerTraceBuffer * tb = (StackWalkerTraceBuffer *)param;
+  for (int i = 0; i < 200; i++)
+    tb->Record();
+  return 0;
+}
+
+int run()
+{
+  StackWalkerTraceBuffer tb(128, 16);
+  HANDLE hThreads[Threads];
+  for (int i = 0; i < Threads; i++)
+    hThreads[i] = CreateThread(NULL, 0, ProducerProc, &tb, 0, NULL);
+  WaitForMultipleObjects(Threads, hThreads, TRUE, INFINITE);
+  for (int i = 0; i < Threads; i++)
+    CloseHandle(hThreads[i]);
+  TDrainData data = { 0, 0, 0 };
+  if (tb.Drain(OnRecord, &data) != Threads * Events || data.count != Threads * Events)
+    ExitWithError(1, L"Incorrect number of drained records: %d \n", data.count);
+  if (data.badRecords != 0 || data.eventSum != (ULONGLONG)Threads * Events * (Events + 1) / 2)
+    ExitWithError(1, L"Incorrect drained records \n");
+  if (tb.GetDroppedCount() != 0)
+    ExitWithError(1, L"Records dropped \n");
+  // overflow of the ring of this thread
+  for (int i = 0; i < 200; i++)
+    tb.Record();
+  if (tb.GetDroppedCount() != 200 - 128)
+    ExitWithError(1, L"Incorrect number of dropped records \n");
+  data.count = 0;
+  if (tb.Drain(OnRecord, &data, 100) != 100 || tb.Drain(OnRecord, &data) != 28)
+    ExitWithError(1, L"Incorrect limit of drained records \n");
+  // the ring of an exited thread is freed with its dropped count kept
+  HANDLE hThread = CreateThread(NULL, 0, OverflowProc, &tb, 0, NULL);
+  WaitForSingleObject(hThread, INFINITE);
+  CloseHandle(hThread);
+  if (tb.Drain(OnRecord, &data) != 128 || tb.Drain(OnRecord, &data) != 0)
+    ExitWithError(1, L"Incorrect records of an exited thread \n");
+  if (tb.GetDroppedCount() != 2 * (200 - 128))
+    ExitWithError(1, L"Incorrect number of dropped records of an exited thread \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test20 {
+
+const char caption[] = "Test sampling profiler.";
+
+volatile LONG g_stop = 0;
+int g_busyHits = 0;
+
+class SampleWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    const StackWalkerSampler::TSampleSite * site = (const StackWalkerSampler::TSampleSite *)GetUserData();
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (site == NULL || site->hits == 0)
+      ExitWithError(1, L"Incorrect sample site \n");
+    if (entry.type != lastEntry && entry.name != NULL && wcsstr(entry.name, L"::BusyFunc") != NULL)
+      g_busyHits += (int)site->hits;
+  }
+};
+
+void BusyFunc()
+{
+  while (g_stop == 0)
+    Sleep(1);
+}
+
+DWORD WINAPI BusyProc(LPVOID param)
+{
+  BusyFunc();
+  return 0;
+}
+
+int run()
+{
+  SampleWalker sw;
+  StackWalkerSampler sampler(sw);
+  HANDLE hThread = CreateThread(NULL, 0, BusyProc, NULL, 0, NULL);
+  Sleep(50);
+  int sampled = 0;
+  for (int i = 0; i < 5; i++)
+    sampled += sampler.Sample();
+  if (sampled < 5 || sampler.GetSamplesCount() != (ULONGLONG)sampled)
+    ExitWithError(1, L"Threads not sampled \n");
+  if (!sampler.Start(5))
+    ExitWithError(1, L"Sampler not started \n");
+  Sleep(100);
+  sampler.Stop();
+  InterlockedExchange(&g_stop, 1);
+  WaitForSingleObject(hThread, INFINITE);
+  CloseHandle(hThread);
+  if (sampler.GetSamplesCount() <= (ULONGLONG)sampled)
+    ExitWithError(1, L"No samples of the sampler thread \n");
+  if (!sampler.Dump() || g_busyHits < 5)
+    ExitWithError(1, L"Incorrect callstacks of the sampled thread \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test21 {
+
+const char caption[] = "Test load and unload notifications of the modules.";
+
+int g_loaded = 0;
+int g_unloaded = 0;
+
+class ModuleWalker : public StackWalker
+{
+public:
+  ModuleWalker() STKWLK_NOEXCEPT
+    : StackWalker(OptionsAll | NotifyModules)
+  { }
+
+  virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT
+  {
+    StackWalkerDemo::OnLoadModule(data);
+    if (data.modName != NULL && _wcsicmp(data.modName, L"msimg32") == 0)
+      g_loaded++;
+  }
+
+  virtual void OnUnloadModule(const TUnloadModule & data) STKWLK_NOEXCEPT
+  {
+    StackWalkerDemo::OnUnloadModule(data);
+    if (data.modName != NULL && _wcsicmp(data.modName, L"msimg32") == 0)
+      g_unloaded++;
+  }
+};
+
+int run()
+{
+  ModuleWalker sw;
+  sw.ShowCallstack();
+  if (GetModuleHandleA("msimg32.dll") != NULL)
+    return 1;    // loaded already, nothing to check
+  HMODULE hLib = LoadLibraryA("msimg32.dll");
+  if (hLib == NULL)
+    ExitWithError(1, L"msimg32.dll not loaded \n");
+  sw.ShowCallstack();
+  if (g_loaded != 1 || g_unloaded != 0)
+    ExitWithError(1, L"Load of the module not reported \n");
+  sw.ShowCallstack();     // no change
+  FreeLibrary(hLib);
+  sw.ShowCallstack();
+  if (g_loaded != 1 || g_unloaded != 1)
+    ExitWithError(1, L"Unload of the module not reported \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test22 {
+
+const char caption[] = "Test call tree of raw callstacks.";
+
+int run()
+{
+  // leaf first: main -> loop -> work / main -> loop -> idle
+  const DWORD64 work[] = { 0x3000, 0x2000, 0x1000 };
+  const DWORD64 idle[] = { 0x4000, 0x2000, 0x1000 };
+  StackWalkerCallTree ct;
+  for (int i = 0; i < 1000; i++)
+  {
+    ct.AddSample(work, 3);
+    ct.AddSample(idle, 3, 2);
+  }
+  ct.AddSample(work + 1, 2);    // main -> loop
+  if (ct.GetNodesCount() != 5)
+    ExitWithError(1, L"Incorrect number of nodes: %d \n", ct.GetNodesCount());
+
+  StackWalkerCallTree::TCallTree tree;
+  if (!ct.Snapshot(tree) || tree.count != 5)
+    ExitWithError(1, L"Snapshot failed \n");
+  const StackWalkerCallTree::TNode & root = tree.nodes[0];
+  if (root.total != 3001 || root.firstChild < 0 || tree.nodes[root.firstChild].nextSibling != -1)
+    ExitWithError(1, L"Incorrect root node \n");
+  int loop = tree.nodes[root.firstChild].firstChild;
+  if (loop < 0 || tree.nodes[loop].addr != 0x2000 || tree.nodes[loop].self != 1 || tree.nodes[loop].total != 3001)
+    ExitWithError(1, L"Incorrect inner node \n");
+  int leaf = -1;
+  for (int i = tree.nodes[loop].firstChild; i >= 0; i = tree.nodes[i].nextSibling)
+    if (tree.nodes[i].addr == 0x4000)
+      leaf = i;
+  if (leaf < 0 || tree.nodes[leaf].self != 2000 || tree.nodes[leaf].depth != 3)
+    ExitWithError(1, L"Incorrect leaf node \n");
+  DWORD64 frames[8];
+  if (StackWalkerCallTree::GetNodeFrames(tree, leaf, frames, 8) != 3 || memcmp(frames, idle, sizeof(idle)) != 0)
+    ExitWithError(1, L"Incorrect frames of the node \n");
+  StackWalkerCallTree::FreeSnapshot(tree);
+
+  if (!ct.Snapshot(tree, true) || tree.count != 5 || ct.GetNodesCount() != 0)
+    ExitWithError(1, L"Snapshot with reset failed \n");
+  StackWalkerCallTree::FreeSnapshot(tree);
+  ct.AddSample(work, 3);
+  if (ct.GetNodesCount() != 4)
+    ExitWithError(1, L"Incorrect tree after reset \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test23 {
+
+const char caption[] = "Test frame filters.";
+
+int g_entries = 0;
+int g_exeEntries = 0;
+int g_ntdllEntries = 0;
+int g_lastEntries = 0;
+DWORD64 g_first = 0;
+
+class FilterWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    StackWalkerDemo::OnCallstackEntry(entry);
+    if (entry.type == lastEntry)
+    {
+      g_lastEntries++;
+      return;
+    }
+    if (entry.type == firstEntry)
+      g_first = entry.offset;
+    g_entries++;
+    if (entry.baseOfImage == (DWORD64)(ULONG_PTR)GetModuleHandleW(NULL))
+      g_exeEntries++;
+    if (entry.moduleName != NULL && _wcsicmp(entry.moduleName, L"ntdll") == 0)
+      g_ntdllEntries++;
+  }
+};
+
+void Show(FilterWalker & sw, const DWORD64 * frames, int count)
+{
+  g_entries = 0;
+  g_exeEntries = 0;
+  g_ntdllEntries = 0;
+  g_lastEntries = 0;
+  g_first = 0;
+  sw.ShowRawCallstack(frames, count);
+}
+
+int run()
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int count = StackWalkerBase::CaptureRawCallstack(frames, STKWLK_MAX_RAW_FRAMES);
+  if (count < 4)
+    ExitWithError(1, L"Raw callstack not captured \n");
+  WCHAR exePath[MAX_PATH];
+  GetModuleFileNameW(NULL, exePath, MAX_PATH);
+  LPCWSTR exeFile = wcsrchr(exePath, L'\\') ? wcsrchr(exePath, L'\\') + 1 : exePath;
+
+  FilterWalker sw;
+  Show(sw, frames, count);
+  int all = g_entries;
+  int exeAll = g_exeEntries;
+  if (exeAll < 2 || g_ntdllEntries == 0)
+    ExitWithError(1, L"Unexpected callstack \n");
+
+  sw.SetSkipFrames(1);
+  sw.AddRangeFilter(frames[2], frames[2] + 1);
+  Show(sw, frames, count);
+  if (g_entries != all - 2 || g_first != frames[1])
+    ExitWithError(1, L"Incorrect skip and range filters \n");
+
+  sw.ClearFrameFilters();
+  sw.AddModuleFilter(L"ntdll", StackWalkerBase::FrameDrop);
+  sw.AddModuleFilter(exeFile, StackWalkerBase::FrameCollapse);
+  Show(sw, frames, count);
+  if (g_ntdllEntries != 0 || g_exeEntries != 1)
+    ExitWithError(1, L"Incorrect module filters \n");
+
+  sw.ClearFrameFilters();
+  sw.AddModuleFilter(exeFile, StackWalkerBase::FrameAllow);
+  Show(sw, frames, count);
+  if (g_entries != exeAll || g_exeEntries != exeAll)
+    ExitWithError(1, L"Incorrect allow filter \n");
+
+  // the callstack ends with lastEntry even if all the frames are dropped
+  sw.ClearFrameFilters();
+  sw.SetSkipFrames(10000);     // more than any callstack
+  Show(sw, frames, count);
+  if (g_entries != 0 || g_lastEntries != 1)
+    ExitWithError(1, L"Incorrect end of a raw callstack without frames \n");
+  g_lastEntries = 0;
+  sw.ShowCallstack();
+  if (g_entries != 0 || g_lastEntries != 1)
+    ExitWithError(1, L"Incorrect end of a callstack without frames \n");
+
+  // a snapshot with its own modules is filtered by them
+  StackWalkerBase::TSnapshot snap;
+  FilterWalker snapWalker;
+  if (!snapWalker.CaptureSnapshot(snap, GetCurrentThread(), NULL, 64 * 1024, true))
+    ExitWithError(1, L"Snapshot not captured \n");
+  g_ntdllEntries = 0;
+  snapWalker.StackWalkerDemo::ShowCallstack(snap);
+  if (g_ntdllEntries == 0)
+    ExitWithError(1, L"Unexpected snapshot callstack \n");
+  snapWalker.AddModuleFilter(L"ntdll", StackWalkerBase::FrameDrop);
+  g_exeEntries = 0;
+  g_ntdllEntries = 0;
+  snapWalker.StackWalkerDemo::ShowCallstack(snap);
+  StackWalkerBase::FreeSnapshot(snap);
+  if (g_ntdllEntries != 0 || g_exeEntries == 0)
+    ExitWithError(1, L"Incorrect module filters of a snapshot \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test24 {
+
+const char caption[] = "Test dropping of async callstacks when the queue is full.";
+
+class BlockingWalker : public StackWalker
+{
+public:
+  HANDLE        m_release;
+  volatile LONG m_entered;
+
+  BlockingWalker() STKWLK_NOEXCEPT
+    : StackWalker(StackWalkerBase::RetrieveSymbol)
+  {
+    m_release = CreateEventW(NULL, TRUE, FALSE, NULL);
+    m_entered = 0;
+  }
+
+  ~BlockingWalker() STKWLK_NOEXCEPT
+  {
+    StopAsync(false);
+    CloseHandle(m_release);
+  }
+
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    // the first callstack blocks the only worker
+    if (InterlockedExchange(&m_entered, 1) == 0)
+      WaitForSingleObject(m_release, INFINITE);
+  }
+};
+
+int run()
+{
+  BlockingWalker sw;
+  if (!sw.StartAsync(1, 2))
+    ExitWithError(1, L"Cannot start async workers \n");
+  if (!sw.ShowCallstackAsync())
+    ExitWithError(1, L"First callstack not queued \n");
+  for (int i = 0; i < 60 * 1000 && sw.m_entered == 0; i++)
+    Sleep(1);
+  if (sw.m_entered == 0)
+    ExitWithError(1, L"The worker did not take the first callstack \n");
+  int queued = 0;
+  int dropped = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    if (sw.ShowCallstackAsync())
+      queued++;
+    else
+      dropped++;
+  }
+  if (queued != 2 || dropped != 8 || sw.GetAsyncDropCount() != dropped)
+    ExitWithError(1, L"Incorrect queue-full handling: %d queued, %d dropped, %d counted \n",
+                  queued, dropped, (int)sw.GetAsyncDropCount());
+  if (sw.FlushAsync(50))
+    ExitWithError(1, L"Flush finished while the worker is blocked \n");
+  SetEvent(sw.m_release);
+  if (!sw.FlushAsync(60 * 1000))
+    ExitWithError(1, L"Async symbolization timed out \n");
+  sw.StopAsync();
+  if (sw.ShowCallstackAsync())
+    ExitWithError(1, L"Callstack queued after StopAsync \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test25 {
+
+const char caption[] = "Test counters and timers of the internal phases.";
+
+class CountingWalker : public StackWalker
+{
+public:
+  int m_entries;
+
+  explicit CountingWalker(int options) STKWLK_NOEXCEPT
+    : StackWalker(options)
+  {
+    m_entries = 0;
+  }
+
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    m_entries++;
+  }
+};
+
+int run()
+{
+  StackWalkerBase::TStats st;
+  CountingWalker sw(StackWalker::OptionsAll | StackWalkerBase::CollectStats);
+  if (!sw.GetStats(st))
+    ExitWithError(1, L"Cannot get the statistics \n");
+  for (int i = 0; i < StackWalkerBase::StatPhasesCount; i++)
+    if (st.count[i] != 0 || st.timeNs[i] != 0)
+      ExitWithError(1, L"Phase %d counted before any callstack \n", i);
+  sw.ShowCallstack();
+  if (sw.m_entries <= 0 || !sw.GetStats(st))
+    ExitWithError(1, L"Callstack not shown \n");
+  if (st.count[StackWalkerBase::StatLoadModules] == 0 ||
+      st.count[StackWalkerBase::StatStackWalk] < (ULONGLONG)sw.m_entries ||
+      st.count[StackWalkerBase::StatSymFromAddr] == 0 ||
+      st.count[StackWalkerBase::StatGetModuleInfo] == 0 ||
+      st.count[StackWalkerBase::StatOutput] != (ULONGLONG)sw.m_entries)
+    ExitWithError(1, L"Incorrect counters of the phases \n");
+  ULONGLONG total = 0;
+  for (int i = 0; i < StackWalkerBase::StatPhasesCount; i++)
+    total += st.timeNs[i];
+  if (total == 0)
+    ExitWithError(1, L"No time measured \n");
+  sw.ResetStats();
+  sw.GetStats(st);
+  for (int i = 0; i < StackWalkerBase::StatPhasesCount; i++)
+    if (st.count[i] != 0 || st.timeNs[i] != 0)
+      ExitWithError(1, L"Phase %d not reset \n", i);
+  // without the option nothing is collected
+  CountingWalker sw2(StackWalker::OptionsAll);
+  sw2.ShowCallstack();
+  sw2.GetStats(st);
+  for (int i = 0; i < StackWalkerBase::StatPhasesCount; i++)
+    if (st.count[i] != 0)
+      ExitWithError(1, L"Phase %d counted without CollectStats \n", i);
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test26 {
+
+const char caption[] = "Test user entries of the generated symbol search path.";
+
+const WCHAR userPath[] = L"C:\\stkwlk-not-existing-dir";
+
+class PathWalker : public StackWalker
+{
+public:
+  WCHAR m_searchPath[4096];
+
+  PathWalker() STKWLK_NOEXCEPT
+    : StackWalker(StackWalker::OptionsAll)
+  {
+    m_searchPath[0] = 0;
+  }
+
+  virtual void OnSymInit(const TSymInit & data) STKWLK_NOEXCEPT
+  {
+    if (data.szSearchPath)
+      wcsncpy_s(m_searchPath, data.szSearchPath, _TRUNCATE);
+  }
+
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    // nothing
+  }
+};
+
+int run()
+{
+  WCHAR path[MAX_PATH * 2];
+  swprintf_s(path, L"%s;%s;.", userPath, userPath);
+  PathWalker sw;
+  sw.SetSymPath(path);
+  sw.ShowCallstack();
+  // the not existing directory of the user is kept verbatim, but only once
+  size_t len = wcslen(userPath);
+  if (wcsncmp(sw.m_searchPath, userPath, len) != 0 || sw.m_searchPath[len] != ';')
+    ExitWithError(1, L"User entry of the symbol path dropped \n");
+  if (wcsstr(sw.m_searchPath + len, userPath) != NULL)
+    ExitWithError(1, L"Duplicated entry in the symbol path \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test27 {
+
+const char caption[] = "Test file versions read by several threads.";
+
+class VersionWalker : public StackWalker
+{
+public:
+  struct Module
+  {
+    DWORD64  baseAddr;
+    TFileVer ver;
+  };
+  std::vector<Module> m_modules;
+
+  explicit VersionWalker(int options) STKWLK_NOEXCEPT
+    : StackWalker(options)
+  {
+    // nothing
+  }
+
+  virtual void OnLoadModule(const TLoadModule & data) STKWLK_NOEXCEPT
+  {
+    Module m;
+    m.baseAddr = data.baseAddr;
+    m.ver = data.ver;
+    m_modules.push_back(m);
+  }
+};
+
+const LPCWSTR extraDlls[] = {
+  L"advapi32.dll", L"user32.dll", L"gdi32.dll", L"ole32.dll", L"oleaut32.dll", L"shell32.dll",
+  L"shlwapi.dll", L"ws2_32.dll", L"crypt32.dll", L"rpcrt4.dll", L"winmm.dll", L"imm32.dll",
+  L"setupapi.dll", L"comdlg32.dll", L"wininet.dll", L"psapi.dll",
+};
+
+int run()
+{
+  // at least 16 modules are needed for two workers
+  for (size_t i = 0; i < _countof(extraDlls); i++)
+    LoadLibraryW(extraDlls[i]);
+  VersionWalker threaded(StackWalker::OptionsAll | StackWalkerBase::PrefetchVersions);
+  VersionWalker inplace(StackWalker::OptionsAll);
+  threaded.ShowModules();
+  inplace.ShowModules();
+  if (threaded.m_modules.size() < 16)
+    ExitWithError(1, L"Too few modules for the threaded path \n");
+  if (threaded.m_modules.size() != inplace.m_modules.size())
+    ExitWithError(1, L"Different module lists \n");
+  int versions = 0;
+  for (size_t i = 0; i < threaded.m_modules.size(); i++)
+  {
+    const VersionWalker::Module & a = threaded.m_modules[i];
+    const VersionWalker::Module & b = inplace.m_modules[i];
+    if (a.baseAddr != b.baseAddr || memcmp(&a.ver, &b.ver, sizeof(a.ver)) != 0)
+      ExitWithError(1, L"Version of the module at %p differs \n", (LPVOID)a.baseAddr);
+    if (!a.ver.isEmpty())
+      versions++;
+  }
+  if (versions == 0)
+    ExitWithError(1, L"No file versions read \n");
+  return 1;
+}
+
+} // namespace
+
+// =========================================================================================
+namespace test28 {
+
+const char caption[] = "Benchmark batch symbolization against the scalar path.";
+
+const int Samples = 1000000;
+const int Offsets = 32;     // distinct addresses per captured frame
+
+int g_entries = 0;
+
+class QuietWalker : public StackWalker
+{
+public:
+  virtual void OnCallstackEntry(const TCallstackEntry & entry) STKWLK_NOEXCEPT
+  {
+    if (entry.type != lastEntry)
+      g_entries++;
+  }
+
+  virtual void OnDbgHelpErr(const TDbgHelpErr & data) STKWLK_NOEXCEPT
+  {
+    // nothing (addresses without line info)
+  }
+};
+
+LONGLONG ElapsedTicks(const LARGE_INTEGER & start)
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return now.QuadPart - start.QuadPart;
+}
+
+int run()
+{
+  DWORD64 frames[STKWLK_MAX_RAW_FRAMES];
+  int count = StackWalkerBase::CaptureRawCallstack(frames, STKWLK_MAX_RAW_FRAMES);
+  if (count < 4)
+    ExitWithError(1, L"Raw callstack not captured \n");
+  // a profile dump: a few hundred distinct code addresses repeated up to 1M samples
+  DWORD64 * samples = (DWORD64 *)malloc(Samples * sizeof(DWORD64));
+  if (samples == NULL)
+    ExitWithError(1, L"Out of memory \n");
+  for (int i = 0; i < Samples; i++)
+    samples[i] = frames[(i / Offsets) % count] + (i % Offsets);
+
+  LARGE_INTEGER start;
+  QuietWalker sw;
+  sw.ShowRawCallstack(samples, 1);      // load the modules before the measurement
+  g_entries = 0;
+  QueryPerformanceCounter(&start);
+  bool scalarOk = sw.ShowRawCallstack(samples, Samples);    // every address is looked up
+  LONGLONG scalar = ElapsedTicks(start);
+  int scalarEntries = g_entries;
+  g_entries = 0;
+  QueryPerformanceCounter(&start);
+  bool batchOk = sw.SymbolizeBatch(samples, Samples);       // every distinct address once
+  LONGLONG batch = ElapsedTicks(start);
+  free(samples);
+  if (!scalarOk || !batchOk || scalarEntries != Samples || g_entries != Samples)
+    ExitWithError(1, L"Incorrect number of the symbolized addresses \n");
+  if (batch * 2 > scalar)
+    ExitWithError(1, L"Batch symbolization is not faster: %I64d vs %I64d ticks \n", batch, scalar);
+  return 1;
+}
+
+} // namespace
+
 // =========================================================================================
 
 int CatchEHsync()
@@ -492,6 +2216,30 @@ int wmain(int argc, WCHAR * argv[])
   RUNTEST(test2, run);
   RUNTEST(test3, run);
   RUNTEST(test4, run);
+  RUNTEST(test5, run);
+  RUNTEST(test6, run);
+  RUNTEST(test7, run);
+  RUNTEST(test8, run);
+  RUNTEST(test9, run);
+  RUNTEST(test10, run);
+  RUNTEST(test11, run);
+  RUNTEST(test12, run);
+  RUNTEST(test13, run);
+  RUNTEST(test14, run);
+  RUNTEST(test15, run);
+  RUNTEST(test16, run);
+  RUNTEST(test17, run);
+  RUNTEST(test18, run);
+  RUNTEST(test19, run);
+  RUNTEST(test20, run);
+  RUNTEST(test21, run);
+  RUNTEST(test22, run);
+  RUNTEST(test23, run);
+  RUNTEST(test24, run);
+  RUNTEST(test25, run);
+  RUNTEST(test26, run);
+  RUNTEST(test27, run);
+  RUNTEST(test28, run);
   return 0;
 }
 
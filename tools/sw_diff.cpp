@@ -0,0 +1,78 @@
+/**********************************************************************
+ *
+ * sw_diff.cpp
+ *
+ * Compares two folded stack profiles (StackWalkerFoldedStacks::Write
+ * or Merge), e.g. of the releases before and after a regression.
+ *
+ * Usage: sw_diff [-stacks | -self | -total] [-top N] [-z Z] before.folded after.folded
+ *
+ **********************************************************************/
+
+#include "StackWalker.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void Usage()
+{
+  printf("Usage: sw_diff [-stacks | -self | -total] [-top N] [-z Z] before.folded after.folded\n");
+  printf("  -stacks  compare whole callstacks\n");
+  printf("  -self    compare functions on the top of the stacks\n");
+  printf("  -total   compare functions anywhere in the stacks (default)\n");
+  printf("  -top N   show the N largest changes (default 20)\n");
+  printf("  -z Z     show only the changes with |z-score| >= Z (default 3)\n");
+}
+
+int wmain(int argc, WCHAR * argv[])
+{
+  StackWalkerFoldedStacks::DiffMode mode = StackWalkerFoldedStacks::DiffTotal;
+  int     top = 20;
+  double  minZ = 3;
+  LPCWSTR files[2] = { NULL, NULL };
+  int     nfiles = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (wcscmp(argv[i], L"-stacks") == 0)
+      mode = StackWalkerFoldedStacks::DiffStacks;
+    else if (wcscmp(argv[i], L"-self") == 0)
+      mode = StackWalkerFoldedStacks::DiffSelf;
+    else if (wcscmp(argv[i], L"-total") == 0)
+      mode = StackWalkerFoldedStacks::DiffTotal;
+    else if (wcscmp(argv[i], L"-top") == 0 && i + 1 < argc)
+      top = _wtoi(argv[++i]);
+    else if (wcscmp(argv[i], L"-z") == 0 && i + 1 < argc)
+      minZ = _wtof(argv[++i]);
+    else if (argv[i][0] != L'-' && nfiles < 2)
+      files[nfiles++] = argv[i];
+    else
+    {
+      Usage();
+      return 2;
+    }
+  }
+  if (nfiles != 2 || top <= 0)
+  {
+    Usage();
+    return 2;
+  }
+
+  StackWalkerFoldedStacks::TDiff diff;
+  if (!StackWalkerFoldedStacks::Compare(files[0], files[1], mode, top, diff, minZ))
+  {
+    fprintf(stderr, "ERROR: cannot compare the profiles (GetLastError: %u)\n", (unsigned)GetLastError());
+    return 1;
+  }
+  printf("samples: %I64u -> %I64u\n\n", diff.totalBefore, diff.totalAfter);
+  printf("%8s %8s %10s %10s  %s\n", "before%", "after%", "delta%", "z-score", "stack / function");
+  for (int i = 0; i < diff.count; i++)
+  {
+    const StackWalkerFoldedStacks::TDiffItem & item = diff.items[i];
+    printf("%8.2f %8.2f %+10.2f %10.1f  %s\n",
+           100.0 * (double)(LONGLONG)item.before / (double)(LONGLONG)diff.totalBefore,
+           100.0 * (double)(LONGLONG)item.after / (double)(LONGLONG)diff.totalAfter,
+           100.0 * item.delta, item.zScore, item.key);
+  }
+  StackWalkerFoldedStacks::FreeDiff(diff);
+  return 0;
+}